@@ -8,4 +8,4 @@ make clean
 make -j${NPROC}
 
 mkdir -p ${DESTDIR}
-cp -avp bin/server bin/client runner.sh ${DESTDIR}
\ No newline at end of file
+cp -avp bin/server bin/client bin/queuebench-* bin/microbench runner.sh ${DESTDIR}
\ No newline at end of file
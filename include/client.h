@@ -3,13 +3,38 @@
 
 #include <time.h>
 #include <pthread.h>
+#include <sys/uio.h>
 
 #include "rpc.h"
 #include "utils.h"
 #include "thread.h"
+#include "histogram.h"
 
 #define MAX_CLIENT_THREADS 128
 #define MAX_PATH_LEN	128
+#define ARRIVAL_NAME_LEN	16
+
+#define ARRIVAL_CONSTANT	0
+#define ARRIVAL_POISSON		1
+
+#define WORKLOAD_NAME_LEN	16
+#define WORKLOAD_COMPUTE	0
+#define WORKLOAD_KV		1
+
+#define KEY_DIST_NAME_LEN	16
+#define KEY_DIST_UNIFORM	0
+#define KEY_DIST_ZIPF		1
+
+#define PAYLOAD_DIST_NAME_LEN	16
+#define PAYLOAD_FIXED		0
+#define PAYLOAD_UNIFORM		1
+#define PAYLOAD_BIMODAL		2
+#define PAYLOAD_TRACE		3
+
+// Most requests written with one writev, see send_batch
+#define CLIENT_SEND_BATCH_MAX	64
+// Room for a request header and a PUT value, the rest of a payload is zeros
+#define CLIENT_REQ_HEAD_LEN	(sizeof (struct request_t) + KV_VALUE_LEN)
 
 struct client_config_t {
 	char server_path[MAX_PATH_LEN];
@@ -17,6 +42,22 @@ struct client_config_t {
 	unsigned int nr_connections; // per thread
 	unsigned int nr_requests; // per connection
 	int duration;
+	unsigned int latency_window; // send timestamps kept per connection
+	unsigned int rate; // aggregate requests/sec, 0 for closed loop
+	char arrival[ARRIVAL_NAME_LEN];
+	char workload[WORKLOAD_NAME_LEN];
+	unsigned int keys; // kv: key space, matches the server's kv.keys
+	char key_dist[KEY_DIST_NAME_LEN];
+	unsigned int zipf_theta; // in 1/100
+	unsigned int read_pct; // kv: share of GETs
+	char payload_dist[PAYLOAD_DIST_NAME_LEN];
+	unsigned int payload_size; // fixed size, uniform maximum, bimodal large mode
+	unsigned int payload_min; // uniform minimum, bimodal small mode
+	unsigned int payload_large_pct; // bimodal: share of large payloads
+	char payload_trace[MAX_PATH_LEN]; // trace: one size per line, replayed in order
+	unsigned int send_batch; // requests per writev, 1 to send them one by one
+	unsigned int recv_size; // bytes per recv, 0 to read response by response
+	unsigned int max_inflight; // requests sent but not answered per connection, 0 for no limit
 };
 
 struct client_status_t {
@@ -25,6 +66,14 @@ struct client_status_t {
 	unsigned long sent;
 	unsigned long received;
 	unsigned long total;
+	unsigned long unmatched; // responses whose send time was overwritten
+	unsigned long failed; // responses with a status other than RPC_STATUS_OK
+};
+
+/* Send time of an in-flight request, found again by its id */
+struct client_send_ts_t {
+	unsigned int id;
+	uint64_t ns;
 };
 
 #define CONN_OPEN 1
@@ -33,15 +82,29 @@ struct client_status_t {
 struct client_connection_t {
 	int state;
 	int fd;
+	int events; // registered with epoll, see epoll_set_conn()
 	struct {
-		struct request_t msg;
+		struct request_t *msg; // room for the largest payload
 		int left;
 	} sendbuf;
+	struct {
+		unsigned char *heads; // send_batch request heads, CLIENT_REQ_HEAD_LEN apart
+		struct iovec iov[2 * CLIENT_SEND_BATCH_MAX];
+		unsigned int nr; // requests in the batch
+		unsigned int iov_nr;
+		unsigned int iov_pos; // first iovec not fully written
+	} sendv;
 	struct {
 		struct response_t msg;
 		int left;
+		int framed;
+		unsigned char *bulk; // recv_size bytes read ahead, see client_conn_recv()
+		unsigned int head;
+		unsigned int tail;
 	} recvbuf;
 	struct client_status_t status;
+	struct client_send_ts_t *send_ts; // latency_window entries, by id
+	uint64_t next_send_ns; // open loop: when the next request is due
 };
 
 struct client_thread_t {
@@ -49,6 +112,32 @@ struct client_thread_t {
 	struct thread_info_t *ti;
 	struct client_context_t *ctx;
 	struct client_connection_t *conns;
+	struct hist_t latency; // send to receive, nsec
+	uint64_t rng;
+	unsigned long trace_pos;
+};
+
+/*
+ * Key generator for the kv workload. Zipf keys follow Gray et al.'s
+ * method as used by YCSB, with zeta(n) computed once at startup.
+ */
+struct client_keys_t {
+	int dist;
+	unsigned long n;
+	double theta;
+	double zetan;
+	double alpha;
+	double eta;
+	double half_pow_theta;
+};
+
+/* Request payload sizes, see client_payload_len() */
+struct client_payload_t {
+	int dist;
+	unsigned int max; // largest size the distribution produces
+	unsigned int *trace;
+	unsigned long trace_len;
+	unsigned char *zeros; // max bytes of batched payload
 };
 
 struct client_context_t {
@@ -57,6 +146,11 @@ struct client_context_t {
 	struct client_thread_t client_threads[MAX_CLIENT_THREADS];
 	struct barrier_t start_barrier;
 	uint64_t deadline;
+	int arrival;
+	double interval_ns; // open loop: mean gap between requests of a connection
+	int workload;
+	struct client_keys_t keys;
+	struct client_payload_t payload;
 };
 
 void *client_worker(
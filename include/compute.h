@@ -0,0 +1,26 @@
+#ifndef __BENCHMARK_COMPUTE_H
+#define __BENCHMARK_COMPUTE_H
+
+#include "rpc.h"
+
+#define COMPUTE_KERNEL_NAME_LEN	16
+
+/*
+ * A compute workload. One iteration processes every request of a batch
+ * once and leaves a digest of the work in its response. setup() prepares
+ * shared state and cleanup() releases it, both are optional. Kernels
+ * other than the selected one are set up only for their calibration.
+ */
+struct compute_kernel_t {
+	const char *name;
+	const char *desc;
+	int (*setup)(void);
+	void (*cleanup)(void);
+	void (*run)(struct request_t *reqs[], struct response_t *res[], unsigned int n);
+};
+
+const struct compute_kernel_t *compute_kernel_find(const char *name);
+/* The i-th registered kernel, NULL past the last one */
+const struct compute_kernel_t *compute_kernel_at(unsigned int i);
+
+#endif // __BENCHMARK_COMPUTE_H
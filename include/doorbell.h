@@ -0,0 +1,90 @@
+#ifndef __BENCHMARK_DOORBELL_H
+#define __BENCHMARK_DOORBELL_H
+
+#include "queue.h"
+
+#define DOORBELL_AWAKE	0
+#define DOORBELL_PARKED	1
+
+#define DOORBELL_PARK_MSEC	100
+
+/*
+ * Futex doorbell for a single consumer. The consumer spins on its queue for
+ * `spin` empty polls, then announces it is parked and sleeps on the futex;
+ * producers ring it after queue_put(). A ring costs one fence and a shared
+ * load while the consumer is awake.
+ */
+struct doorbell_t {
+	int state;
+	int enabled;
+
+	// Owned by the consumer
+	unsigned long parks __attribute__((aligned(64)));
+	unsigned long wakeups;
+	unsigned long park_ns;
+} __attribute__((aligned(64)));
+
+void doorbell_wait(struct doorbell_t *db);
+void doorbell_wake(struct doorbell_t *db);
+
+static inline void doorbell_init(struct doorbell_t *db, unsigned int spin) {
+	db->state = DOORBELL_AWAKE;
+	db->enabled = spin != 0;
+	db->parks = db->wakeups = db->park_ns = 0;
+}
+
+static inline void doorbell_ring(struct doorbell_t *db) {
+	if (!db->enabled)
+		return;
+	// Pairs with the store in doorbell_queue_get_batch(): publish, then check
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&db->state, __ATOMIC_RELAXED) == DOORBELL_PARKED)
+		doorbell_wake(db);
+}
+
+/*
+ * For consumers that steal from each other's queues: ring dbs[idx], or if
+ * that consumer is awake, the first parked one after it, which would only
+ * notice the work when its park times out otherwise.
+ */
+static inline void doorbell_ring_group(struct doorbell_t dbs[], unsigned int n, unsigned int idx) {
+	if (!dbs[idx].enabled)
+		return;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (unsigned int i = 0; i < n; i++) {
+		struct doorbell_t *db = &dbs[(idx + i) % n];
+		if (__atomic_load_n(&db->state, __ATOMIC_RELAXED) == DOORBELL_PARKED) {
+			doorbell_wake(db);
+			return;
+		}
+	}
+}
+
+static inline unsigned int doorbell_queue_get_batch(
+	struct queue_root *queue,
+	struct doorbell_t *db,
+	unsigned int spin,
+	unsigned int *idle,
+	struct queue_head **out,
+	unsigned int max
+) {
+	unsigned int n = queue_get_batch(queue, out, max);
+	if (n || !spin) {
+		*idle = 0;
+		return n;
+	}
+	if (++*idle < spin)
+		return 0;
+	*idle = 0;
+
+	__atomic_store_n(&db->state, DOORBELL_PARKED, __ATOMIC_SEQ_CST);
+	n = queue_get_batch(queue, out, max);
+	if (n) {
+		__atomic_store_n(&db->state, DOORBELL_AWAKE, __ATOMIC_RELAXED);
+		return n;
+	}
+	doorbell_wait(db);
+	return 0;
+}
+
+#endif // __BENCHMARK_DOORBELL_H
@@ -0,0 +1,71 @@
+#ifndef __BENCHMARK_EXECUTOR_H
+#define __BENCHMARK_EXECUTOR_H
+
+#include "doorbell.h"
+
+/*
+ * Exception-less syscalls, FlexSC style. With --io.syscalls=executor the
+ * Z_ layer makes no recv, send, sendmsg or epoll_ctl itself: the calling
+ * thread writes the call into a free entry of its own page, flags the
+ * entry and the page as posted and rings the executor. A dedicated
+ * executor thread, in kerncall if kerncall.executor is set, takes the
+ * posted flags and makes only those calls, in bulk.
+ *
+ * Posting does not wait. Z_syscall_post() hands over a batch and returns,
+ * Z_syscall_reap() collects it later, so the IO loop keeps receiving while
+ * its sends are made. A caller that does need a result spins on it for
+ * io.executor_spin polls, then sleeps on the entry.
+ */
+#define EXEC_ENTRIES		64	// per thread, one bit each in posted
+#define EXEC_MAX_THREADS	64	// one bit each in active
+#define EXEC_SPIN_DEFAULT	1000	// io.executor_spin with several CPUs
+
+#define EXEC_FREE	0
+#define EXEC_SUBMITTED	1
+#define EXEC_WAITING	2	// submitted, and the caller sleeps on state
+#define EXEC_DONE	3
+
+struct exec_entry_t {
+	int state;
+	long nr;
+	long args[6];
+	long ret;	// result or -errno
+} __attribute__((aligned(64)));
+
+struct exec_page_t {
+	// Entries posted and not taken by the executor yet
+	unsigned long posted;
+	// Owned by the thread: entries in use, posted or waiting to be reaped
+	unsigned long used __attribute__((aligned(64)));
+	unsigned int idx;
+	struct exec_entry_t entries[EXEC_ENTRIES];
+};
+
+struct syscall_executor_t {
+	int enabled;
+	int stop;
+	unsigned int spin;
+	// Pages with posted entries
+	unsigned long active;
+	struct doorbell_t db;
+	// Pages in registration order, a slot stays NULL until its page is set up
+	struct exec_page_t *pages[EXEC_MAX_THREADS];
+	unsigned int nr_pages;
+
+	// Owned by the executor
+	unsigned long executed __attribute__((aligned(64)));
+	unsigned long sweeps;
+} __attribute__((aligned(64)));
+
+extern struct syscall_executor_t syscall_executor;
+
+static inline int syscall_exec_routed(void) {
+	return __builtin_expect(__atomic_load_n(&syscall_executor.enabled, __ATOMIC_RELAXED), 0);
+}
+
+/* Set up the calling thread's page if the executor is on, at thread start */
+int syscall_exec_register(void);
+/* Post one call to the executor and wait for it, returns like a syscall */
+long syscall_exec(long nr, long a1, long a2, long a3, long a4, long a5, long a6);
+
+#endif // __BENCHMARK_EXECUTOR_H
@@ -0,0 +1,60 @@
+#ifndef __BENCHMARK_HISTOGRAM_H
+#define __BENCHMARK_HISTOGRAM_H
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Log-linear (HDR-style) histogram over the full 64-bit range. Values below
+ * 2 * HIST_SUB are exact; above that every power of two is split into
+ * HIST_SUB linear sub-buckets, i.e. about 3% relative precision. Recording
+ * is a clz, a shift and an increment, cheap enough for every request.
+ */
+#define HIST_SUB_BITS	5
+#define HIST_SUB	(1UL << HIST_SUB_BITS)
+#define HIST_BUCKETS	((65 - HIST_SUB_BITS) * HIST_SUB)
+
+struct hist_t {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t min;
+	uint64_t max;
+	uint64_t buckets[HIST_BUCKETS];
+};
+
+static inline void hist_init(struct hist_t *h) {
+	memset(h, 0, sizeof (*h));
+	h->min = UINT64_MAX;
+}
+
+static inline unsigned int hist_index(uint64_t v) {
+	if (v < HIST_SUB)
+		return v;
+	unsigned int e = 63 - __builtin_clzl(v) - HIST_SUB_BITS;
+	return e * HIST_SUB + (v >> e);
+}
+
+/* Lowest value that falls into bucket idx */
+static inline uint64_t hist_bucket_value(unsigned int idx) {
+	if (idx < 2 * HIST_SUB)
+		return idx;
+	unsigned int e = idx / HIST_SUB - 1;
+	return (idx % HIST_SUB + HIST_SUB) << e;
+}
+
+static inline void hist_record(struct hist_t *h, uint64_t v) {
+	h->buckets[hist_index(v)]++;
+	h->count++;
+	h->sum += v;
+	if (v < h->min)
+		h->min = v;
+	if (v > h->max)
+		h->max = v;
+}
+
+void hist_merge(struct hist_t *dst, const struct hist_t *src);
+uint64_t hist_percentile(const struct hist_t *h, double p);
+/* Print count, mean, percentiles and max, each value multiplied by scale */
+void hist_print(const char *name, const struct hist_t *h, double scale, const char *unit);
+
+#endif // __BENCHMARK_HISTOGRAM_H
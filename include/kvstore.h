@@ -0,0 +1,49 @@
+#ifndef __BENCHMARK_KVSTORE_H
+#define __BENCHMARK_KVSTORE_H
+
+#include <stdint.h>
+
+#include "rpc.h"
+
+#define KV_VALUE_WORDS	(KV_VALUE_LEN / 8)
+
+#define KV_SLOT_FREE	0
+#define KV_SLOT_BUSY	1	// claimed, key not published yet
+#define KV_SLOT_USED	2
+
+// Slots when neither kv.slots nor kv.keys size the table
+#define KV_DEFAULT_SLOTS	(2UL << 20)
+
+/*
+ * Open addressing slot. Keys are never removed, so a slot goes from free
+ * to used exactly once. The value is guarded by a sequence lock: writers
+ * hold seq odd while they store, readers retry if it moved under them.
+ */
+struct kv_slot_t {
+	uint64_t key;
+	unsigned int state;
+	unsigned int seq;
+	uint64_t value[KV_VALUE_WORDS];
+} __attribute__((aligned(32)));
+
+/*
+ * Fixed-size concurrent hash table with linear probing, shared by all
+ * threads running requests. The slots are mapped untouched, so memory is
+ * only taken as keys come in. Unless the table was preloaded, a GET of a
+ * missing key inserts kv_value_of() for it, otherwise GETs never write to
+ * shared memory.
+ */
+struct kv_store_t {
+	struct kv_slot_t *slots;
+	size_t slots_len;
+	uint64_t mask;
+	int on_demand;
+	unsigned long nr_keys;
+};
+
+struct kv_store_t *kv_create(unsigned long nr_slots, unsigned long preload);
+void kv_destroy(struct kv_store_t *kv);
+int kv_get(struct kv_store_t *kv, uint64_t key, unsigned char value[KV_VALUE_LEN]);
+int kv_put(struct kv_store_t *kv, uint64_t key, const unsigned char value[KV_VALUE_LEN]);
+
+#endif // __BENCHMARK_KVSTORE_H
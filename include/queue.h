@@ -16,43 +16,250 @@
 
 #define QUEUE_POISON1 ((struct queue_head *)0xCAFEBAB5)
 
+#define QUEUE_CACHELINE 64
+#define QUEUE_DEFAULT_SIZE 4096
+
 
 struct queue_head {
 	struct queue_head *next;
 };
 
+static inline void queue_head_init(struct queue_head *head)
+{
+	head->next = QUEUE_POISON1;
+}
+
+#ifdef QUEUE_LOCKFREE
+
+/*
+ * Bounded MPMC ring (Vyukov). Every cell carries a sequence number telling
+ * producers and consumers whose turn it is, so put/get claim a slot with a
+ * single CAS on their own position counter. The counters live on separate
+ * cache lines to keep producers and consumers from false sharing.
+ *
+ * The ring never grows: callers size it for the maximum number of elements
+ * it may hold. queue_put() on a full ring yields until a slot frees up.
+ */
+
+struct queue_cell {
+	unsigned long seq;
+	struct queue_head *node;
+};
+
+struct queue_root {
+	struct queue_cell *cells;
+	unsigned long mask;
+
+	unsigned long enqueue_pos __attribute__((aligned(QUEUE_CACHELINE)));
+	unsigned long dequeue_pos __attribute__((aligned(QUEUE_CACHELINE)));
+} __attribute__((aligned(QUEUE_CACHELINE)));
+
+static inline unsigned long queue_roundup_size(unsigned long size)
+{
+	unsigned long n = 4;
+	while (n < size)
+		n <<= 1;
+	return n;
+}
+
+static inline int init_queue_root_sized(struct queue_root *root, unsigned long size)
+{
+	unsigned long n = queue_roundup_size(size);
+	root->cells = aligned_alloc(QUEUE_CACHELINE, n * sizeof (struct queue_cell));
+	if (!root->cells)
+		return -1;
+	for (unsigned long i = 0; i < n; i++) {
+		root->cells[i].seq = i;
+		root->cells[i].node = NULL;
+	}
+	root->mask = n - 1;
+	root->enqueue_pos = 0;
+	root->dequeue_pos = 0;
+	return 0;
+}
+
+static inline void fini_queue_root(struct queue_root *root)
+{
+	free(root->cells);
+	root->cells = NULL;
+}
+
+static inline void queue_put(struct queue_head *new_, struct queue_root *root)
+{
+	struct queue_cell *cell;
+	unsigned long pos = __atomic_load_n(&root->enqueue_pos, __ATOMIC_RELAXED);
+
+	queue_head_init(new_);
+	while (1) {
+		cell = &root->cells[pos & root->mask];
+		unsigned long seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		long dif = (long) seq - (long) pos;
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&root->enqueue_pos, &pos, pos + 1, 1,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else {
+			if (dif < 0)
+				sched_yield();
+			pos = __atomic_load_n(&root->enqueue_pos, __ATOMIC_RELAXED);
+		}
+	}
+	cell->node = new_;
+	__atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+static inline struct queue_head *queue_get(struct queue_root *root)
+{
+	struct queue_cell *cell;
+	unsigned long pos = __atomic_load_n(&root->dequeue_pos, __ATOMIC_RELAXED);
+
+	while (1) {
+		cell = &root->cells[pos & root->mask];
+		unsigned long seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+		long dif = (long) seq - (long) (pos + 1);
+		if (dif == 0) {
+			if (__atomic_compare_exchange_n(&root->dequeue_pos, &pos, pos + 1, 1,
+							__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0) {
+			return NULL;
+		} else {
+			pos = __atomic_load_n(&root->dequeue_pos, __ATOMIC_RELAXED);
+		}
+	}
+	struct queue_head *head = cell->node;
+	__atomic_store_n(&cell->seq, pos + root->mask + 1, __ATOMIC_RELEASE);
+	return head;
+}
+
+/*
+ * Claim up to max consecutive filled cells with a single CAS on
+ * dequeue_pos, then hand them back to producers one by one.
+ */
+static inline unsigned int queue_get_batch(struct queue_root *root, struct queue_head **out, unsigned int max)
+{
+	unsigned long pos = __atomic_load_n(&root->dequeue_pos, __ATOMIC_RELAXED);
+	unsigned int n;
+
+	while (1) {
+		for (n = 0; n < max; n++) {
+			struct queue_cell *cell = &root->cells[(pos + n) & root->mask];
+			unsigned long seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+			if (seq != pos + n + 1)
+				break;
+		}
+		if (!n) {
+			unsigned long cur = __atomic_load_n(&root->dequeue_pos, __ATOMIC_RELAXED);
+			if (cur == pos)
+				return 0;
+			pos = cur;
+			continue;
+		}
+		if (__atomic_compare_exchange_n(&root->dequeue_pos, &pos, pos + n, 1,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			break;
+	}
+	for (unsigned int i = 0; i < n; i++) {
+		struct queue_cell *cell = &root->cells[(pos + i) & root->mask];
+		out[i] = cell->node;
+		__atomic_store_n(&cell->seq, pos + i + root->mask + 1, __ATOMIC_RELEASE);
+	}
+	return n;
+}
+
+/* Elements in the ring right now; racy, for statistics only */
+static inline unsigned long queue_depth(struct queue_root *root)
+{
+	unsigned long deq = __atomic_load_n(&root->dequeue_pos, __ATOMIC_RELAXED);
+	unsigned long enq = __atomic_load_n(&root->enqueue_pos, __ATOMIC_RELAXED);
+	return (long) (enq - deq) > 0 ? enq - deq : 0;
+}
+
+/*
+ * Splice a chain of n elements linked through ->next, first to last. The
+ * whole run of cells is claimed with one CAS, retried while other
+ * producers move enqueue_pos; only when fewer than n cells are free do
+ * the elements go in one at a time.
+ */
+static inline void queue_put_list(struct queue_head *first, struct queue_head *last, unsigned long n, struct queue_root *root)
+{
+	unsigned long pos = __atomic_load_n(&root->enqueue_pos, __ATOMIC_RELAXED);
+	while (n <= root->mask + 1) {
+		unsigned long i;
+		long dif = 0;
+		for (i = 0; i < n; i++) {
+			struct queue_cell *cell = &root->cells[(pos + i) & root->mask];
+			unsigned long seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+			dif = (long) seq - (long) (pos + i);
+			if (dif)
+				break;
+		}
+		if (i < n) {
+			// Full: the consumer has not handed the cell back yet
+			if (dif < 0)
+				break;
+			// Another producer claimed it, start over behind them
+			pos = __atomic_load_n(&root->enqueue_pos, __ATOMIC_RELAXED);
+			continue;
+		}
+		if (__atomic_compare_exchange_n(&root->enqueue_pos, &pos, pos + n, 1,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			struct queue_head *q = first;
+			for (i = 0; i < n; i++) {
+				struct queue_cell *cell = &root->cells[(pos + i) & root->mask];
+				struct queue_head *next = q->next;
+				queue_head_init(q);
+				cell->node = q;
+				__atomic_store_n(&cell->seq, pos + i + 1, __ATOMIC_RELEASE);
+				q = next;
+			}
+			return;
+		}
+	}
+
+	while (1) {
+		struct queue_head *next = first->next;
+		queue_put(first, root);
+		if (first == last)
+			break;
+		first = next;
+	}
+}
+
+#else // QUEUE_LOCKFREE
 
+/*
+ * puts and gets count every node that goes through, the divider included,
+ * so their difference is the number of elements while the divider is in.
+ */
 struct queue_root {
 	struct queue_head *head;
 	lock_t head_lock;
+	unsigned long gets;
 
 	struct queue_head *tail;
 	lock_t tail_lock;
+	unsigned long puts;
 
 	struct queue_head divider;
 };
 
-static inline void init_queue_root(struct queue_root *root) {
+static inline int init_queue_root_sized(struct queue_root *root, unsigned long size)
+{
+	(void) size; // unbounded
 	lock_init(&root->head_lock);
 	lock_init(&root->tail_lock);
 
 	root->divider.next = NULL;
 	root->head = &root->divider;
 	root->tail = &root->divider;
+	root->gets = root->puts = 0;
+	return 0;
 }
 
-static inline struct queue_root *alloc_queue_root()
+static inline void fini_queue_root(struct queue_root *root)
 {
-	struct queue_root *root = (struct queue_root *) malloc(sizeof(struct queue_root));
-	init_queue_root(root);
-	return root;
-}
-
-
-
-static inline void queue_head_init(struct queue_head *head)
-{
-	head->next = QUEUE_POISON1;
+	(void) root;
 }
 
 static inline void queue_put(struct queue_head *new_, struct queue_root *root)
@@ -63,6 +270,7 @@ static inline void queue_put(struct queue_head *new_, struct queue_root *root)
 	lock(&root->tail_lock);
 	root->tail->next = new_;
 	root->tail = new_;
+	root->puts++;
 	unlock(&root->tail_lock);
 }
 
@@ -79,6 +287,7 @@ static inline struct queue_head *queue_get(struct queue_root *root)
 			return NULL;
 		}
 		root->head = next;
+		root->gets++;
 		unlock(&root->head_lock);
 
 		if (head == &root->divider) {
@@ -91,5 +300,87 @@ static inline struct queue_head *queue_get(struct queue_root *root)
 	}
 }
 
+static inline unsigned int queue_get_batch(struct queue_root *root, struct queue_head **out, unsigned int max)
+{
+	struct queue_head *head, *next;
+	unsigned int n = 0;
+	int divider;
+
+	do {
+		divider = 0;
+		lock(&root->head_lock);
+		while (n < max) {
+			head = root->head;
+			next = head->next;
+			if (next == NULL)
+				break;
+			root->head = next;
+			root->gets++;
+			if (head == &root->divider) {
+				divider = 1;
+				continue;
+			}
+			head->next = QUEUE_POISON1;
+			out[n++] = head;
+		}
+		unlock(&root->head_lock);
+
+		// Same as queue_get(): the last element can only leave once
+		// the divider is behind it
+		if (divider)
+			queue_put(&root->divider, root);
+	} while (divider && !n);
+	return n;
+}
+
+/* Splice a chain of n elements linked through ->next, first to last, under one lock */
+static inline void queue_put_list(struct queue_head *first, struct queue_head *last, unsigned long n, struct queue_root *root)
+{
+	last->next = NULL;
+
+	lock(&root->tail_lock);
+	root->tail->next = first;
+	root->tail = last;
+	root->puts += n;
+	unlock(&root->tail_lock);
+}
+
+/* Elements in the queue right now; racy, for statistics only */
+static inline unsigned long queue_depth(struct queue_root *root)
+{
+	unsigned long gets = __atomic_load_n(&root->gets, __ATOMIC_RELAXED);
+	unsigned long puts = __atomic_load_n(&root->puts, __ATOMIC_RELAXED);
+	return (long) (puts - gets) > 0 ? puts - gets : 0;
+}
+
+#endif // QUEUE_LOCKFREE
+
+static inline int init_queue_root(struct queue_root *root) {
+	return init_queue_root_sized(root, QUEUE_DEFAULT_SIZE);
+}
+
+static inline struct queue_root *alloc_queue_root_sized(unsigned long size)
+{
+	struct queue_root *root = (struct queue_root *) aligned_alloc(QUEUE_CACHELINE, sizeof(struct queue_root));
+	if (!root)
+		return NULL;
+	if (init_queue_root_sized(root, size)) {
+		free(root);
+		return NULL;
+	}
+	return root;
+}
+
+static inline struct queue_root *alloc_queue_root()
+{
+	return alloc_queue_root_sized(QUEUE_DEFAULT_SIZE);
+}
+
+static inline void free_queue_root(struct queue_root *root)
+{
+	fini_queue_root(root);
+	free(root);
+}
+
 
 #endif // _QUEUE
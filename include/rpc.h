@@ -1,28 +1,70 @@
 #ifndef __BENCHMARK_RPC_H
 #define __BENCHMARK_RPC_H
 
+#include <stddef.h>
+#include <stdint.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <openssl/sha.h>
 
 #include "queue.h"
 
-#define REQUEST_LENGTH 1020
+// Default payload, a 1024 byte request on the wire
+#define REQUEST_LENGTH 1000
+// Largest payload that fits the biggest server buffer class
+#define REQUEST_MAX_LENGTH (65536 - sizeof (struct request_t))
+// Largest COMPUTE payload, streamed ones need no buffer of their own
+#define REQUEST_STREAM_MAX_LENGTH (16U << 20)
 
+/* Request opcodes */
+#define RPC_OP_COMPUTE	0	// run the compute kernel over data
+#define RPC_OP_GET	1	// value of key
+#define RPC_OP_PUT	2	// store the first KV_VALUE_LEN bytes of data under key
+
+/* Response status */
+#define RPC_STATUS_OK		0
+#define RPC_STATUS_NOTFOUND	1
+#define RPC_STATUS_FULL		2	// PUT of a new key into a full store
+#define RPC_STATUS_BADOP	3
+
+#define KV_VALUE_LEN	16
+
+/*
+ * Messages are length-prefixed: a fixed header whose len gives the number
+ * of payload bytes following it on the wire. flags are zero on the wire,
+ * the server keeps REQUEST_F_* there while it handles the request.
+ */
 struct request_t {
 	unsigned int id;
-	unsigned char data[REQUEST_LENGTH];
+	unsigned int op;
+	uint64_t key;
+	unsigned int len;
+	unsigned int flags;
+	unsigned char data[];
 };
 
+/* The payload was hashed while it arrived, the digest is in the response */
+#define REQUEST_F_STREAMED	0x1
+
+/* A digest for COMPUTE, the value for a successful GET, nothing otherwise */
 struct response_t {
 	unsigned int id;
-	unsigned char sha[SHA_DIGEST_LENGTH];
+	unsigned int status;
+	unsigned int len;
+	union {
+		unsigned char sha[SHA_DIGEST_LENGTH];
+		unsigned char value[KV_VALUE_LEN];
+	};
 };
 
-struct message_t {
-	struct request_t req;
-	struct response_t res;
-};
+#define RESPONSE_HDR_LEN	offsetof(struct response_t, sha)
+#define RESPONSE_MAX_LENGTH	(sizeof (struct response_t) - RESPONSE_HDR_LEN)
+
+/* Value a key is preloaded with, and that the client PUTs back */
+static inline void kv_value_of(uint64_t key, unsigned char value[KV_VALUE_LEN]) {
+	uint64_t words[2] = { key, ~key };
+	__builtin_memcpy(value, words, KV_VALUE_LEN);
+}
 
 
 #endif // __BENCHMARK_RPC_H
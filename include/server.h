@@ -4,9 +4,41 @@
 #include "rpc.h"
 #include "thread.h"
 #include "queue.h"
+#include "doorbell.h"
+#include "histogram.h"
+#include "utils.h"
+#include "sha1.h"
+#include "compute.h"
+#include "kvstore.h"
 
 #define SERVER_MAX_THREADS 128
 #define MAX_PATH_LEN	128
+#define IO_ENGINE_NAME_LEN	16
+
+#define IO_ENGINE_EPOLL	0
+#define IO_ENGINE_URING	1
+
+#define IO_SYSCALLS_NAME_LEN	16
+
+#define SERVER_MODE_NAME_LEN	16
+#define SERVER_MODE_STAGED	0
+#define SERVER_MODE_RTC		1
+
+#define SERVER_BATCH_MAX	64
+
+// Most responses coalesced into one send, see load.send_iov
+#define SERVER_SEND_IOV_MAX	64
+
+#define COMPUTE_MODE_NAME_LEN	16
+#define LOAD_WORKLOAD_NAME_LEN	16
+
+/*
+ * Buffers come in size classes of 256 bytes to 64KB, each four times the
+ * previous one, counted in request bytes including the header.
+ */
+#define BUFFER_CLASSES		5
+#define BUFFER_CLASS_MIN	256
+#define BUFFER_CLASS_MIN_NR	256
 
 #define _KERNCALL_COND(cfg, local)					\
 	(cfg.kerncall.global || cfg.kerncall.local)
@@ -15,32 +47,63 @@
 
 struct server_config_t {
 	char socket_path[MAX_PATH_LEN];
+	char stats_path[MAX_PATH_LEN];
+	char mode[SERVER_MODE_NAME_LEN];
+	unsigned int trace;
+	unsigned int syscall_stats;
 	struct {
-		unsigned int compute_dur; // in usec
+		unsigned int compute_dur; // in nsec
+		char compute_mode[COMPUTE_MODE_NAME_LEN];
+		char workload[LOAD_WORKLOAD_NAME_LEN];
+		char kernel[COMPUTE_KERNEL_NAME_LEN];
 		unsigned int max_io_size;
+		unsigned int max_payload;
+		unsigned int payload;
 		unsigned int readahead;
+		char sha[SHA1_NAME_LEN];
+		unsigned int stream;
+		unsigned int stream_window;
+		unsigned int recv_ring;
+		unsigned int send_iov;
+		unsigned int send_delay;
 	} load;
+	struct {
+		unsigned int keys;
+		unsigned int slots;
+	} kv;
+	struct {
+		char engine[IO_ENGINE_NAME_LEN];
+		unsigned int uring_entries;
+		unsigned int uring_bufs;
+		unsigned int send_batch;
+		char syscalls[IO_SYSCALLS_NAME_LEN];
+		unsigned int executor_spin;
+	} io;
 	struct {
 		unsigned int io;
 		unsigned int accept;
 		unsigned int submit;
 		unsigned int compute;
+		unsigned int steal;
+		unsigned int spin;
+		unsigned int batch;
 	} threads;
 	struct {
 		unsigned int sessions;
 		unsigned int buffers;
+		unsigned int buffer_cache;
 	} alloc;
 	struct {
 		unsigned int global;
 		unsigned int io;
 		unsigned int accept;
 		unsigned int submit;
+		unsigned int executor;
 	} kerncall;
 };
 
 struct server_queues_t {
 	struct queue_root *empty_connections;
-	struct queue_root *empty_buffers;
 	struct queue_root *compute_inbox[SERVER_MAX_THREADS];
 	struct queue_root *submitter_inbox[SERVER_MAX_THREADS];
 };
@@ -50,30 +113,162 @@ struct server_threads_t {
 	struct thread_group_t *submit;
 	struct thread_group_t *io;
 	struct thread_group_t *accept;
+	struct thread_info_t *stats;
+	struct thread_info_t *executor;
 };
 
+struct server_uring_t;
+
 struct server_io_t {
 	int listen_fd;
+	int stats_fd;
+	int engine;
 	size_t nr_io;
 	int epoll_fds[SERVER_MAX_THREADS];
+	struct server_uring_t *urings[SERVER_MAX_THREADS];
+	// Connections with received bytes left to slice, see handle_request_ring()
+	struct server_connection_t *ring_pending[SERVER_MAX_THREADS];
+	// Connections holding a short batch back, see handle_response_delayed()
+	struct server_connection_t *send_delayed[SERVER_MAX_THREADS];
+	uint64_t send_delay;	// load.send_delay in TSC ticks
 	int next;
 };
 
+/*
+ * Preallocated buffers of one size class, carved out of a single slab so
+ * that it can be registered with io_uring. size is the request capacity.
+ */
+struct buffer_pool_t {
+	unsigned int size;
+	unsigned int nr;
+	size_t stride;
+	void *slab;
+	struct queue_root *empty;
+};
+
+/*
+ * Per-thread magazine of empty buffers in front of a pool. Only the owning
+ * thread touches it; the pool is hit once per size/2 buffers on refill or
+ * flush.
+ */
+struct buffer_magazine_t {
+	unsigned int nr;
+	unsigned int size;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long flushes;
+	struct server_buffer_t **bufs;
+};
+
+struct buffer_cache_t {
+	struct buffer_magazine_t mags[BUFFER_CLASSES];
+} __attribute__((aligned(64)));
+
+/*
+ * Per-thread counters, each written by its own thread only and read at
+ * any time by the stats socket, see stats_worker().
+ */
+struct compute_stats_t {
+	unsigned long executed;
+	unsigned long stolen;
+	unsigned long batches;
+	unsigned long loops;
+} __attribute__((aligned(64)));
+
+struct io_stats_t {
+	unsigned long received;		// requests handed on to compute
+	unsigned long sends;		// send syscalls that wrote responses
+	unsigned long responses;	// responses they completed
+	unsigned long loops;
+} __attribute__((aligned(64)));
+
+struct submit_stats_t {
+	unsigned long submitted;
+	unsigned long loops;
+} __attribute__((aligned(64)));
+
+/* Points in the pipeline a request is stamped at, see trace_stamp() */
+enum trace_point_t {
+	TRACE_RECV,		// fully received by the IO thread
+	TRACE_COMPUTE_START,	// taken off compute_inbox
+	TRACE_COMPUTE_DONE,
+	TRACE_SUBMIT,		// put on conn->send_queue
+	TRACE_SENT,		// response fully written
+	TRACE_POINTS,
+};
+
+/* Time spent between consecutive trace points, plus end to end */
+enum trace_stage_t {
+	TRACE_STAGE_INBOX,
+	TRACE_STAGE_COMPUTE,
+	TRACE_STAGE_SUBMIT,
+	TRACE_STAGE_SEND,
+	TRACE_STAGE_TOTAL,
+	TRACE_STAGES,
+};
+
+/* Stage histograms in TSC ticks, one per IO thread which records them */
+struct server_trace_t {
+	struct hist_t stages[TRACE_STAGES];
+} __attribute__((aligned(64)));
+
+/*
+ * Workload kernel and compute cost of a request derived from
+ * load.compute_dur at startup: a TSC budget, or in iters mode a fixed
+ * number of kernel iterations. GET and PUT requests go to the store.
+ * Streamed requests are charged ticks in either mode.
+ */
+struct compute_load_t {
+	const struct compute_kernel_t *kernel;
+	uint64_t ticks;
+	unsigned int iters;
+	struct kv_store_t *kv;
+};
+
+struct server_doorbells_t {
+	struct doorbell_t *compute;
+	struct doorbell_t *submit;
+};
+
+struct server_caches_t {
+	struct buffer_cache_t *io;
+	struct buffer_cache_t *submit;
+};
+
 struct server_context_t {
 	struct server_config_t cfg;
 	struct server_queues_t queues;
 	struct server_threads_t threads;
 	struct server_io_t io;
+	struct server_caches_t caches;
+	struct server_doorbells_t doorbells;
+	struct compute_stats_t *compute_stats;
+	struct io_stats_t *io_stats;
+	struct submit_stats_t *submit_stats;
+	struct server_trace_t *traces;
+	struct compute_load_t load;
+	struct buffer_pool_t pools[BUFFER_CLASSES];
+	unsigned int nr_pools;
+	unsigned int recv_cls; // class requests are received into, see io_request_start()
+	int mode;
 	int stopping;
 };
 
+/*
+ * The request comes last so that its payload runs on to the end of the
+ * buffer's size class. Until framed is set, left counts header bytes.
+ */
 struct server_buffer_t {
 	struct queue_head q;
-	struct message_t msg;
 	struct server_connection_t *conn;
 	size_t left;
 	unsigned char *ptr;
-};
+	uint64_t ts[TRACE_POINTS];
+	unsigned int cls;
+	int framed;
+	struct response_t res;
+	struct request_t req;
+} __attribute__((aligned(64)));
 
 struct server_connection_t {
 	struct queue_head q;
@@ -86,20 +281,174 @@ struct server_connection_t {
 	int epoll_state;
 	struct server_buffer_t *recvbuf;
 	struct server_buffer_t *sendbuf;
+	int send_posted;	// sendbuf is with the syscall executor, see post_response_batch()
 	struct queue_root send_queue;
+	struct {
+		struct sha1_ctx_t sha;
+		unsigned char *window;
+	} stream;
+	struct {
+		unsigned char *buf;
+		size_t head;
+		size_t tail;
+		int pending;
+		struct server_connection_t *pending_next;
+	} ring;
+	// Responses being sent together, the first one possibly in part
+	struct {
+		struct server_buffer_t *bufs[SERVER_SEND_IOV_MAX];
+		unsigned int nr;
+		uint64_t since;
+		int delayed;
+		struct server_connection_t *delayed_next;
+	} sendv;
+	struct {
+		struct server_buffer_t *backlog;
+		struct server_buffer_t *backlog_tail;
+		int recv_armed;
+		int recv_paused;
+		int send_inflight;
+		int tx_scheduled;
+		int closing;
+		int stalled;
+		struct server_connection_t *stalled_next;
+	} uring;
 	unsigned long received;
 	unsigned long processed;  // FIXME atomic send counter
 	unsigned long sent;
 	lock_t lock;
 };
 
+static inline void buffer_cache_refill(
+	struct queue_root *pool,
+	struct buffer_magazine_t *mag,
+	unsigned int n
+) {
+	while (n-- && mag->nr < mag->size) {
+		struct queue_head *q = queue_get(pool);
+		if (!q)
+			break;
+		mag->bufs[mag->nr++] = container_of(q, struct server_buffer_t, q);
+	}
+}
+
+static inline void buffer_cache_flush(
+	struct queue_root *pool,
+	struct buffer_magazine_t *mag,
+	unsigned int n
+) {
+	while (n-- && mag->nr)
+		queue_put(&mag->bufs[--mag->nr]->q, pool);
+}
+
+/* Smallest size class holding size request bytes, nr_pools if none does */
+static inline unsigned int buffer_class(struct server_context_t *ctx, size_t size) {
+	unsigned int cls = 0;
+	while (cls < ctx->nr_pools && ctx->pools[cls].size < size)
+		cls++;
+	return cls;
+}
+
+static inline struct server_buffer_t *buffer_class_get(
+	struct server_context_t *ctx,
+	struct buffer_cache_t *cache,
+	unsigned int cls
+) {
+	struct buffer_magazine_t *mag = &cache->mags[cls];
+	struct queue_root *pool = ctx->pools[cls].empty;
+
+	if (!mag->size) {
+		struct queue_head *q = queue_get(pool);
+		return q ? container_of(q, struct server_buffer_t, q) : NULL;
+	}
+	if (mag->nr) {
+		mag->hits++;
+	} else {
+		mag->misses++;
+		buffer_cache_refill(pool, mag, (mag->size + 1) / 2);
+		if (!mag->nr)
+			return NULL;
+	}
+	return mag->bufs[--mag->nr];
+}
+
+/* A buffer for size request bytes, from a larger class if its own ran dry */
+static inline struct server_buffer_t *buffer_get(
+	struct server_context_t *ctx,
+	struct buffer_cache_t *cache,
+	size_t size
+) {
+	for (unsigned int cls = buffer_class(ctx, size); cls < ctx->nr_pools; cls++) {
+		struct server_buffer_t *buff = buffer_class_get(ctx, cache, cls);
+		if (buff)
+			return buff;
+	}
+	return NULL;
+}
+
+static inline void buffer_put(
+	struct server_context_t *ctx,
+	struct buffer_cache_t *cache,
+	struct server_buffer_t *buff
+) {
+	struct buffer_magazine_t *mag = &cache->mags[buff->cls];
+	struct queue_root *pool = ctx->pools[buff->cls].empty;
+
+	if (!mag->size) {
+		queue_put(&buff->q, pool);
+		return;
+	}
+	if (mag->nr == mag->size) {
+		mag->flushes++;
+		buffer_cache_flush(pool, mag, (mag->size + 1) / 2);
+	}
+	mag->bufs[mag->nr++] = buff;
+}
+
+static inline void trace_stamp(
+	struct server_context_t *ctx,
+	struct server_buffer_t *buff,
+	enum trace_point_t point
+) {
+	if (ctx->cfg.trace)
+		buff->ts[point] = rdtsc();
+}
+
+/* Stamp TRACE_SENT and account the request to its IO thread's histograms */
+static inline void trace_request_done(
+	struct server_context_t *ctx,
+	struct server_buffer_t *buff
+) {
+	if (!ctx->cfg.trace)
+		return;
+	uint64_t *ts = buff->ts;
+	struct hist_t *stages = ctx->traces[buff->conn->ioidx].stages;
+
+	ts[TRACE_SENT] = rdtsc();
+	hist_record(&stages[TRACE_STAGE_INBOX], ts[TRACE_COMPUTE_START] - ts[TRACE_RECV]);
+	hist_record(&stages[TRACE_STAGE_COMPUTE], ts[TRACE_COMPUTE_DONE] - ts[TRACE_COMPUTE_START]);
+	hist_record(&stages[TRACE_STAGE_SUBMIT], ts[TRACE_SUBMIT] - ts[TRACE_COMPUTE_DONE]);
+	hist_record(&stages[TRACE_STAGE_SEND], ts[TRACE_SENT] - ts[TRACE_SUBMIT]);
+	hist_record(&stages[TRACE_STAGE_TOTAL], ts[TRACE_SENT] - ts[TRACE_RECV]);
+}
+
+extern void compute_requests(const struct compute_load_t *load, struct request_t *reqs[], struct response_t *res[], unsigned int n);
+extern int setup_compute_load(struct server_context_t *ctx);
+extern void cleanup_compute_load(struct server_context_t *ctx);
+extern int setup_server_stats_socket(struct server_context_t *ctx);
+extern void cleanup_server_stats_socket(struct server_context_t *ctx);
+extern void *stats_worker(void *opaque, struct thread_info_t *ti);
 extern void *compute_worker(void *opaque, struct thread_info_t *ti);
 extern void *submitter_worker(void *opaque, struct thread_info_t *ti);
 extern void *io_worker(void *opaque, struct thread_info_t *ti);
 extern void *accept_worker(void *opaque, struct thread_info_t *ti);
+extern void *syscall_executor_worker(void *opaque, struct thread_info_t *ti);
 
 int epoll_conn_finish(struct server_context_t *ctx, struct server_connection_t *conn);
 
+extern int setup_server_uring(struct server_context_t *ctx);
+extern void cleanup_server_uring(struct server_context_t *ctx);
+
 extern struct server_context_t *create_server(struct server_config_t *cfg);
 extern int destroy_server(struct server_context_t *ctx);
 
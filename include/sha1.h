@@ -0,0 +1,51 @@
+#ifndef __BENCHMARK_SHA1_H
+#define __BENCHMARK_SHA1_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define SHA1_DIGEST_LEN	20
+#define SHA1_BLOCK_LEN	64
+#define SHA1_NAME_LEN	16
+
+/* Lanes hashed side by side by the AVX2 multi-buffer kernel */
+#define SHA1_AVX2_LANES	8
+
+/*
+ * SHA1 over n equally long messages at once. Kernels either hash the
+ * messages one by one (openssl, scalar, shani) or several per pass (avx2).
+ */
+typedef void (*sha1_multi_fn)(
+	const unsigned char *const data[],
+	size_t len,
+	unsigned char *const digest[],
+	unsigned int n
+);
+
+struct sha1_kernel_t {
+	const char *name;
+	int (*supported)(void);
+	sha1_multi_fn hash;
+};
+
+/*
+ * Pick a kernel by name, or the fastest supported one for "auto". The
+ * choice is checked against OpenSSL before it is used.
+ */
+int sha1_select(const char *name);
+const char *sha1_selected(void);
+
+extern sha1_multi_fn sha1_multi;
+
+/* Incremental SHA1, for messages hashed piece by piece as they arrive */
+struct sha1_ctx_t {
+	uint32_t state[5];
+	uint64_t len;
+	unsigned char buf[SHA1_BLOCK_LEN];
+};
+
+void sha1_init(struct sha1_ctx_t *c);
+void sha1_update(struct sha1_ctx_t *c, const unsigned char *p, size_t len);
+void sha1_final(struct sha1_ctx_t *c, unsigned char *digest);
+
+#endif // __BENCHMARK_SHA1_H
@@ -0,0 +1,96 @@
+#ifndef __BENCHMARK_SYSCALL_STATS_H
+#define __BENCHMARK_SYSCALL_STATS_H
+
+#include <stdint.h>
+#include <sys/syscall.h>
+
+#include "histogram.h"
+#include "server.h"
+#include "thread.h"
+
+/*
+ * Accounting of the syscalls made through the Z_ layer, see
+ * src/server/io/sysinface.c. Each server thread registers its own table
+ * when it starts, outside kerncall: a count, the total cycles and a cycle
+ * histogram per syscall and per path, the syscall instruction or the
+ * kerncall gate. Off unless --syscall_stats is set, and then a flag test
+ * per syscall. Syscalls of threads without a table are not counted.
+ */
+enum syscall_path_t {
+	SYSCALL_PATH_SYSCALL,
+	SYSCALL_PATH_GATE,
+	SYSCALL_PATHS,
+};
+
+enum syscall_slot_t {
+	SYSCALL_SLOT_ACCEPT,
+	SYSCALL_SLOT_RECV,
+	SYSCALL_SLOT_SEND,
+	SYSCALL_SLOT_SENDMSG,
+	SYSCALL_SLOT_CLOSE,
+	SYSCALL_SLOT_EPOLL_CREATE,
+	SYSCALL_SLOT_EPOLL_CTL,
+	SYSCALL_SLOT_EPOLL_WAIT,
+	SYSCALL_SLOT_READ,
+	SYSCALL_SLOT_WRITE,
+	SYSCALL_SLOT_FUTEX,
+	SYSCALL_SLOT_CLOCK_GETTIME,
+	SYSCALL_SLOT_URING_SETUP,
+	SYSCALL_SLOT_URING_ENTER,
+	SYSCALL_SLOT_URING_REGISTER,
+	SYSCALL_SLOT_IOCTL,
+	SYSCALL_SLOT_OTHER,
+	SYSCALL_SLOTS,
+};
+
+#define SYSCALL_STATS_MAX_THREADS	SERVER_MAX_THREADS
+
+struct syscall_stat_t {
+	uint64_t count;
+	uint64_t cycles;
+	struct hist_t hist;
+};
+
+struct syscall_stats_t {
+	char name[THREAD_NAME_MAX];
+	struct syscall_stat_t calls[SYSCALL_SLOTS][SYSCALL_PATHS];
+} __attribute__((aligned(64)));
+
+extern int syscall_stats_enabled;
+// Tables in registration order, a slot stays NULL until its table is set up
+extern struct syscall_stats_t *syscall_stats[SYSCALL_STATS_MAX_THREADS];
+extern unsigned int syscall_stats_nr;
+
+extern const char *const syscall_slot_names[SYSCALL_SLOTS];
+extern const char *const syscall_path_names[SYSCALL_PATHS];
+
+/* Folds to a constant, the Z_ wrappers pass constant syscall numbers */
+static inline unsigned int syscall_slot(long n) {
+	switch (n) {
+	case SYS_accept:
+	case SYS_accept4:		return SYSCALL_SLOT_ACCEPT;
+	case SYS_recvfrom:		return SYSCALL_SLOT_RECV;
+	case SYS_sendto:		return SYSCALL_SLOT_SEND;
+	case SYS_sendmsg:		return SYSCALL_SLOT_SENDMSG;
+	case SYS_close:			return SYSCALL_SLOT_CLOSE;
+	case SYS_epoll_create1:		return SYSCALL_SLOT_EPOLL_CREATE;
+	case SYS_epoll_ctl:		return SYSCALL_SLOT_EPOLL_CTL;
+	case SYS_epoll_wait:
+	case SYS_epoll_pwait2:		return SYSCALL_SLOT_EPOLL_WAIT;
+	case SYS_read:			return SYSCALL_SLOT_READ;
+	case SYS_write:			return SYSCALL_SLOT_WRITE;
+	case SYS_futex:			return SYSCALL_SLOT_FUTEX;
+	case SYS_clock_gettime:		return SYSCALL_SLOT_CLOCK_GETTIME;
+	case SYS_io_uring_setup:	return SYSCALL_SLOT_URING_SETUP;
+	case SYS_io_uring_enter:	return SYSCALL_SLOT_URING_ENTER;
+	case SYS_io_uring_register:	return SYSCALL_SLOT_URING_REGISTER;
+	case SYS_ioctl:			return SYSCALL_SLOT_IOCTL;
+	default:			return SYSCALL_SLOT_OTHER;
+	}
+}
+
+void syscall_stats_record(unsigned int slot, unsigned int path, uint64_t cycles);
+/* Set up the calling thread's table if stats are on, at thread start */
+int syscall_stats_register(const char *name);
+
+#endif // __BENCHMARK_SYSCALL_STATS_H
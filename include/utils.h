@@ -3,6 +3,8 @@
 
 #include <assert.h>
 #include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <time.h>
 #include <pthread.h>
 
@@ -48,6 +50,40 @@ static inline uint64_t cur_nanoseconds(void) {
 	return as_nanoseconds(&ts);
 }
 
+/*
+ * Cycle-calibrated clock. tsc_init() measures the TSC against
+ * CLOCK_MONOTONIC once; afterwards reading the time is a rdtsc and a
+ * fixed-point multiply, with no vDSO or syscall involved, so it also works
+ * in kerncall context. Values are only meaningful as differences.
+ */
+struct tsc_clock_t {
+	double ticks_per_ns;
+	uint64_t ns_mult; // ns = ticks * ns_mult >> TSC_SHIFT
+	int init;
+};
+
+#define TSC_SHIFT	32
+
+extern struct tsc_clock_t tsc_clock;
+
+int tsc_init(void);
+
+static inline uint64_t rdtsc(void) {
+	return __builtin_ia32_rdtsc();
+}
+
+static inline uint64_t tsc_to_ns(uint64_t ticks) {
+	return ((unsigned __int128) ticks * tsc_clock.ns_mult) >> TSC_SHIFT;
+}
+
+static inline uint64_t ns_to_tsc(uint64_t ns) {
+	return ns * tsc_clock.ticks_per_ns;
+}
+
+static inline uint64_t tsc_nanoseconds(void) {
+	return tsc_to_ns(rdtsc());
+}
+
 static int uniform_rand(int low, int high) {
     double candidate = rand()/(1.0 + RAND_MAX);
     int range = high - low + 1;
@@ -7,8 +7,14 @@ export COMP_VALUES=${COMP_VALUES:-1000 5000 10000}
 # export IO_SIZE_VALUES=${IO_SIZE_VALUES:-8 16 32 64 128 256 512 1024}
 export IO_SIZE_VALUES=${IO_SIZE_VALUES:-4 16 64 256 1024}
 export KERNCALL=${KERNCALL:-1}
+export IO_ENGINE=${IO_ENGINE:-epoll}
+export SERVER_MODE=${SERVER_MODE:-staged}
+# How IO threads make syscalls: direct (syscall or kerncall gate) or executor
+export SYSCALLS=${SYSCALLS:-direct}
 export DURATION=${DURATION:-30}
 export CLIENT_ITERS=${CLIENT_ITERS:-11}
+# Reported by view: rps or a client latency percentile (p50 p90 p99 p99.9 max)
+export METRIC=${METRIC:-rps}
 export EXTRA_SERVER_ARGS=${EXTRA_SERVER_ARGS:-""}
 export EXTRA_CLIENT_ARGS=${EXTRA_CLIENT_ARGS:-"--nr_requests=1000000"}
 export SERVER=$PREFIX/server
@@ -18,14 +24,14 @@ server_log () {
     io_size=$1
     compute_dur=$2
     kerncall=$3
-    echo "/tmp/piotbench-server-io_$io_size-compute_$compute_dur-kerncall_$kerncall.log"
+    echo "/tmp/piotbench-server-io_$io_size-compute_$compute_dur-kerncall_$kerncall-engine_$IO_ENGINE-mode_$SERVER_MODE-syscalls_$SYSCALLS.log"
 }
 
 client_log () {
     io_size=$1
     compute_dur=$2
     kerncall=$3
-    echo "/tmp/piotbench-client-io_$io_size-compute_$compute_dur-kerncall_$kerncall.log"
+    echo "/tmp/piotbench-client-io_$io_size-compute_$compute_dur-kerncall_$kerncall-engine_$IO_ENGINE-mode_$SERVER_MODE-syscalls_$SYSCALLS.log"
 }
 
 start_server () {
@@ -33,7 +39,7 @@ start_server () {
     compute_dur=$2
     kerncall=$3
     server_log=$4
-    $SERVER --kerncall.global=$kerncall --load.compute_dur=$compute_dur --load.max_io_size=$io_size ${EXTRA_SERVER_ARGS} &>$server_log &
+    $SERVER --kerncall.global=$kerncall --load.compute_dur=$compute_dur --load.max_io_size=$io_size --io.engine=$IO_ENGINE --mode=$SERVER_MODE --io.syscalls=$SYSCALLS ${EXTRA_SERVER_ARGS} &>$server_log &
     echo $!
 }
 
@@ -83,7 +89,11 @@ get_one_result () {
     compute_dur=$2
     kerncall=$3
     client_log=$(client_log $io_size $compute_dur $kerncall)
-    grep 'Requests/sec' $client_log | awk '{print $NF}' | tail -"$(( ${CLIENT_ITERS} - 1 ))" | awk '{s+=$1}END{print s/NR}'
+    if [ "$METRIC" = rps ]; then
+        grep 'Requests/sec' $client_log | awk '{print $NF}'
+    else
+        grep 'Latency: count' $client_log | sed -E "s/.* ${METRIC} ([0-9.]+)[, ].*/\1/"
+    fi | tail -"$(( ${CLIENT_ITERS} - 1 ))" | awk '{s+=$1}END{print s/NR}'
 }
 
 view_results () {
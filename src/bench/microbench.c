@@ -0,0 +1,492 @@
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+
+#define NEED_DEBUG 1
+#include "include/debug.h"
+#include "include/command.h"
+#include "include/histogram.h"
+#include "include/kerncall.h"
+#include "include/utils.h"
+#include "src/server/io/io.h"
+
+/*
+ * Cost of one kernel transition for the calls the server makes, by the
+ * path it takes: libc wrappers, the Z_ layer with the syscall instruction,
+ * the Z_ layer through the kerncall gate, and io_uring with one SQE per
+ * io_uring_enter. Every call is timed on its own with the TSC. The null
+ * call is getpid, or a NOP on io_uring.
+ *
+ * The gate suite runs inside kerncall_spawn(), so no libc call may be
+ * made there; it only fills in the results, which are printed afterwards.
+ * That is also why this file is built with INSTR_CFLAGS.
+ */
+
+#define MICROBENCH_PAYLOAD_MAX	65536
+#define MICROBENCH_REPS_MAX	64
+#define MICROBENCH_PATHS_LEN	64
+
+struct microbench_config_t {
+	unsigned int iters; // per repetition
+	unsigned int warmup;
+	unsigned int reps;
+	unsigned int payload;
+	char paths[MICROBENCH_PATHS_LEN];
+};
+
+#define MICROBENCH_PARAM_UINT(field_name, desc, default_) \
+	PARAM_UINT(struct microbench_config_t, field_name, desc, default_)
+#define MICROBENCH_PARAM_STR(field_name, desc, default_) \
+	PARAM_STR(struct microbench_config_t, field_name, desc, default_)
+
+struct param_t microbench_params[] = {
+	MICROBENCH_PARAM_UINT(
+		iters,
+		"Timed calls per operation and repetition",
+		100000
+	),
+	MICROBENCH_PARAM_UINT(
+		warmup,
+		"Untimed calls before each repetition",
+		1000
+	),
+	MICROBENCH_PARAM_UINT(
+		reps,
+		"Repetitions per operation, the spread of their means is reported",
+		5
+	),
+	MICROBENCH_PARAM_UINT(
+		payload,
+		"Bytes per recv/send",
+		64
+	),
+	MICROBENCH_PARAM_STR(
+		paths,
+		"Comma separated paths to measure: libc, syscall, gate, uring",
+		"libc,syscall,gate,uring"
+	),
+	LAST_PARAM,
+};
+
+enum microbench_op_t {
+	MICROBENCH_OP_NULL,
+	MICROBENCH_OP_RECV,
+	MICROBENCH_OP_SEND,
+	MICROBENCH_OP_EPOLL_CTL,
+	MICROBENCH_OP_EPOLL_WAIT,
+	MICROBENCH_OPS,
+};
+
+static const char *microbench_op_names[MICROBENCH_OPS] = {
+	[MICROBENCH_OP_NULL] = "null",
+	[MICROBENCH_OP_RECV] = "recvfrom",
+	[MICROBENCH_OP_SEND] = "sendto",
+	[MICROBENCH_OP_EPOLL_CTL] = "epoll_ctl MOD",
+	[MICROBENCH_OP_EPOLL_WAIT] = "epoll_wait ready",
+};
+
+/* One way into the kernel; a NULL op is not available on that path */
+struct microbench_path_t {
+	const char *name;
+	long (*getpid)(void);
+	ssize_t (*recv)(int sockfd, void *buf, size_t len, int flags);
+	ssize_t (*send)(int sockfd, const void *buf, size_t len, int flags);
+	int (*epoll_ctl)(int epfd, int op, int fd, struct epoll_event *event);
+	int (*epoll_wait)(int epfd, struct epoll_event *events, int maxevents, int timeout);
+};
+
+struct microbench_result_t {
+	int done;
+	int failed;
+	double rep_mean[MICROBENCH_REPS_MAX];
+	struct hist_t hist;
+};
+
+struct microbench_ctx_t {
+	struct microbench_config_t cfg;
+	int sv[2];
+	int epfd;
+	unsigned char *buf;
+	const struct microbench_path_t *path;
+	struct microbench_result_t *results; // MICROBENCH_OPS of them for path
+	struct hist_t rep;
+};
+
+/* libc */
+
+static long libc_getpid(void) {
+	return getpid();
+}
+
+static const struct microbench_path_t microbench_libc = {
+	.name = "libc",
+	.getpid = libc_getpid,
+	.recv = recv,
+	.send = send,
+	.epoll_ctl = epoll_ctl,
+	.epoll_wait = epoll_wait,
+};
+
+/* Z_ layer, by the syscall instruction or by the gate depending on where it runs */
+
+static const struct microbench_path_t microbench_z = {
+	.name = "syscall",
+	.getpid = Z_getpid,
+	.recv = Z_recv,
+	.send = Z_send,
+	.epoll_ctl = Z_epoll_ctl,
+	.epoll_wait = Z_epoll_wait,
+};
+
+static const struct microbench_path_t microbench_gate = {
+	.name = "gate",
+	.getpid = Z_getpid,
+	.recv = Z_recv,
+	.send = Z_send,
+	.epoll_ctl = Z_epoll_ctl,
+	.epoll_wait = Z_epoll_wait,
+};
+
+/*
+ * io_uring, one SQE submitted and waited for per io_uring_enter. There is
+ * no epoll_wait opcode; NOP stands in for the null call.
+ */
+struct microbench_uring_t {
+	int fd;
+	unsigned int *sq_tail;
+	unsigned int sq_mask;
+	struct io_uring_sqe *sqes;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_ring;
+	size_t sq_ring_len;
+	void *cq_ring;
+	size_t cq_ring_len;
+	size_t sqes_len;
+};
+
+static struct microbench_uring_t microbench_ring = { .fd = -1 };
+
+static int microbench_uring_init(struct microbench_uring_t *ring) {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof (p));
+
+	ring->fd = Z_io_uring_setup(4, &p);
+	if (ring->fd < 0)
+		return -1;
+	ring->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof (unsigned int);
+	ring->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+	ring->sqes_len = p.sq_entries * sizeof (struct io_uring_sqe);
+	ring->sq_ring = mmap(NULL, ring->sq_ring_len, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	ring->cq_ring = mmap(NULL, ring->cq_ring_len, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+		perror("mmap");
+		return -1;
+	}
+	ring->sq_tail = ring->sq_ring + p.sq_off.tail;
+	ring->sq_mask = *(unsigned int *) (ring->sq_ring + p.sq_off.ring_mask);
+	unsigned int *sq_array = ring->sq_ring + p.sq_off.array;
+	for (unsigned int i = 0; i < p.sq_entries; i++)
+		sq_array[i] = i;
+	ring->cq_head = ring->cq_ring + p.cq_off.head;
+	ring->cq_tail = ring->cq_ring + p.cq_off.tail;
+	ring->cq_mask = *(unsigned int *) (ring->cq_ring + p.cq_off.ring_mask);
+	ring->cqes = ring->cq_ring + p.cq_off.cqes;
+	return 0;
+}
+
+static void microbench_uring_fini(struct microbench_uring_t *ring) {
+	if (ring->fd < 0)
+		return;
+	munmap(ring->sqes, ring->sqes_len);
+	munmap(ring->cq_ring, ring->cq_ring_len);
+	munmap(ring->sq_ring, ring->sq_ring_len);
+	close(ring->fd);
+	ring->fd = -1;
+}
+
+/* Submit one SQE, wait for its CQE and return its result like a syscall would */
+static long microbench_uring_call(unsigned char opcode, int fd, uint64_t addr, unsigned int len, uint64_t off, int flags) {
+	struct microbench_uring_t *ring = &microbench_ring;
+	unsigned int tail = *ring->sq_tail;
+	struct io_uring_sqe *sqe = &ring->sqes[tail & ring->sq_mask];
+
+	memset(sqe, 0, sizeof (*sqe));
+	sqe->opcode = opcode;
+	sqe->fd = fd;
+	sqe->addr = addr;
+	sqe->len = len;
+	sqe->off = off;
+	sqe->msg_flags = flags;
+	__atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	if (Z_io_uring_enter(ring->fd, 1, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+		return -1;
+
+	unsigned int head = *ring->cq_head;
+	if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+		errno = EAGAIN;
+		return -1;
+	}
+	int res = ring->cqes[head & ring->cq_mask].res;
+	__atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+	if (res < 0) {
+		errno = -res;
+		return -1;
+	}
+	return res;
+}
+
+static long uring_nop(void) {
+	return microbench_uring_call(IORING_OP_NOP, -1, 0, 0, 0, 0);
+}
+
+static ssize_t uring_recv(int sockfd, void *buf, size_t len, int flags) {
+	return microbench_uring_call(IORING_OP_RECV, sockfd, (uintptr_t) buf, len, 0, flags);
+}
+
+static ssize_t uring_send(int sockfd, const void *buf, size_t len, int flags) {
+	return microbench_uring_call(IORING_OP_SEND, sockfd, (uintptr_t) buf, len, 0, flags);
+}
+
+static int uring_epoll_ctl(int epfd, int op, int fd, struct epoll_event *event) {
+	return microbench_uring_call(IORING_OP_EPOLL_CTL, epfd, (uintptr_t) event, op, fd, 0);
+}
+
+static const struct microbench_path_t microbench_uring = {
+	.name = "uring",
+	.getpid = uring_nop,
+	.recv = uring_recv,
+	.send = uring_send,
+	.epoll_ctl = uring_epoll_ctl,
+};
+
+/* Measurement */
+
+static int microbench_available(const struct microbench_path_t *path, unsigned int op) {
+	switch (op) {
+	case MICROBENCH_OP_NULL:	return path->getpid != NULL;
+	case MICROBENCH_OP_RECV:	return path->recv && path->send;
+	case MICROBENCH_OP_SEND:	return path->recv && path->send;
+	case MICROBENCH_OP_EPOLL_CTL:	return path->epoll_ctl != NULL;
+	case MICROBENCH_OP_EPOLL_WAIT:	return path->epoll_wait != NULL;
+	}
+	return 0;
+}
+
+/*
+ * One call of op, timed. recv is preceded by an untimed send of the same
+ * size and send followed by an untimed recv, so the socket never fills up.
+ * epoll_wait finds the byte left queued on sv[0] by microbench_path().
+ */
+static int microbench_call(struct microbench_ctx_t *ctx, unsigned int op, uint64_t *cycles) {
+	const struct microbench_path_t *path = ctx->path;
+	size_t len = ctx->cfg.payload;
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+	};
+	uint64_t start;
+	long ret;
+
+	switch (op) {
+	case MICROBENCH_OP_NULL:
+		start = rdtsc();
+		ret = path->getpid();
+		*cycles = rdtsc() - start;
+		return ret < 0 ? -1 : 0;
+	case MICROBENCH_OP_RECV:
+		if (path->send(ctx->sv[1], ctx->buf, len, 0) != (ssize_t) len)
+			return -1;
+		start = rdtsc();
+		ret = path->recv(ctx->sv[0], ctx->buf, len, 0);
+		*cycles = rdtsc() - start;
+		return ret != (ssize_t) len ? -1 : 0;
+	case MICROBENCH_OP_SEND:
+		start = rdtsc();
+		ret = path->send(ctx->sv[0], ctx->buf, len, 0);
+		*cycles = rdtsc() - start;
+		if (ret != (ssize_t) len)
+			return -1;
+		return path->recv(ctx->sv[1], ctx->buf, len, 0) != (ssize_t) len ? -1 : 0;
+	case MICROBENCH_OP_EPOLL_CTL:
+		start = rdtsc();
+		ret = path->epoll_ctl(ctx->epfd, EPOLL_CTL_MOD, ctx->sv[0], &ev);
+		*cycles = rdtsc() - start;
+		return ret;
+	case MICROBENCH_OP_EPOLL_WAIT:
+		start = rdtsc();
+		ret = path->epoll_wait(ctx->epfd, &ev, 1, 0);
+		*cycles = rdtsc() - start;
+		return ret != 1 ? -1 : 0;
+	}
+	return -1;
+}
+
+static void microbench_op(struct microbench_ctx_t *ctx, unsigned int op) {
+	struct microbench_result_t *res = &ctx->results[op];
+	uint64_t cycles;
+
+	hist_init(&res->hist);
+	for (unsigned int r = 0; r < ctx->cfg.reps; r++) {
+		hist_init(&ctx->rep);
+		for (unsigned int i = 0; i < ctx->cfg.warmup + ctx->cfg.iters; i++) {
+			if (microbench_call(ctx, op, &cycles)) {
+				res->failed = 1;
+				return;
+			}
+			if (i >= ctx->cfg.warmup)
+				hist_record(&ctx->rep, cycles);
+		}
+		res->rep_mean[r] = (double) ctx->rep.sum / ctx->rep.count;
+		hist_merge(&res->hist, &ctx->rep);
+	}
+	res->done = 1;
+}
+
+/* Runs every op of ctx->path; called from kerncall_spawn() for the gate */
+static int microbench_path(unsigned long arg) {
+	struct microbench_ctx_t *ctx = (void *) arg;
+	const struct microbench_path_t *path = ctx->path;
+
+	// Level triggered and never read, so epoll_wait always has an event
+	if (path->send(ctx->sv[1], ctx->buf, 1, 0) != 1)
+		return -1;
+	for (unsigned int op = 0; op < MICROBENCH_OPS; op++)
+		if (microbench_available(path, op))
+			microbench_op(ctx, op);
+	return path->recv(ctx->sv[0], ctx->buf, 1, 0) != 1 ? -1 : 0;
+}
+
+static void microbench_report(struct microbench_ctx_t *ctx) {
+	for (unsigned int op = 0; op < MICROBENCH_OPS; op++) {
+		struct microbench_result_t *res = &ctx->results[op];
+		if (res->failed) {
+			printf("%s\t%s\tfailed\n", ctx->path->name, microbench_op_names[op]);
+			continue;
+		}
+		if (!res->done)
+			continue;
+		double mean = 0, var = 0;
+		for (unsigned int r = 0; r < ctx->cfg.reps; r++)
+			mean += res->rep_mean[r];
+		mean /= ctx->cfg.reps;
+		for (unsigned int r = 0; r < ctx->cfg.reps; r++)
+			var += (res->rep_mean[r] - mean) * (res->rep_mean[r] - mean);
+		var /= ctx->cfg.reps;
+		printf("%s\t%s\t%lu\t%lu\t%lu\t%.1lf\t%.1lf\t%.1lf\n",
+		       ctx->path->name, microbench_op_names[op],
+		       res->hist.min, hist_percentile(&res->hist, 50), hist_percentile(&res->hist, 99),
+		       mean, sqrt(var), mean / tsc_clock.ticks_per_ns);
+		fflush(stdout);
+	}
+}
+
+static int microbench_wanted(struct microbench_ctx_t *ctx, const char *name) {
+	size_t len = strlen(name);
+	for (const char *p = ctx->cfg.paths; (p = strstr(p, name)); p += len)
+		if ((p == ctx->cfg.paths || p[-1] == ',') && (p[len] == ',' || !p[len]))
+			return 1;
+	return 0;
+}
+
+static void microbench_run(struct microbench_ctx_t *ctx, const struct microbench_path_t *path) {
+	int ret;
+
+	if (!microbench_wanted(ctx, path->name))
+		return;
+	ctx->path = path;
+	memset(ctx->results, 0, MICROBENCH_OPS * sizeof (struct microbench_result_t));
+	if (path == &microbench_gate) {
+		if (kerncall_setup()) {
+			printf("%s\tskipped, kerncall not available\n", path->name);
+			return;
+		}
+		ret = kerncall_spawn((uintptr_t) microbench_path, (unsigned long) ctx);
+	} else if (path == &microbench_uring) {
+		if (microbench_uring_init(&microbench_ring)) {
+			printf("%s\tskipped, io_uring setup failed: %s\n", path->name, strerror(errno));
+			microbench_uring_fini(&microbench_ring);
+			return;
+		}
+		ret = microbench_path((unsigned long) ctx);
+		microbench_uring_fini(&microbench_ring);
+	} else {
+		ret = microbench_path((unsigned long) ctx);
+	}
+	if (ret)
+		printf("%s\tfailed\n", path->name);
+	microbench_report(ctx);
+}
+
+int main(int argc, char **argv) {
+	struct command_t microbench_command = {
+		.progname = argv[0],
+		.description = "Syscall path microbenchmark",
+		.params = microbench_params,
+	};
+	struct microbench_ctx_t *ctx = calloc(1, sizeof (*ctx));
+	if (!ctx) {
+		perror("calloc");
+		return 1;
+	}
+	if (parse_command_args(argc, argv, &ctx->cfg, &microbench_command))
+		return 1;
+	if (!ctx->cfg.iters)
+		ctx->cfg.iters = 1;
+	if (!ctx->cfg.reps)
+		ctx->cfg.reps = 1;
+	if (ctx->cfg.reps > MICROBENCH_REPS_MAX)
+		ctx->cfg.reps = MICROBENCH_REPS_MAX;
+	if (!ctx->cfg.payload)
+		ctx->cfg.payload = 1;
+	if (ctx->cfg.payload > MICROBENCH_PAYLOAD_MAX)
+		ctx->cfg.payload = MICROBENCH_PAYLOAD_MAX;
+
+	ctx->buf = calloc(1, MICROBENCH_PAYLOAD_MAX);
+	ctx->results = calloc(MICROBENCH_OPS, sizeof (struct microbench_result_t));
+	if (!ctx->buf || !ctx->results) {
+		perror("calloc");
+		return 1;
+	}
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, ctx->sv)) {
+		perror("socketpair");
+		return 1;
+	}
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+	};
+	ctx->epfd = epoll_create1(0);
+	if (ctx->epfd < 0 || epoll_ctl(ctx->epfd, EPOLL_CTL_ADD, ctx->sv[0], &ev)) {
+		perror("epoll");
+		return 1;
+	}
+	if (tsc_init())
+		return 1;
+
+	printf("path\top\tmin\tp50\tp99\tmean\tstddev\tmean_ns\t(cycles, %u reps of %u calls)\n",
+	       ctx->cfg.reps, ctx->cfg.iters);
+	microbench_run(ctx, &microbench_libc);
+	microbench_run(ctx, &microbench_z);
+	microbench_run(ctx, &microbench_gate);
+	microbench_run(ctx, &microbench_uring);
+
+	close(ctx->epfd);
+	close(ctx->sv[0]);
+	close(ctx->sv[1]);
+	free(ctx->results);
+	free(ctx->buf);
+	free(ctx);
+	return 0;
+}
@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define NEED_DEBUG 1
+#include "include/debug.h"
+#include "include/command.h"
+#include "include/queue.h"
+#include "include/thread.h"
+#include "include/utils.h"
+
+#ifdef QUEUE_LOCKFREE
+#define QUEUE_IMPL_NAME "lockfree"
+#else
+#define QUEUE_IMPL_NAME "lock"
+#endif
+
+struct queuebench_config_t {
+	unsigned int max_threads;
+	unsigned int nr_ops; // per thread
+	unsigned int nr_items;
+	unsigned int batch;
+};
+
+#define QUEUEBENCH_PARAM_UINT(field_name, desc, default_) \
+	PARAM_UINT(struct queuebench_config_t, field_name, desc, default_)
+
+struct param_t queuebench_params[] = {
+	QUEUEBENCH_PARAM_UINT(
+		max_threads,
+		"Measure 1..max_threads concurrent threads",
+		8
+	),
+	QUEUEBENCH_PARAM_UINT(
+		nr_ops,
+		"Number of get/put pairs per thread",
+		1000000
+	),
+	QUEUEBENCH_PARAM_UINT(
+		nr_items,
+		"Number of elements circulating through the queue",
+		1024
+	),
+	QUEUEBENCH_PARAM_UINT(
+		batch,
+		"Elements moved per get/put (queue_get_batch/queue_put_list above 1)",
+		1
+	),
+	LAST_PARAM,
+};
+
+#define QUEUEBENCH_BATCH_MAX	64
+
+struct queuebench_item_t {
+	struct queue_head q;
+	unsigned long payload;
+};
+
+struct queuebench_ctx_t {
+	struct queuebench_config_t cfg;
+	struct queue_root *queue;
+	struct barrier_t start_barrier;
+	unsigned long moved; // elements moved by all threads of a run
+};
+
+/*
+ * Each thread repeatedly takes an element and puts it back, the same
+ * pattern the server applies to empty_buffers and the stage inboxes.
+ * With batch > 1 every round moves up to batch elements instead, the
+ * elements actually moved are added to ctx->moved.
+ */
+static void *queuebench_worker(void *opaque, struct thread_info_t *ti) {
+	struct queuebench_ctx_t *ctx = opaque;
+	unsigned long moved = 0;
+
+	(void) ti;
+
+	pthread_barrier_wait(&ctx->start_barrier.barrier);
+	if (ctx->cfg.batch > 1) {
+		struct queue_head *batch[QUEUEBENCH_BATCH_MAX];
+		for (unsigned int i = 0; i < ctx->cfg.nr_ops; i++) {
+			unsigned int n;
+			while (!(n = queue_get_batch(ctx->queue, batch, ctx->cfg.batch)))
+				;
+			moved += n;
+			for (unsigned int j = 0; j < n; j++) {
+				container_of(batch[j], struct queuebench_item_t, q)->payload++;
+				if (j + 1 < n)
+					batch[j]->next = batch[j + 1];
+			}
+			queue_put_list(batch[0], batch[n - 1], n, ctx->queue);
+		}
+		__atomic_fetch_add(&ctx->moved, moved, __ATOMIC_RELAXED);
+		return NULL;
+	}
+	for (unsigned int i = 0; i < ctx->cfg.nr_ops; i++) {
+		struct queue_head *q;
+		while (!(q = queue_get(ctx->queue)))
+			;
+		container_of(q, struct queuebench_item_t, q)->payload++;
+		queue_put(q, ctx->queue);
+		moved++;
+	}
+	__atomic_fetch_add(&ctx->moved, moved, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+static int run_one(struct queuebench_ctx_t *ctx, unsigned int nr_threads, double *ops_per_sec) {
+	struct thread_info_t *threads[THREAD_GROUP_MAX];
+	memset(&ctx->start_barrier, 0, sizeof (ctx->start_barrier));
+	ctx->moved = 0;
+	if (barrier_init(&ctx->start_barrier, nr_threads + 1)) {
+		perror("barrier_init");
+		return -1;
+	}
+
+	for (unsigned int i = 0; i < nr_threads; i++) {
+		char name[THREAD_NAME_MAX];
+		snprintf(name, THREAD_NAME_MAX, "queuebench:%u", i);
+		threads[i] = create_thread(name, queuebench_worker, ctx);
+		if (!threads[i]) {
+			perror("create_thread");
+			exit(1);
+		}
+	}
+
+	pthread_barrier_wait(&ctx->start_barrier.barrier);
+	uint64_t start = cur_nanoseconds();
+	for (unsigned int i = 0; i < nr_threads; i++)
+		thread_join(threads[i]);
+	uint64_t duration_ns = cur_nanoseconds() - start;
+
+	barrier_destroy(&ctx->start_barrier);
+	// Every element moved was got once and put once
+	double total_ops = 2.0 * ctx->moved;
+	*ops_per_sec = total_ops * 1000000000.0 / duration_ns;
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	struct command_t queuebench_command = {
+		.progname = argv[0],
+		.description = "Queue implementation throughput benchmark",
+		.params = queuebench_params,
+	};
+	struct queuebench_ctx_t ctx;
+	memset(&ctx, 0, sizeof (ctx));
+	if (parse_command_args(argc, argv, &ctx.cfg, &queuebench_command)) {
+		return 1;
+	}
+	if (ctx.cfg.max_threads > THREAD_GROUP_MAX)
+		ctx.cfg.max_threads = THREAD_GROUP_MAX;
+	if (!ctx.cfg.batch)
+		ctx.cfg.batch = 1;
+	if (ctx.cfg.batch > QUEUEBENCH_BATCH_MAX)
+		ctx.cfg.batch = QUEUEBENCH_BATCH_MAX;
+
+	ctx.queue = alloc_queue_root_sized(ctx.cfg.nr_items);
+	struct queuebench_item_t *items = calloc(ctx.cfg.nr_items, sizeof (struct queuebench_item_t));
+	if (!ctx.queue || !items) {
+		perror("alloc");
+		return 1;
+	}
+	for (unsigned int i = 0; i < ctx.cfg.nr_items; i++)
+		queue_put(&items[i].q, ctx.queue);
+
+	printf("impl\tthreads\tMops/sec\n");
+	for (unsigned int n = 1; n <= ctx.cfg.max_threads; n++) {
+		double ops_per_sec;
+		if (run_one(&ctx, n, &ops_per_sec))
+			return 1;
+		printf("%s\t%u\t%.3lf\n", QUEUE_IMPL_NAME, n, ops_per_sec / 1000000.0);
+		fflush(stdout);
+	}
+
+	free_queue_root(ctx.queue);
+	free(items);
+	return 0;
+}
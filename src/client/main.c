@@ -1,4 +1,6 @@
 #include <unistd.h>
+#include <string.h>
+#include <math.h>
 
 #define NEED_DEBUG 1
 #include "include/client.h"
@@ -39,6 +41,86 @@ struct param_t client_params[] = {
 		"Total test duration (-1 for no limit)",
 		-1
 	),
+	CLIENT_PARAM_UINT(
+		latency_window,
+		"Request send times kept per connection for latency matching",
+		4096
+	),
+	CLIENT_PARAM_UINT(
+		rate,
+		"Open loop: aggregate requests/sec offered over all connections (0 for closed loop)",
+		0
+	),
+	CLIENT_PARAM_STR(
+		arrival,
+		"Open loop inter-arrival distribution (constant, poisson)",
+		"poisson"
+	),
+	CLIENT_PARAM_STR(
+		workload,
+		"Requests to send: compute, or kv for GET/PUT",
+		"compute"
+	),
+	CLIENT_PARAM_UINT(
+		keys,
+		"kv: number of keys, as preloaded by a server run with --load.workload=kv",
+		1048576
+	),
+	CLIENT_PARAM_STR(
+		key_dist,
+		"kv: key distribution (uniform, zipf)",
+		"zipf"
+	),
+	CLIENT_PARAM_UINT(
+		zipf_theta,
+		"kv: Zipf skew in 1/100, below 100",
+		99
+	),
+	CLIENT_PARAM_UINT(
+		read_pct,
+		"kv: percentage of GET requests, the rest are PUTs",
+		95
+	),
+	CLIENT_PARAM_STR(
+		payload_dist,
+		"Request payload size distribution (fixed, uniform, bimodal, trace)",
+		"fixed"
+	),
+	CLIENT_PARAM_UINT(
+		payload_size,
+		"Payload bytes: the fixed size, the uniform maximum or the bimodal large mode",
+		REQUEST_LENGTH
+	),
+	CLIENT_PARAM_UINT(
+		payload_min,
+		"Payload bytes: the uniform minimum or the bimodal small mode",
+		64
+	),
+	CLIENT_PARAM_UINT(
+		payload_large_pct,
+		"Bimodal: percentage of requests with the large payload",
+		10
+	),
+	CLIENT_PARAM_STR(
+		payload_trace,
+		"Trace: file with one payload size per line, replayed in order",
+		""
+	),
+	CLIENT_PARAM_UINT(
+		send_batch,
+		"Requests written per writev (1 to 64, 1 sends them one by one)",
+		1
+	),
+	CLIENT_PARAM_UINT(
+		recv_size,
+		"Bytes read per recv and then parsed into responses (0 to read response by response)",
+		0
+	),
+	CLIENT_PARAM_UINT(
+		max_inflight,
+		"Requests per connection sent but not yet answered (0 for no limit)",
+		0
+	),
 	LAST_PARAM,
 };
 
@@ -50,6 +132,105 @@ struct client_progress_t {
 	struct timespec timestamp;
 };
 
+static int init_client_keys(struct client_context_t *ctx) {
+	struct client_keys_t *keys = &ctx->keys;
+
+	keys->n = ctx->cfg.keys;
+	if (!keys->n) {
+		debug("kv: no keys");
+		return -1;
+	}
+	if (!strcmp(ctx->cfg.key_dist, "uniform")) {
+		keys->dist = KEY_DIST_UNIFORM;
+		return 0;
+	}
+	if (strcmp(ctx->cfg.key_dist, "zipf")) {
+		debug("unknown key distribution: %s", ctx->cfg.key_dist);
+		return -1;
+	}
+	if (ctx->cfg.zipf_theta >= 100) {
+		debug("kv: zipf_theta must be below 100");
+		return -1;
+	}
+	keys->dist = KEY_DIST_ZIPF;
+	keys->theta = ctx->cfg.zipf_theta / 100.0;
+	keys->zetan = 0;
+	for (unsigned long i = 1; i <= keys->n; i++)
+		keys->zetan += 1 / pow(i, keys->theta);
+	double zeta2 = 1 + 1 / pow(2, keys->theta);
+	keys->alpha = 1 / (1 - keys->theta);
+	keys->eta = (1 - pow(2.0 / keys->n, 1 - keys->theta)) / (1 - zeta2 / keys->zetan);
+	keys->half_pow_theta = 1 + pow(0.5, keys->theta);
+	return 0;
+}
+
+static int load_payload_trace(struct client_context_t *ctx) {
+	struct client_payload_t *payload = &ctx->payload;
+	unsigned long cap = 0;
+	unsigned int size;
+
+	FILE *f = fopen(ctx->cfg.payload_trace, "r");
+	if (!f) {
+		perror("fopen");
+		return -1;
+	}
+	while (fscanf(f, "%u", &size) == 1) {
+		if (payload->trace_len == cap) {
+			cap = cap ? 2 * cap : 1024;
+			unsigned int *trace = realloc(payload->trace, cap * sizeof (unsigned int));
+			if (!trace) {
+				perror("realloc");
+				fclose(f);
+				return -1;
+			}
+			payload->trace = trace;
+		}
+		payload->trace[payload->trace_len++] = size;
+		if (payload->max < size)
+			payload->max = size;
+	}
+	fclose(f);
+	if (!payload->trace_len) {
+		debug("no payload sizes in %s", ctx->cfg.payload_trace);
+		return -1;
+	}
+	return 0;
+}
+
+static int init_client_payload(struct client_context_t *ctx) {
+	struct client_payload_t *payload = &ctx->payload;
+
+	payload->max = ctx->cfg.payload_size;
+	if (!strcmp(ctx->cfg.payload_dist, "fixed")) {
+		payload->dist = PAYLOAD_FIXED;
+	} else if (!strcmp(ctx->cfg.payload_dist, "uniform")) {
+		payload->dist = PAYLOAD_UNIFORM;
+	} else if (!strcmp(ctx->cfg.payload_dist, "bimodal")) {
+		payload->dist = PAYLOAD_BIMODAL;
+	} else if (!strcmp(ctx->cfg.payload_dist, "trace")) {
+		payload->dist = PAYLOAD_TRACE;
+		payload->max = 0;
+		if (load_payload_trace(ctx))
+			return -1;
+	} else {
+		debug("unknown payload distribution: %s", ctx->cfg.payload_dist);
+		return -1;
+	}
+	if (payload->dist != PAYLOAD_FIXED && payload->dist != PAYLOAD_TRACE &&
+	    ctx->cfg.payload_min > ctx->cfg.payload_size) {
+		debug("payload_min above payload_size");
+		return -1;
+	}
+	// PUTs carry at least a value
+	if (payload->max < KV_VALUE_LEN)
+		payload->max = KV_VALUE_LEN;
+	if (payload->max > REQUEST_STREAM_MAX_LENGTH) {
+		debug("payloads above %u bytes", REQUEST_STREAM_MAX_LENGTH);
+		return -1;
+	}
+	return 0;
+}
+
 static int init_client_conn(
 	struct client_context_t *ctx,
 	unsigned int thread_idx,
@@ -76,11 +257,43 @@ static int init_client_conn(
 		perror("setnonblock");
 		goto out_close;
 	}
+	conn->send_ts = calloc(ctx->cfg.latency_window, sizeof (struct client_send_ts_t));
+	if (!conn->send_ts) {
+		perror("calloc");
+		goto out_close;
+	}
+	conn->sendbuf.msg = calloc(1, sizeof (struct request_t) + ctx->payload.max);
+	if (!conn->sendbuf.msg) {
+		perror("calloc");
+		goto out_close;
+	}
+	if (ctx->cfg.send_batch > 1) {
+		conn->sendv.heads = calloc(ctx->cfg.send_batch, CLIENT_REQ_HEAD_LEN);
+		if (!conn->sendv.heads) {
+			perror("calloc");
+			goto out_close;
+		}
+	}
+	if (ctx->cfg.recv_size) {
+		conn->recvbuf.bulk = malloc(ctx->cfg.recv_size);
+		if (!conn->recvbuf.bulk) {
+			perror("malloc");
+			goto out_close;
+		}
+	}
 	conn->state = CONN_OPEN;
 	conn->status.total = ctx->cfg.nr_requests;
 	return 0;
 
 out_close:
+	free(conn->send_ts);
+	conn->send_ts = NULL;
+	free(conn->sendbuf.msg);
+	conn->sendbuf.msg = NULL;
+	free(conn->sendv.heads);
+	conn->sendv.heads = NULL;
+	free(conn->recvbuf.bulk);
+	conn->recvbuf.bulk = NULL;
 	close(conn->fd);
 out:
 	return -1;
@@ -89,6 +302,14 @@ out:
 static void cleanup_client_conn(struct client_connection_t *conn) {
 	if (conn->fd > 0)
 		close(conn->fd);
+	free(conn->send_ts);
+	conn->send_ts = NULL;
+	free(conn->sendbuf.msg);
+	conn->sendbuf.msg = NULL;
+	free(conn->sendv.heads);
+	conn->sendv.heads = NULL;
+	free(conn->recvbuf.bulk);
+	conn->recvbuf.bulk = NULL;
 	conn->state = 0;
 }
 
@@ -105,6 +326,8 @@ static void cleanup_client_thread(struct client_thread_t *cthread) {
 static int init_client_thread(struct client_context_t *ctx, unsigned int idx) {
 	struct client_thread_t *cthread = &ctx->client_threads[idx];
 	cthread->ctx = ctx;
+	cthread->rng = 0x9e3779b97f4a7c15ULL * (idx + 1);
+	hist_init(&cthread->latency);
 	cthread->conns = calloc(ctx->cfg.nr_connections, sizeof (struct client_connection_t));
 	if (!cthread->conns){
 		perror("calloc");
@@ -134,6 +357,8 @@ void cleanup_client(struct client_context_t *ctx) {
 			cleanup_client_thread(&ctx->client_threads[i]);
 		}
 	}
+	free(ctx->payload.trace);
+	free(ctx->payload.zeros);
 	free(ctx);
 }
 
@@ -144,6 +369,45 @@ static struct client_context_t *init_client(struct client_config_t *cfg) {
 		goto out_err;
 	}
 	ctx->cfg = *cfg;
+	if (tsc_init()) {
+		debug("TSC calibration failed");
+		goto out_cleanup;
+	}
+	if (!ctx->cfg.latency_window)
+		ctx->cfg.latency_window = 1;
+	if (!strcmp(ctx->cfg.arrival, "constant")) {
+		ctx->arrival = ARRIVAL_CONSTANT;
+	} else if (!strcmp(ctx->cfg.arrival, "poisson")) {
+		ctx->arrival = ARRIVAL_POISSON;
+	} else {
+		debug("unknown arrival distribution: %s", ctx->cfg.arrival);
+		goto out_cleanup;
+	}
+	if (!strcmp(ctx->cfg.workload, "compute")) {
+		ctx->workload = WORKLOAD_COMPUTE;
+	} else if (!strcmp(ctx->cfg.workload, "kv")) {
+		ctx->workload = WORKLOAD_KV;
+		if (init_client_keys(ctx))
+			goto out_cleanup;
+	} else {
+		debug("unknown workload: %s", ctx->cfg.workload);
+		goto out_cleanup;
+	}
+	if (init_client_payload(ctx))
+		goto out_cleanup;
+	if (!ctx->cfg.send_batch)
+		ctx->cfg.send_batch = 1;
+	if (ctx->cfg.send_batch > CLIENT_SEND_BATCH_MAX)
+		ctx->cfg.send_batch = CLIENT_SEND_BATCH_MAX;
+	if (ctx->cfg.send_batch > 1) {
+		ctx->payload.zeros = calloc(1, ctx->payload.max);
+		if (!ctx->payload.zeros) {
+			perror("calloc");
+			goto out_cleanup;
+		}
+	}
+	if (ctx->cfg.rate)
+		ctx->interval_ns = 1e9 * ctx->cfg.nr_threads * ctx->cfg.nr_connections / ctx->cfg.rate;
 	for (unsigned int i = 0; i < cfg->nr_threads; i++) {
 		if (init_client_thread(ctx, i)) {
 			perror("init_client_thread");
@@ -200,7 +464,11 @@ static int report_client_stats(struct client_context_t *ctx) {
 	uint64_t start_time = -1ULL;
 	uint64_t end_time = 0;
 	uint64_t total_requests = 0;
+	uint64_t unmatched = 0;
+	uint64_t failed = 0;
+	struct hist_t latency;
 
+	hist_init(&latency);
 	for (unsigned int thr = 0; thr < ctx->cfg.nr_threads; thr++) {
 		for (unsigned int conn = 0; conn < ctx->cfg.nr_connections; conn++) {
 			struct client_status_t *status = &ctx->client_threads[thr].conns[conn].status;
@@ -216,22 +484,27 @@ static int report_client_stats(struct client_context_t *ctx) {
 				end_time = conn_end_time;
 
 			total_requests += status->sent;
+			unmatched += status->unmatched;
+			failed += status->failed;
 		}
+		hist_merge(&latency, &ctx->client_threads[thr].latency);
 	}
 
 	debug("Total requests: %ld", total_requests);
 
 	uint64_t duration_ns = end_time - start_time;
-	double duration_sec = duration_ns / (1000000000L);
-	debug("Duration in sec: %.6lf", (double) duration_ns / 1000000000L);
-
-	uint64_t avg_dur_ns = duration_ns / total_requests;
-	double avg_dur_us = ((double) avg_dur_ns) / 1000;
-	double rpus = 1.0 / avg_dur_us;
-	debug("Requests/usec: %lf", rpus);
+	double duration_sec = (double) duration_ns / 1000000000L;
+	debug("Duration in sec: %.6lf", duration_sec);
 
-	double rps = rpus * 1000000;
+	double rps = total_requests / duration_sec;
+	debug("Requests/usec: %lf", rps / 1000000);
 	debug("Requests/sec: %lf", rps);
+
+	hist_print("Latency", &latency, 1 / 1000.0, "usec");
+	if (unmatched)
+		debug("Latency: %lu responses unmatched, raise --latency_window", unmatched);
+	if (failed)
+		debug("Failed requests: %lu", failed);
 	return 0;
 }
 
@@ -265,9 +538,9 @@ int join_client(struct client_context_t *ctx) {
 	}
 }
 
-static int client_nr_threads_done(struct client_context_t *ctx) {
-	int nr_done = 0;
-	for (int i = 0; i < ctx->cfg.nr_threads; i++) {
+static unsigned int client_nr_threads_done(struct client_context_t *ctx) {
+	unsigned int nr_done = 0;
+	for (unsigned int i = 0; i < ctx->cfg.nr_threads; i++) {
 		nr_done += ctx->client_threads[i].ti->returned;
 	}
 	return nr_done;
@@ -282,8 +555,8 @@ static int report_progress(struct client_context_t *ctx, struct client_progress_
 	struct client_progress_t new_progress = { 0 };
 	clock_gettime(CLOCK_MONOTONIC, &new_progress.timestamp);
 
-	for (int tidx = 0; tidx < ctx->cfg.nr_threads; tidx++) {
-		for (int cidx = 0; cidx < ctx->cfg.nr_connections; cidx++) {
+	for (unsigned int tidx = 0; tidx < ctx->cfg.nr_threads; tidx++) {
+		for (unsigned int cidx = 0; cidx < ctx->cfg.nr_connections; cidx++) {
 			if (ctx->client_threads[tidx].conns[cidx].status.received < ctx->cfg.nr_requests)
 				new_progress.conns_active++;
 			new_progress.sent_total += ctx->client_threads[tidx].conns[cidx].status.sent;
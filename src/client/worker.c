@@ -1,5 +1,6 @@
 #include <sys/epoll.h>
 #include <errno.h>
+#include <math.h>
 #include <unistd.h>
 
 #include "include/client.h"
@@ -13,6 +14,9 @@ static int epoll_set_conn(int epollfd, struct client_connection_t *conn, int eve
 		.events = events,
 		.data.ptr = conn,
 	};
+	if (conn->events == events)
+		return 0;
+	conn->events = events;
 	epoll_ctl(epollfd, EPOLL_CTL_DEL, conn->fd, NULL);
 	if (!events)
 		return 0;
@@ -35,8 +39,10 @@ static int init_client_thread_epoll(struct client_thread_t *cthread) {
 		close(fd);
 		return -1;
 	}
+	// In open loop mode sends follow the schedule instead of EPOLLOUT
+	int events = cthread->ctx->cfg.rate ? EPOLLIN : EPOLLIN | EPOLLOUT;
 	for (unsigned int i = 0; i < cthread->ctx->cfg.nr_connections; i++) {
-		if (epoll_set_conn(fd, &cthread->conns[i], EPOLLIN | EPOLLOUT)) {
+		if (epoll_set_conn(fd, &cthread->conns[i], events)) {
 			perror("epoll_set_conn");
 			close(fd);
 			return -1;
@@ -46,6 +52,121 @@ static int init_client_thread_epoll(struct client_thread_t *cthread) {
 	return fd;
 }
 
+static inline struct client_send_ts_t *client_send_ts(
+	struct client_thread_t *cthread,
+	struct client_connection_t *conn,
+	unsigned int id
+) {
+	return &conn->send_ts[id % cthread->ctx->cfg.latency_window];
+}
+
+static void client_record_latency(
+	struct client_thread_t *cthread,
+	struct client_connection_t *conn
+) {
+	unsigned int id = conn->recvbuf.msg.id;
+	struct client_send_ts_t *ts = client_send_ts(cthread, conn, id);
+	if (ts->id != id || !ts->ns) {
+		conn->status.unmatched++;
+		return;
+	}
+	hist_record(&cthread->latency, tsc_nanoseconds() - ts->ns);
+	ts->ns = 0;
+}
+
+/* xorshift64*, uniform in (0, 1] */
+static double client_rand(struct client_thread_t *cthread) {
+	uint64_t x = cthread->rng;
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	cthread->rng = x;
+	return ((x * 0x2545f4914f6cdd1dULL >> 11) + 1) * (1.0 / (1ULL << 53));
+}
+
+static uint64_t client_interarrival(struct client_thread_t *cthread) {
+	double mean = cthread->ctx->interval_ns;
+	if (cthread->ctx->arrival == ARRIVAL_POISSON)
+		return -log(client_rand(cthread)) * mean;
+	return mean;
+}
+
+/* Key rank, 0 the most popular for zipf */
+static uint64_t client_next_key(struct client_thread_t *cthread) {
+	const struct client_keys_t *keys = &cthread->ctx->keys;
+	double u = client_rand(cthread);
+
+	if (keys->dist == KEY_DIST_UNIFORM)
+		return (uint64_t) ((u - 0x1p-53) * keys->n);
+	double uz = u * keys->zetan;
+	if (uz < 1)
+		return 0;
+	if (uz < keys->half_pow_theta)
+		return 1;
+	uint64_t key = keys->n * pow(keys->eta * u - keys->eta + 1, keys->alpha);
+	return key < keys->n ? key : keys->n - 1;
+}
+
+static unsigned int client_payload_len(struct client_thread_t *cthread) {
+	const struct client_config_t *cfg = &cthread->ctx->cfg;
+	const struct client_payload_t *payload = &cthread->ctx->payload;
+
+	switch (payload->dist) {
+	case PAYLOAD_UNIFORM:
+		return cfg->payload_min + (unsigned int) ((client_rand(cthread) - 0x1p-53) *
+							  (cfg->payload_size - cfg->payload_min + 1));
+	case PAYLOAD_BIMODAL:
+		return client_rand(cthread) * 100 <= cfg->payload_large_pct ?
+			cfg->payload_size : cfg->payload_min;
+	case PAYLOAD_TRACE:
+		return payload->trace[cthread->trace_pos++ % payload->trace_len];
+	default:
+		return cfg->payload_size;
+	}
+}
+
+static void client_fill_request(struct client_thread_t *cthread, struct request_t *req) {
+	req->len = client_payload_len(cthread);
+	if (cthread->ctx->workload != WORKLOAD_KV)
+		return;
+	req->key = client_next_key(cthread);
+	if (client_rand(cthread) * 100 <= cthread->ctx->cfg.read_pct) {
+		req->op = RPC_OP_GET;
+	} else {
+		req->op = RPC_OP_PUT;
+		if (req->len < KV_VALUE_LEN)
+			req->len = KV_VALUE_LEN;
+		kv_value_of(req->key, req->data);
+	}
+}
+
+/*
+ * recv() for the response parser. With recv_size set the socket is read in
+ * bulk and responses are copied out of the read-ahead bytes; the parser
+ * only stops at EAGAIN, so nothing is left behind unseen by epoll.
+ */
+static ssize_t client_conn_recv(
+	struct client_thread_t *cthread,
+	struct client_connection_t *conn,
+	void *buf,
+	size_t len
+) {
+	if (!conn->recvbuf.bulk)
+		return recv(conn->fd, buf, len, 0);
+	if (conn->recvbuf.head == conn->recvbuf.tail) {
+		ssize_t received = recv(conn->fd, conn->recvbuf.bulk, cthread->ctx->cfg.recv_size, 0);
+		if (received <= 0)
+			return received;
+		conn->recvbuf.head = 0;
+		conn->recvbuf.tail = received;
+	}
+	if (len > conn->recvbuf.tail - conn->recvbuf.head)
+		len = conn->recvbuf.tail - conn->recvbuf.head;
+	memcpy(buf, conn->recvbuf.bulk + conn->recvbuf.head, len);
+	conn->recvbuf.head += len;
+	return len;
+}
+
 static int client_conn_handle_input(
 	struct client_thread_t *cthread,
 	struct client_connection_t *conn
@@ -57,12 +178,14 @@ static int client_conn_handle_input(
 			/* Check if we're done: */
 			if (conn->status.received == conn->status.total)
 				return 0;
-			conn->recvbuf.left = sizeof (struct response_t);
+			conn->recvbuf.left = RESPONSE_HDR_LEN;
+			conn->recvbuf.framed = 0;
 		}
 
-		unsigned char *recvptr = (unsigned char *) &conn->recvbuf.msg.id;
-		recvptr += (sizeof (struct response_t) - conn->recvbuf.left);
-		int received = recv(conn->fd, recvptr, conn->recvbuf.left, 0);
+		size_t want = conn->recvbuf.framed ? RESPONSE_HDR_LEN + conn->recvbuf.msg.len : RESPONSE_HDR_LEN;
+		unsigned char *recvptr = (unsigned char *) &conn->recvbuf.msg;
+		recvptr += want - conn->recvbuf.left;
+		int received = client_conn_recv(cthread, conn, recvptr, conn->recvbuf.left);
 		if (received == -1) {
 			if (errno == EAGAIN)
 				break;
@@ -73,8 +196,123 @@ static int client_conn_handle_input(
 		}
 		debug("received = %d", received);
 		conn->recvbuf.left -= received;
-		if (!conn->recvbuf.left)
+		if (!conn->recvbuf.left && !conn->recvbuf.framed) {
+			if (conn->recvbuf.msg.len > RESPONSE_MAX_LENGTH) {
+				debug("response %d: bad length %u", conn->recvbuf.msg.id, conn->recvbuf.msg.len);
+				return -1;
+			}
+			conn->recvbuf.framed = 1;
+			conn->recvbuf.left = conn->recvbuf.msg.len;
+		}
+		if (!conn->recvbuf.left) {
 			conn->status.received++;
+			if (conn->recvbuf.msg.status != RPC_STATUS_OK)
+				conn->status.failed++;
+			client_record_latency(cthread, conn);
+		}
+	}
+	return 0;
+}
+
+static int client_conn_sending(struct client_connection_t *conn) {
+	return conn->sendbuf.left || conn->sendv.nr;
+}
+
+/* Room in the max_inflight window for queued requests plus one more */
+static int client_conn_window_open(
+	struct client_thread_t *cthread,
+	struct client_connection_t *conn,
+	unsigned int queued
+) {
+	unsigned int window = cthread->ctx->cfg.max_inflight;
+	return !window || conn->status.sent + queued - conn->status.received < window;
+}
+
+/*
+ * Queue up to send_batch requests as iovecs: each request's head (header
+ * and PUT value) followed by zeros for the rest of its payload. Send
+ * times are taken here rather than once the batch is written.
+ */
+static void client_build_batch(
+	struct client_thread_t *cthread,
+	struct client_connection_t *conn
+) {
+	struct client_context_t *ctx = cthread->ctx;
+	uint64_t now = tsc_nanoseconds();
+
+	conn->sendv.iov_nr = conn->sendv.iov_pos = 0;
+	while (conn->sendv.nr < ctx->cfg.send_batch &&
+	       conn->status.sent + conn->sendv.nr < conn->status.total &&
+	       client_conn_window_open(cthread, conn, conn->sendv.nr)) {
+		struct request_t *req = (struct request_t *) (conn->sendv.heads + conn->sendv.nr * CLIENT_REQ_HEAD_LEN);
+		uint64_t ns = now;
+
+		// Open loop: only what is due, measured from the schedule
+		if (ctx->cfg.rate) {
+			if (now < conn->next_send_ns)
+				break;
+			ns = conn->next_send_ns;
+			conn->next_send_ns += client_interarrival(cthread);
+		}
+		req->id = conn->status.sent + conn->sendv.nr;
+		struct client_send_ts_t *ts = client_send_ts(cthread, conn, req->id);
+		ts->id = req->id;
+		ts->ns = ns;
+		client_fill_request(cthread, req);
+
+		unsigned int head = req->len < KV_VALUE_LEN ? req->len : KV_VALUE_LEN;
+		struct iovec *iov = &conn->sendv.iov[conn->sendv.iov_nr];
+		iov->iov_base = req;
+		iov->iov_len = sizeof (struct request_t) + head;
+		conn->sendv.iov_nr++;
+		if (req->len > head) {
+			iov[1].iov_base = ctx->payload.zeros;
+			iov[1].iov_len = req->len - head;
+			conn->sendv.iov_nr++;
+		}
+		conn->sendv.nr++;
+	}
+}
+
+static int client_conn_handle_output_batch(
+	struct client_thread_t *cthread,
+	struct client_connection_t *conn
+) {
+	while (1) {
+		if (!conn->sendv.nr) {
+			if (cthread->ctx->stopping) {
+				conn->status.total = conn->status.sent;
+				return 0;
+			}
+			client_build_batch(cthread, conn);
+			if (!conn->sendv.nr)
+				return 0;
+		}
+
+		struct iovec *iov = &conn->sendv.iov[conn->sendv.iov_pos];
+		ssize_t written = writev(conn->fd, iov, conn->sendv.iov_nr - conn->sendv.iov_pos);
+		if (written == -1) {
+			if (errno == EAGAIN)
+				break;
+			perror("client_conn_handle_output_batch");
+			return -1;
+		}
+		while (conn->sendv.iov_pos < conn->sendv.iov_nr && (size_t) written >= iov->iov_len) {
+			written -= iov->iov_len;
+			conn->sendv.iov_pos++;
+			iov++;
+		}
+		if (written) {
+			iov->iov_base = (unsigned char *) iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+		if (conn->sendv.iov_pos == conn->sendv.iov_nr) {
+			debug("sent messages %lu to %lu", conn->status.sent, conn->status.sent + conn->sendv.nr - 1);
+			conn->status.sent += conn->sendv.nr;
+			conn->sendv.nr = 0;
+			if (conn->status.sent == conn->status.total)
+				return 0;
+		}
 	}
 	return 0;
 }
@@ -83,6 +321,9 @@ static int client_conn_handle_output(
 	struct client_thread_t *cthread,
 	struct client_connection_t *conn
 ) {
+	if (cthread->ctx->cfg.send_batch > 1)
+		return client_conn_handle_output_batch(cthread, conn);
+
 	while (1) {
 		/* init! create a new request */
 		if (!conn->sendbuf.left) {
@@ -90,16 +331,31 @@ static int client_conn_handle_output(
 				conn->status.total = conn->status.sent;
 				return 0;
 			}
-			/* Check if we're done: */
-			conn->sendbuf.left = sizeof (struct request_t);
-			conn->sendbuf.msg.id = conn->status.sent;
-			// for (unsigned int i = 0; i < REQUEST_LENGTH; i++) {
-			// 	conn->sendbuf.msg.data[i] = rand();
+			if (!client_conn_window_open(cthread, conn, 0))
+				return 0;
+			conn->sendbuf.msg->id = conn->status.sent;
+			if (cthread->ctx->cfg.rate) {
+				/*
+				 * Open loop: hold the request until it is due, and
+				 * measure from the schedule so that a stalled send
+				 * shows up as latency instead of being omitted.
+				 */
+				if (tsc_nanoseconds() < conn->next_send_ns)
+					return 0;
+				struct client_send_ts_t *ts = client_send_ts(cthread, conn, conn->sendbuf.msg->id);
+				ts->id = conn->sendbuf.msg->id;
+				ts->ns = conn->next_send_ns;
+				conn->next_send_ns += client_interarrival(cthread);
+			}
+			client_fill_request(cthread, conn->sendbuf.msg);
+			conn->sendbuf.left = sizeof (struct request_t) + conn->sendbuf.msg->len;
+			// for (unsigned int i = 0; i < conn->sendbuf.msg->len; i++) {
+			// 	conn->sendbuf.msg->data[i] = rand();
 			// }
 		}
 
-		unsigned char *sendptr = (unsigned char *) &conn->sendbuf.msg.id;
-		sendptr += (sizeof (struct request_t) - conn->sendbuf.left);
+		unsigned char *sendptr = (unsigned char *) conn->sendbuf.msg;
+		sendptr += sizeof (struct request_t) + conn->sendbuf.msg->len - conn->sendbuf.left;
 		int written = send(conn->fd, sendptr, conn->sendbuf.left, 0);
 		if (written == -1) {
 			if (errno == EAGAIN)
@@ -113,6 +369,11 @@ static int client_conn_handle_output(
 		conn->sendbuf.left -= written;
 		if (!conn->sendbuf.left) {
 			debug("sent message %d", conn->status.sent);
+			if (!cthread->ctx->cfg.rate) {
+				struct client_send_ts_t *ts = client_send_ts(cthread, conn, conn->sendbuf.msg->id);
+				ts->id = conn->sendbuf.msg->id;
+				ts->ns = tsc_nanoseconds();
+			}
 			conn->status.sent++;
 			if (conn->status.sent == conn->status.total)
 				return 0;
@@ -121,6 +382,115 @@ static int client_conn_handle_output(
 	return 0;
 }
 
+static int client_conn_send(
+	struct client_thread_t *cthread,
+	struct client_connection_t *conn
+) {
+	if (!conn->status.sent && !client_conn_sending(conn)) {
+		if (clock_gettime(CLOCK_MONOTONIC, &conn->status.start_time)) {
+			perror("clock_gettime - start time");
+			return -1;
+		}
+	}
+	if (client_conn_handle_output(cthread, conn)) {
+		perror("client_conn_handle_output");
+		return -1;
+	}
+	// Stopped with nothing in flight, no response is going to end the run
+	if (conn->status.received == conn->status.total && !conn->status.end_time.tv_sec) {
+		if (clock_gettime(CLOCK_MONOTONIC, &conn->status.end_time)) {
+			perror("clock_gettime");
+			return -1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Open loop: send what is due on conn, and when the socket fills up wait
+ * for EPOLLOUT to resume the rest instead of polling for it.
+ */
+static int client_conn_send_due(
+	struct client_thread_t *cthread,
+	struct client_connection_t *conn,
+	int epollfd
+) {
+	if (client_conn_send(cthread, conn))
+		return -1;
+	if (epoll_set_conn(epollfd, conn, client_conn_sending(conn) ? EPOLLIN | EPOLLOUT : EPOLLIN)) {
+		perror("epoll_set_conn");
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Open loop: send whatever is due on every connection and return how long
+ * the thread may sleep until the next request is, in nsec. Connections
+ * waiting for EPOLLOUT are left to the event loop.
+ */
+static int64_t client_send_due(struct client_thread_t *cthread, int epollfd) {
+	uint64_t now = tsc_nanoseconds();
+	uint64_t next = now + 100000000UL;
+
+	for (unsigned int i = 0; i < cthread->ctx->cfg.nr_connections; i++) {
+		struct client_connection_t *conn = &cthread->conns[i];
+		if (conn->fd < 0 || conn->status.sent == conn->status.total || (conn->events & EPOLLOUT))
+			continue;
+		// A full window opens with a response, which wakes up epoll
+		if (!client_conn_sending(conn) && !client_conn_window_open(cthread, conn, 0))
+			continue;
+		if (client_conn_sending(conn) || conn->next_send_ns <= now || cthread->ctx->stopping) {
+			if (client_conn_send_due(cthread, conn, epollfd))
+				return -1;
+		}
+		if (conn->status.sent < conn->status.total && conn->next_send_ns < next)
+			next = conn->next_send_ns;
+	}
+	now = tsc_nanoseconds();
+	return next > now ? next - now : 0;
+}
+
+static void client_schedule_start(struct client_thread_t *cthread, unsigned int idx) {
+	struct client_context_t *ctx = cthread->ctx;
+	uint64_t now = tsc_nanoseconds();
+
+	for (unsigned int i = 0; i < ctx->cfg.nr_connections; i++) {
+		struct client_connection_t *conn = &cthread->conns[i];
+		if (ctx->arrival == ARRIVAL_POISSON) {
+			conn->next_send_ns = now + client_interarrival(cthread);
+		} else {
+			// Spread connections evenly over one interval
+			unsigned int nr = ctx->cfg.nr_threads * ctx->cfg.nr_connections;
+			conn->next_send_ns = now + ctx->interval_ns * (idx * ctx->cfg.nr_connections + i) / nr;
+		}
+	}
+}
+
+/*
+ * Closed loop: send what the window allows, and only wait for EPOLLOUT
+ * while there is something left to send. With max_inflight set, responses
+ * reopen the window and restart sending from the input side.
+ */
+static int client_conn_pump(
+	struct client_thread_t *cthread,
+	struct client_connection_t *conn,
+	int epollfd
+) {
+	int events = EPOLLIN;
+
+	if (client_conn_send(cthread, conn))
+		return -1;
+	if (client_conn_sending(conn) ||
+	    (conn->status.sent < conn->status.total && client_conn_window_open(cthread, conn, 0)))
+		events |= EPOLLOUT;
+	if (epoll_set_conn(epollfd, conn, events)) {
+		perror("epoll_set_conn");
+		return -1;
+	}
+	return 0;
+}
+
 static int handle_client_epoll_event(
 	struct client_thread_t *cthread,
 	struct client_connection_t *conn,
@@ -129,22 +499,12 @@ static int handle_client_epoll_event(
 ) {
 	if (evt->events & EPOLLOUT) {
 		debug("conn %d: output event", conn->fd);
-		if (!conn->status.sent) {
-			if (clock_gettime(CLOCK_MONOTONIC, &conn->status.start_time)) {
-				perror("clock_gettime - start time");
+		if (cthread->ctx->cfg.rate) {
+			if (client_conn_send_due(cthread, conn, epollfd))
 				return -1;
-			}
-		}
-		if (client_conn_handle_output(cthread, conn)) {
-			perror("client_conn_handle_output");
+		} else if (client_conn_pump(cthread, conn, epollfd)) {
 			return -1;
 		}
-		if (conn->status.sent == conn->status.total) {
-			if (epoll_set_conn(epollfd, conn, EPOLLIN)) {
-				perror("epoll_set_conn");
-				return -1;
-			}
-		}
 	}
 
 	if (evt->events & EPOLLIN) {
@@ -164,6 +524,10 @@ static int handle_client_epoll_event(
 			}
 			close(conn->fd);
 			conn->fd = -1;
+		} else if (cthread->ctx->cfg.max_inflight && !cthread->ctx->cfg.rate &&
+			   conn->status.sent < conn->status.total) {
+			if (client_conn_pump(cthread, conn, epollfd))
+				return -1;
 		}
 	}
 	return 0;
@@ -171,7 +535,7 @@ static int handle_client_epoll_event(
 
 static int thread_has_active_connections(struct client_thread_t *cthread) {
 	int active = 0;
-	for (int i = 0; i < cthread->ctx->cfg.nr_connections; i++) {
+	for (unsigned int i = 0; i < cthread->ctx->cfg.nr_connections; i++) {
 		if (cthread->conns[i].status.received < cthread->conns[i].status.total)
 			active++;
 	}
@@ -194,9 +558,24 @@ void *client_worker(
 		goto done;
 	}
 
+	if (cthread->ctx->cfg.rate)
+		client_schedule_start(cthread, cthread - cthread->ctx->client_threads);
+
 	while (thread_has_active_connections(cthread)) {
 		struct epoll_event events[MAX_EVENTS];
-		int nevents = epoll_wait(epollfd, events, MAX_EVENTS, 100);
+		struct timespec timeout = {
+			.tv_sec = 0,
+			.tv_nsec = 100000000L,
+		};
+		if (cthread->ctx->cfg.rate) {
+			int64_t wait_ns = client_send_due(cthread, epollfd);
+			if (wait_ns < 0) {
+				ret = -1;
+				break;
+			}
+			timeout.tv_nsec = wait_ns;
+		}
+		int nevents = epoll_pwait2(epollfd, events, MAX_EVENTS, &timeout, NULL);
 		if (nevents == -1) {
 			if (errno == EINTR)
 				continue;
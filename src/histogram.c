@@ -0,0 +1,60 @@
+#include <stdio.h>
+
+#define NEED_DEBUG 1
+#include "include/debug.h"
+#include "include/histogram.h"
+
+void hist_merge(struct hist_t *dst, const struct hist_t *src) {
+	if (!src->count)
+		return;
+	for (unsigned int i = 0; i < HIST_BUCKETS; i++)
+		dst->buckets[i] += src->buckets[i];
+	dst->count += src->count;
+	dst->sum += src->sum;
+	if (src->min < dst->min)
+		dst->min = src->min;
+	if (src->max > dst->max)
+		dst->max = src->max;
+}
+
+uint64_t hist_percentile(const struct hist_t *h, double p) {
+	if (!h->count)
+		return 0;
+	uint64_t rank = (uint64_t) (p / 100.0 * h->count + 0.5);
+	if (rank < 1)
+		rank = 1;
+	if (rank >= h->count)
+		return h->max;
+
+	uint64_t seen = 0;
+	for (unsigned int i = 0; i < HIST_BUCKETS; i++) {
+		seen += h->buckets[i];
+		if (seen >= rank) {
+			uint64_t v = hist_bucket_value(i);
+			// Clamp to the observed range, the bucket may be wider
+			if (v < h->min)
+				v = h->min;
+			if (v > h->max)
+				v = h->max;
+			return v;
+		}
+	}
+	return h->max;
+}
+
+void hist_print(const char *name, const struct hist_t *h, double scale, const char *unit) {
+	if (!h->count) {
+		debug("%s: no samples", name);
+		return;
+	}
+	debug("%s: count %lu, min %.3lf, avg %.3lf, p50 %.3lf, p90 %.3lf, p99 %.3lf, p99.9 %.3lf, max %.3lf (%s)",
+	      name, h->count,
+	      h->min * scale,
+	      (double) h->sum / h->count * scale,
+	      hist_percentile(h, 50) * scale,
+	      hist_percentile(h, 90) * scale,
+	      hist_percentile(h, 99) * scale,
+	      hist_percentile(h, 99.9) * scale,
+	      h->max * scale,
+	      unit);
+}
@@ -1,41 +1,297 @@
+#include <string.h>
 #include <time.h>
 #define NEED_DEBUG 1
 #include "include/debug.h"
+#include "include/compute.h"
 #include "include/server.h"
+#include "include/syscall_stats.h"
 #include "include/utils.h"
 
 
-void compute_request(unsigned long nsec, struct request_t *req, struct response_t *res) {
-	struct timespec start_time;
-	if (clock_gettime(CLOCK_MONOTONIC, &start_time))
-		return;
+/*
+ * Run the workload kernel over n requests together, either until n times
+ * the per-request budget in TSC ticks has passed or for a fixed number of
+ * iterations. A batch costs at least one iteration over all its requests.
+ */
+static void compute_kernel_requests(const struct compute_load_t *load, struct request_t *reqs[], struct response_t *res[], unsigned int n) {
+	const struct compute_kernel_t *kernel = load->kernel;
 
-	while (1) {
-		SHA1(req->data, REQUEST_LENGTH, res->sha);
+	if (load->iters) {
+		for (unsigned int i = 0; i < load->iters; i++)
+			kernel->run(reqs, res, n);
+	} else {
+		uint64_t deadline = rdtsc() + n * load->ticks;
+		do {
+			kernel->run(reqs, res, n);
+		} while (rdtsc() < deadline);
+	}
+}
+
+/*
+ * Streamed payloads are gone by the time their request gets here, their
+ * digest came with the last chunk. They still cost a compute budget each,
+ * in iters mode the time load->iters iterations took at calibration.
+ */
+static void compute_charge_streamed(const struct compute_load_t *load, unsigned int n) {
+	uint64_t deadline = rdtsc() + n * load->ticks;
+
+	while (rdtsc() < deadline)
+		__builtin_ia32_pause();
+}
+
+/*
+ * Serve GET and PUT requests from the store right away and hand the
+ * compute requests of the batch to the kernel together.
+ */
+void compute_requests(const struct compute_load_t *load, struct request_t *reqs[], struct response_t *res[], unsigned int n) {
+	struct request_t *creqs[SERVER_BATCH_MAX];
+	struct response_t *cres[SERVER_BATCH_MAX];
+	unsigned int nr_compute = 0, nr_streamed = 0;
+
+	for (unsigned int i = 0; i < n; i++) {
+		struct request_t *req = reqs[i];
+
+		res[i]->id = req->id;
+		res[i]->status = RPC_STATUS_OK;
+		res[i]->len = 0;
+		if (req->op == RPC_OP_COMPUTE) {
+			res[i]->len = SHA_DIGEST_LENGTH;
+			// Hashed by the IO stage already, see io_request_stream()
+			if (req->flags & REQUEST_F_STREAMED) {
+				nr_streamed++;
+				continue;
+			}
+			creqs[nr_compute] = req;
+			cres[nr_compute++] = res[i];
+		} else if (!load->kv || (req->op != RPC_OP_GET && req->op != RPC_OP_PUT)) {
+			res[i]->status = RPC_STATUS_BADOP;
+		} else if (req->op == RPC_OP_GET) {
+			res[i]->status = kv_get(load->kv, req->key, res[i]->value);
+			if (res[i]->status == RPC_STATUS_OK)
+				res[i]->len = KV_VALUE_LEN;
+		} else if (req->len < KV_VALUE_LEN) {
+			res[i]->status = RPC_STATUS_BADOP;
+		} else {
+			res[i]->status = kv_put(load->kv, req->key, req->data);
+		}
+	}
+	if (nr_compute)
+		compute_kernel_requests(load, creqs, cres, nr_compute);
+	if (nr_streamed)
+		compute_charge_streamed(load, nr_streamed);
+}
+
+#define COMPUTE_CALIBRATE_NSEC	10000000UL
+
+#define COMPUTE_CALIBRATE_SIZE	(sizeof (struct request_t) + REQUEST_LENGTH)
+
+/*
+ * Average cost of one iteration over one request, in batches of n requests
+ * with the default payload.
+ */
+static double calibrate_kernel(const struct compute_kernel_t *kernel, unsigned int n) {
+	static uint64_t msgs[SERVER_BATCH_MAX][(COMPUTE_CALIBRATE_SIZE + 7) / 8];
+	static struct response_t responses[SERVER_BATCH_MAX];
+	struct request_t *reqs[SERVER_BATCH_MAX];
+	struct response_t *res[SERVER_BATCH_MAX];
+	unsigned long iters = 0;
+
+	for (unsigned int i = 0; i < n; i++) {
+		reqs[i] = (struct request_t *) msgs[i];
+		reqs[i]->id = i;
+		reqs[i]->len = REQUEST_LENGTH;
+		res[i] = &responses[i];
+	}
+	uint64_t start = rdtsc();
+	uint64_t deadline = start + ns_to_tsc(COMPUTE_CALIBRATE_NSEC);
+	do {
+		kernel->run(reqs, res, n);
+		iters++;
+	} while (rdtsc() < deadline);
+	return (double) tsc_to_ns(rdtsc() - start) / (iters * n);
+}
+
+/*
+ * Pick the workload kernel and translate load.compute_dur for the compute
+ * mode. Every kernel is calibrated and reported so that compute_dur can be
+ * compared across them; the others are torn down again right after.
+ */
+int setup_compute_load(struct server_context_t *ctx) {
+	struct compute_load_t *load = &ctx->load;
+	unsigned int compute_dur = ctx->cfg.load.compute_dur;
+	double iter_ns = 0;
+
+	if (tsc_init())
+		return -1;
+	load->kernel = compute_kernel_find(ctx->cfg.load.kernel);
+	if (!load->kernel) {
+		debug("unknown compute kernel: %s", ctx->cfg.load.kernel);
+		return -1;
+	}
+	if (ctx->cfg.load.stream) {
+		if (strcmp(load->kernel->name, "sha1")) {
+			debug("load.stream needs the sha1 kernel, not %s", load->kernel->name);
+			return -1;
+		}
+		if (!ctx->cfg.load.stream_window) {
+			debug("load.stream_window must not be 0");
+			return -1;
+		}
+	}
 
-		struct timespec cur_time;
-		if (clock_gettime(CLOCK_MONOTONIC, &cur_time))
-			return;
+	const struct compute_kernel_t *kernel;
+	for (unsigned int i = 0; (kernel = compute_kernel_at(i)); i++) {
+		if (kernel->setup && kernel->setup()) {
+			debug("compute: %s setup failed", kernel->name);
+			if (kernel != load->kernel)
+				continue;
+			load->kernel = NULL;
+			return -1;
+		}
+		double ns = calibrate_kernel(kernel, ctx->cfg.threads.batch);
+		debug("compute: %-8s %9.1lf ns/iteration (%s)%s", kernel->name, ns, kernel->desc,
+		      kernel == load->kernel ? ", selected" : "");
+		if (kernel == load->kernel)
+			iter_ns = ns;
+		else if (kernel->cleanup)
+			kernel->cleanup();
+	}
+
+	load->ticks = ns_to_tsc(compute_dur);
+	load->iters = 0;
+	if (!strcmp(ctx->cfg.load.compute_mode, "time"))
+		return 0;
+	if (strcmp(ctx->cfg.load.compute_mode, "iters")) {
+		debug("unknown compute mode: %s", ctx->cfg.load.compute_mode);
+		return -1;
+	}
+
+	load->iters = compute_dur / iter_ns + 0.5;
+	if (!load->iters)
+		load->iters = 1;
+	// What streamed requests are charged, see compute_charge_streamed()
+	load->ticks = ns_to_tsc(load->iters * iter_ns);
+	debug("compute: %u %s iterations per request", load->iters, load->kernel->name);
+	return 0;
+}
+
+void cleanup_compute_load(struct server_context_t *ctx) {
+	struct compute_load_t *load = &ctx->load;
+
+	if (load->kernel && load->kernel->cleanup)
+		load->kernel->cleanup();
+	load->kernel = NULL;
+}
+
+static void submit_responses(
+	struct server_context_t *ctx,
+	unsigned int idx,
+	struct queue_head *first,
+	struct queue_head *last,
+	unsigned int n
+) {
+	queue_put_list(first, last, n, ctx->queues.submitter_inbox[idx]);
+	doorbell_ring(&ctx->doorbells.submit[idx]);
+}
 
-		if ((as_nanoseconds(&cur_time) - as_nanoseconds(&start_time)) >= nsec)
-			break;
+/*
+ * Compute a batch of requests and pass the responses on, splicing each run
+ * bound for the same submitter into its inbox at once.
+ */
+static void execute_requests(struct server_context_t *ctx, struct queue_head *batch[], unsigned int n) {
+	struct request_t *reqs[SERVER_BATCH_MAX];
+	struct response_t *res[SERVER_BATCH_MAX];
+	struct queue_head *first = NULL, *last = NULL;
+	unsigned int idx = 0, nr = 0;
+
+	for (unsigned int i = 0; i < n; i++) {
+		struct server_buffer_t *buff = container_of(batch[i], struct server_buffer_t, q);
+		trace_stamp(ctx, buff, TRACE_COMPUTE_START);
+		reqs[i] = &buff->req;
+		res[i] = &buff->res;
 	}
+	compute_requests(&ctx->load, reqs, res, n);
+
+	for (unsigned int i = 0; i < n; i++) {
+		struct server_buffer_t *buff = container_of(batch[i], struct server_buffer_t, q);
+		trace_stamp(ctx, buff, TRACE_COMPUTE_DONE);
+		// debug("conn %d: compute id %d ", buff->conn->fd, buff->res.id);
+
+		if (first && buff->conn->submitidx != (int) idx) {
+			submit_responses(ctx, idx, first, last, nr);
+			first = NULL;
+		}
+		if (first) {
+			last->next = &buff->q;
+			nr++;
+		} else {
+			first = &buff->q;
+			idx = buff->conn->submitidx;
+			nr = 1;
+		}
+		last = &buff->q;
+	}
+	if (first)
+		submit_responses(ctx, idx, first, last, nr);
+}
 
-	res->id = req->id;
+/*
+ * Take up to max requests from the first non-empty sibling inbox, starting
+ * after the last victim so that thieves spread over their siblings.
+ */
+static unsigned int steal_requests(
+	struct server_context_t *ctx,
+	unsigned int self,
+	unsigned int *victim,
+	struct queue_head *batch[],
+	unsigned int max
+) {
+	unsigned int n = ctx->cfg.threads.compute;
+	for (unsigned int i = 0; i < n; i++) {
+		*victim = (*victim + 1) % n;
+		if (*victim == self)
+			continue;
+		unsigned int got = queue_get_batch(ctx->queues.compute_inbox[*victim], batch, max);
+		if (got)
+			return got;
+	}
+	return 0;
 }
 
 void *compute_worker(void *opaque, struct thread_info_t *ti) {
 	struct server_context_t *ctx = opaque;
-	struct queue_root *inbox = ctx->queues.compute_inbox[ti->group_info.current];
+	unsigned int self = ti->group_info.current;
+	struct queue_root *inbox = ctx->queues.compute_inbox[self];
+	struct compute_stats_t *stats = &ctx->compute_stats[self];
+	unsigned int nbatch = ctx->cfg.threads.batch;
+	unsigned int steal = ctx->cfg.threads.steal;
+	unsigned int victim = self;
+	struct queue_head *batch[SERVER_BATCH_MAX];
+	struct doorbell_t *db = &ctx->doorbells.compute[self];
+	unsigned int idle = 0;
+
+	syscall_stats_register(ti->name);
+	if (steal > SERVER_BATCH_MAX)
+		steal = SERVER_BATCH_MAX;
+
 	while(!ctx->stopping) {
-		struct queue_head *q = queue_get(inbox);
-		if (!q)
-			continue;
-		struct server_buffer_t *buff = container_of(q, struct server_buffer_t, q);
-		struct message_t *msg = &buff->msg;
-		compute_request(ctx->cfg.load.compute_dur, &msg->req, &msg->res);
-		// debug("conn %d: compute id %d ", buff->conn->fd, msg->res.id);
-		queue_put(&buff->q, ctx->queues.submitter_inbox[buff->conn->submitidx]);
+		stats->loops++;
+		unsigned int n = queue_get_batch(inbox, batch, nbatch);
+		if (!n && steal) {
+			n = steal_requests(ctx, self, &victim, batch, steal);
+			stats->stolen += n;
+		}
+		if (n) {
+			idle = 0;
+		} else {
+			// Park only once there is nothing to steal either
+			n = doorbell_queue_get_batch(inbox, db, ctx->cfg.threads.spin, &idle, batch, nbatch);
+			if (!n)
+				continue;
+		}
+		execute_requests(ctx, batch, n);
+		stats->executed += n;
+		stats->batches++;
 	}
 	return NULL;
 }
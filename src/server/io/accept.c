@@ -1,10 +1,13 @@
 #include <sys/epoll.h>
 #include <errno.h>
+#include <string.h>
 #include <unistd.h>
 #define NEED_DEBUG 1
 #include "include/debug.h"
+#include "include/executor.h"
 #include "include/kerncall.h"
 #include "include/server.h"
+#include "include/syscall_stats.h"
 
 #include "io.h"
 
@@ -20,6 +23,15 @@ static int handle_accept(struct server_context_t *ctx) {
 	}
 
 	struct server_connection_t *conn = container_of(q, struct server_connection_t, q);
+	setup_connection(ctx, conn, fd);
+	return epoll_set_conn_state(ctx, conn, EPOLLIN);
+}
+
+void setup_connection(
+	struct server_context_t *ctx,
+	struct server_connection_t *conn,
+	int fd
+) {
 	conn->sent = conn->received = conn->processed = 0;
 
 	conn->fd = fd;
@@ -27,13 +39,18 @@ static int handle_accept(struct server_context_t *ctx) {
 	conn->submitidx = ctx->io.next % ctx->cfg.threads.submit;
 	conn->computeidx = ctx->io.next % ctx->cfg.threads.compute;
 	conn->epoll_fd = ctx->io.epoll_fds[conn->ioidx];
-	init_queue_root(&conn->send_queue);
 	conn->recvbuf = NULL;
+	conn->sendbuf = NULL;
+	conn->send_posted = 0;
 	conn->epoll_state = 0;
+	memset(&conn->uring, 0, sizeof (conn->uring));
+	conn->ring.head = conn->ring.tail = 0;
+	conn->ring.pending = 0;
+	conn->sendv.nr = 0;
+	conn->sendv.since = 0;
 	conn->closed = 0;
 	lock_init(&conn->lock);
 	debug("created session %d on io %d compute %d submit %d (%p)" , conn->fd, conn->ioidx, conn->computeidx, conn->submitidx, conn);
-	return epoll_set_conn_state(ctx, conn, EPOLLIN);
 }
 
 struct accept_arg_t {
@@ -72,6 +89,11 @@ void *accept_worker(void *opaque, struct thread_info_t *ti) {
 	int listenfd = ctx->io.listen_fd;
 	long ret = 0;
 
+	syscall_stats_register(ti->name);
+	syscall_exec_register();
+	if (ctx->io.engine == IO_ENGINE_URING)
+		return uring_accept_worker(ctx, ti);
+
 	int epollfd = Z_epoll_create1(0);
 	if (epollfd < 0) {
 		Z_perror("epoll_create1");
@@ -0,0 +1,35 @@
+#include <linux/futex.h>
+#include <time.h>
+
+#include "include/doorbell.h"
+#include "include/utils.h"
+
+#include "io.h"
+
+static uint64_t doorbell_now(void) {
+	struct timespec ts;
+	if (Z_clock_gettime(CLOCK_MONOTONIC, &ts))
+		return 0;
+	return as_nanoseconds(&ts);
+}
+
+void doorbell_wait(struct doorbell_t *db) {
+	struct timespec timeout = {
+		.tv_sec = 0,
+		.tv_nsec = DOORBELL_PARK_MSEC * 1000000L,
+	};
+	uint64_t start = doorbell_now();
+
+	Z_futex(&db->state, FUTEX_WAIT_PRIVATE, DOORBELL_PARKED, &timeout);
+
+	// A producer flips the state back before waking us up
+	if (__atomic_exchange_n(&db->state, DOORBELL_AWAKE, __ATOMIC_ACQ_REL) == DOORBELL_AWAKE)
+		db->wakeups++;
+	db->parks++;
+	db->park_ns += doorbell_now() - start;
+}
+
+void doorbell_wake(struct doorbell_t *db) {
+	if (__atomic_exchange_n(&db->state, DOORBELL_AWAKE, __ATOMIC_ACQ_REL) == DOORBELL_PARKED)
+		Z_futex(&db->state, FUTEX_WAKE_PRIVATE, 1, NULL);
+}
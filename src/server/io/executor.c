@@ -0,0 +1,197 @@
+#include <linux/futex.h>
+#include <errno.h>
+#include <string.h>
+
+#define NEED_DEBUG 1
+#include "include/debug.h"
+#include "include/executor.h"
+#include "include/kerncall.h"
+#include "include/server.h"
+#include "include/syscall_stats.h"
+
+#include "io.h"
+
+struct syscall_executor_t syscall_executor;
+
+// This thread's page, see syscall_exec_register()
+static __thread struct exec_page_t *exec_page;
+
+int syscall_exec_register(void) {
+	if (!syscall_exec_routed() || exec_page)
+		return 0;
+	unsigned int idx = __atomic_fetch_add(&syscall_executor.nr_pages, 1, __ATOMIC_RELAXED);
+	if (idx >= EXEC_MAX_THREADS) {
+		debug("executor: more than %u threads, making syscalls directly", EXEC_MAX_THREADS);
+		return 0;
+	}
+	struct exec_page_t *page = aligned_alloc(64, sizeof (*page));
+	if (!page) {
+		Z_perror("aligned_alloc");
+		return -1;
+	}
+	memset(page, 0, sizeof (*page));
+	page->idx = idx;
+	__atomic_store_n(&syscall_executor.pages[idx], page, __ATOMIC_RELEASE);
+	exec_page = page;
+	return 0;
+}
+
+static void exec_wait(struct exec_entry_t *e) {
+	for (unsigned int i = 0; i < syscall_executor.spin; i++) {
+		if (__atomic_load_n(&e->state, __ATOMIC_ACQUIRE) == EXEC_DONE)
+			return;
+		__builtin_ia32_pause();
+	}
+	int state = EXEC_SUBMITTED;
+	if (!__atomic_compare_exchange_n(&e->state, &state, EXEC_WAITING, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+		return; // done meanwhile
+	while (__atomic_load_n(&e->state, __ATOMIC_ACQUIRE) != EXEC_DONE)
+		Z_futex(&e->state, FUTEX_WAIT_PRIVATE, EXEC_WAITING, NULL);
+}
+
+/*
+ * Write the calls into free entries and flag them all at once, then ring
+ * the executor. Calls that find no entry, without a page or with all of
+ * them in flight, are made right here.
+ */
+void syscall_exec_post(struct z_syscall_t *calls, unsigned int n) {
+	struct exec_page_t *page = exec_page;
+	unsigned long posted = 0;
+
+	for (unsigned int i = 0; i < n; i++) {
+		if (!page || !~page->used) {
+			Z_syscall_direct(&calls[i]);
+			calls[i].slot = -1;
+			continue;
+		}
+		int slot = __builtin_ctzl(~page->used);
+		struct exec_entry_t *e = &page->entries[slot];
+		e->nr = calls[i].nr;
+		memcpy(e->args, calls[i].args, sizeof (e->args));
+		e->state = EXEC_SUBMITTED;
+		page->used |= 1UL << slot;
+		posted |= 1UL << slot;
+		calls[i].slot = slot;
+	}
+	if (!posted)
+		return;
+	// The executor takes active first, then posted: flag in reverse
+	__atomic_fetch_or(&page->posted, posted, __ATOMIC_RELEASE);
+	__atomic_fetch_or(&syscall_executor.active, 1UL << page->idx, __ATOMIC_SEQ_CST);
+	doorbell_ring(&syscall_executor.db);
+}
+
+/* Wait for the posted calls in order and free their entries */
+void syscall_exec_reap(struct z_syscall_t *calls, unsigned int n) {
+	struct exec_page_t *page = exec_page;
+
+	for (unsigned int i = 0; i < n; i++) {
+		int slot = calls[i].slot;
+		if (slot < 0)
+			continue;
+		struct exec_entry_t *e = &page->entries[slot];
+		exec_wait(e);
+		calls[i].ret = e->ret;
+		e->state = EXEC_FREE;
+		page->used &= ~(1UL << slot);
+		calls[i].slot = -1;
+	}
+}
+
+long syscall_exec(long nr, long a1, long a2, long a3, long a4, long a5, long a6) {
+	struct z_syscall_t call = {
+		.nr = nr,
+		.args = { a1, a2, a3, a4, a5, a6 },
+	};
+
+	syscall_exec_post(&call, 1);
+	syscall_exec_reap(&call, 1);
+	if (call.ret < 0) {
+		errno = -call.ret;
+		return -1;
+	}
+	return call.ret;
+}
+
+/* Make the calls posted on page, returns how many there were */
+static unsigned int exec_run_page(struct exec_page_t *page) {
+	unsigned long posted = __atomic_exchange_n(&page->posted, 0, __ATOMIC_ACQUIRE);
+	unsigned int n = 0;
+
+	for (; posted; posted &= posted - 1, n++) {
+		struct exec_entry_t *e = &page->entries[__builtin_ctzl(posted)];
+		struct z_syscall_t call = {
+			.nr = e->nr,
+		};
+		memcpy(call.args, e->args, sizeof (call.args));
+		Z_syscall_direct(&call);
+		e->ret = call.ret;
+		if (__atomic_exchange_n(&e->state, EXEC_DONE, __ATOMIC_ACQ_REL) == EXEC_WAITING)
+			Z_futex(&e->state, FUTEX_WAKE_PRIVATE, 1, NULL);
+	}
+	return n;
+}
+
+/* Visit only the pages flagged active, an idle sweep is a single load */
+static unsigned int exec_sweep(struct syscall_executor_t *exec) {
+	unsigned int n = 0;
+
+	// Ordered after the parked store in __syscall_executor_worker()
+	if (!__atomic_load_n(&exec->active, __ATOMIC_SEQ_CST))
+		return 0;
+	unsigned long active = __atomic_exchange_n(&exec->active, 0, __ATOMIC_ACQUIRE);
+	for (; active; active &= active - 1)
+		n += exec_run_page(exec->pages[__builtin_ctzl(active)]);
+	return n;
+}
+
+static long __syscall_executor_worker(struct syscall_executor_t *exec) {
+	unsigned int idle = 0, iter = 0;
+
+	while (!__atomic_load_n(&exec->stop, __ATOMIC_ACQUIRE) && iter++ < 100000) {
+		unsigned int n = exec_sweep(exec);
+		exec->sweeps++;
+		exec->executed += n;
+		if (n) {
+			idle = 0;
+			continue;
+		}
+		if (idle++ < exec->spin) {
+			__builtin_ia32_pause();
+			continue;
+		}
+		idle = 0;
+
+		// Same protocol as doorbell_queue_get_batch(): park, look again, sleep
+		__atomic_store_n(&exec->db.state, DOORBELL_PARKED, __ATOMIC_SEQ_CST);
+		n = exec_sweep(exec);
+		exec->executed += n;
+		if (n) {
+			__atomic_store_n(&exec->db.state, DOORBELL_AWAKE, __ATOMIC_RELAXED);
+			continue;
+		}
+		doorbell_wait(&exec->db);
+	}
+	return 0;
+}
+
+void *syscall_executor_worker(void *opaque, struct thread_info_t *ti) {
+	struct server_context_t *ctx = opaque;
+	long ret = 0;
+
+	syscall_stats_register(ti->name);
+	while (!__atomic_load_n(&syscall_executor.stop, __ATOMIC_ACQUIRE) && !ret) {
+		if (KERNCALL_COND(ctx->cfg, executor)) {
+			ret = kerncall_spawn(
+				(uintptr_t) __syscall_executor_worker,
+				(unsigned long) &syscall_executor
+			);
+			asm(".align 32");
+		}
+		else
+			ret = __syscall_executor_worker(&syscall_executor);
+	}
+	debug("executor: %lu calls in %lu sweeps, parks %lu", syscall_executor.executed,
+	      syscall_executor.sweeps, syscall_executor.db.parks);
+	return (void *) ret;
+}
@@ -4,8 +4,10 @@
 
 #define NEED_DEBUG 1
 #include "include/debug.h"
+#include "include/executor.h"
 #include "include/kerncall.h"
 #include "include/server.h"
+#include "include/syscall_stats.h"
 
 #include "io.h"
 
@@ -14,19 +16,79 @@
        __typeof__ (b) _b = (b); \
      _a > _b ? _b : _a; })
 
+static void ring_pending_add(
+	struct server_context_t *ctx,
+	struct server_connection_t *conn
+) {
+	if (conn->ring.pending)
+		return;
+	conn->ring.pending = 1;
+	conn->ring.pending_next = ctx->io.ring_pending[conn->ioidx];
+	ctx->io.ring_pending[conn->ioidx] = conn;
+}
+
+static void ring_pending_del(
+	struct server_context_t *ctx,
+	struct server_connection_t *conn
+) {
+	struct server_connection_t **p = &ctx->io.ring_pending[conn->ioidx];
+
+	if (!conn->ring.pending)
+		return;
+	while (*p != conn)
+		p = &(*p)->ring.pending_next;
+	*p = conn->ring.pending_next;
+	conn->ring.pending = 0;
+}
+
+static void send_delayed_add(
+	struct server_context_t *ctx,
+	struct server_connection_t *conn
+) {
+	if (conn->sendv.delayed)
+		return;
+	conn->sendv.delayed = 1;
+	conn->sendv.delayed_next = ctx->io.send_delayed[conn->ioidx];
+	ctx->io.send_delayed[conn->ioidx] = conn;
+}
+
+static void send_delayed_del(
+	struct server_context_t *ctx,
+	struct server_connection_t *conn
+) {
+	struct server_connection_t **p = &ctx->io.send_delayed[conn->ioidx];
+
+	if (!conn->sendv.delayed)
+		return;
+	while (*p != conn)
+		p = &(*p)->sendv.delayed_next;
+	*p = conn->sendv.delayed_next;
+	conn->sendv.delayed = 0;
+}
+
 static int finish_connection(
 	struct server_context_t *ctx,
 	struct server_connection_t *conn
 ) {
+	struct buffer_cache_t *cache = &ctx->caches.io[conn->ioidx];
+
 	if (!trylock(&conn->lock)) {
 		debug("conn %d: termination delayed, submitter has lock", conn->fd);
 		return 0;
 	}
+	ring_pending_del(ctx, conn);
+	send_delayed_del(ctx, conn);
 
 	if (conn->sendbuf)
-		queue_put(&conn->sendbuf->q, ctx->queues.empty_buffers);
+		buffer_put(ctx, cache, conn->sendbuf);
 	if (conn->recvbuf)
-		queue_put(&conn->recvbuf->q, ctx->queues.empty_buffers);
+		buffer_put(ctx, cache, conn->recvbuf);
+	// Unsent coalesced responses count as sent, like the drained send queue
+	for (unsigned int i = 0; i < conn->sendv.nr; i++) {
+		conn->sent++;
+		buffer_put(ctx, cache, conn->sendv.bufs[i]);
+	}
+	conn->sendv.nr = 0;
 
 	// remove from epoll
 	Z_close(conn->fd);
@@ -37,7 +99,7 @@ static int finish_connection(
 		q = queue_get(&conn->send_queue);
 		if (q) {
 			conn->sent++;
-			queue_put(q, ctx->queues.empty_buffers);
+			buffer_put(ctx, cache, container_of(q, struct server_buffer_t, q));
 		}
 	} while (q);
 	conn->closed = 1;
@@ -55,88 +117,315 @@ static int finish_connection(
 	}
 }
 
+static int handle_response(
+	struct server_context_t *ctx,
+	struct server_connection_t *conn
+);
+
+/* In run-to-completion mode responses go out as soon as reading stalls */
+static int handle_request_done(
+	struct server_context_t *ctx,
+	struct server_connection_t *conn
+) {
+	if (ctx->mode != SERVER_MODE_RTC)
+		return 0;
+	return handle_response(ctx, conn);
+}
+
+/*
+ * Completed requests are collected and handed to the next stage up to
+ * threads.batch at a time, and before leaving for any reason.
+ */
+struct request_batch_t {
+	struct server_buffer_t *first;
+	struct server_buffer_t *last;
+	unsigned int nr;
+};
+
+static void flush_request_batch(
+	struct server_context_t *ctx,
+	struct server_connection_t *conn,
+	struct request_batch_t *batch
+) {
+	if (!batch->nr)
+		return;
+	io_dispatch_requests(ctx, conn, batch->first, batch->last, batch->nr);
+	batch->nr = 0;
+}
+
+static void add_request_batch(
+	struct server_context_t *ctx,
+	struct server_connection_t *conn,
+	struct request_batch_t *batch,
+	struct server_buffer_t *buff
+) {
+	if (batch->nr)
+		batch->last->q.next = &buff->q;
+	else
+		batch->first = buff;
+	batch->last = buff;
+	if (++batch->nr >= ctx->cfg.threads.batch)
+		flush_request_batch(ctx, conn, batch);
+}
+
 static int handle_request(
 	struct server_context_t *ctx,
 	struct server_connection_t *conn
 ) {
+	struct buffer_cache_t *cache = &ctx->caches.io[conn->ioidx];
+	struct request_batch_t batch = { .nr = 0 };
+
 	while (1) {
 		struct server_buffer_t *buff = conn->recvbuf;
 
 		if (!buff) {
-			if (conn->received - conn->sent > ctx->cfg.load.readahead)
-				return 0;
-			struct queue_head *q = queue_get(ctx->queues.empty_buffers);
-			if (!q) {
+			if (conn->received + batch.nr - conn->sent > ctx->cfg.load.readahead) {
+				flush_request_batch(ctx, conn, &batch);
+				return handle_request_done(ctx, conn);
+			}
+			buff = io_request_start(ctx, cache, conn);
+			if (!buff) {
 				debug("conn %d: no buffer available, skipping", conn->fd);
-				return 0;
+				flush_request_batch(ctx, conn, &batch);
+				return handle_request_done(ctx, conn);
 			}
-			buff = container_of(q, struct server_buffer_t, q);
-			buff->conn = conn;
-			buff->left = sizeof (struct request_t);
-			buff->ptr = (unsigned char *) &buff->msg.req.id;
-			conn->recvbuf = buff;
 		}
-		size_t io_size = min(buff->left, ctx->cfg.load.max_io_size);
-		int len = Z_recv(conn->fd, buff->ptr, io_size, MSG_DONTWAIT);
-		if (len == -1 && errno == EAGAIN)
-			return 0;
-		else if (len <= 0)
-			return finish_connection(ctx, conn);
-		// debug("len = %d", len);
-		buff->left -= len;
-		buff->ptr += len;
-		if (!buff->left) {
-			// debug("conn %d: received message %d", conn->fd, buff->msg.req.id);
-			lock(&conn->lock);
-			conn->received++;
-			conn->recvbuf = NULL;
-			queue_put(&buff->q, ctx->queues.compute_inbox[conn->computeidx]);
-			unlock(&conn->lock);
+		if (buff->left) {
+			int streamed = buff->framed && (buff->req.flags & REQUEST_F_STREAMED);
+			unsigned char *dst = streamed ? conn->stream.window : buff->ptr;
+			size_t io_size = min(buff->left, ctx->cfg.load.max_io_size);
+			if (streamed)
+				io_size = min(io_size, ctx->cfg.load.stream_window);
+			int len = Z_recv(conn->fd, dst, io_size, MSG_DONTWAIT);
+			if (len == -1 && errno == EAGAIN) {
+				flush_request_batch(ctx, conn, &batch);
+				return handle_request_done(ctx, conn);
+			} else if (len <= 0) {
+				flush_request_batch(ctx, conn, &batch);
+				return finish_connection(ctx, conn);
+			}
+			// debug("len = %d", len);
+			if (streamed) {
+				io_request_stream(conn, buff, dst, len);
+			} else {
+				buff->left -= len;
+				buff->ptr += len;
+			}
+			if (buff->left)
+				continue;
 		}
+		if (!buff->framed) {
+			if (io_request_too_long(ctx, buff)) {
+				debug("conn %d: %u byte payload too long", conn->fd, buff->req.len);
+				flush_request_batch(ctx, conn, &batch);
+				return finish_connection(ctx, conn);
+			}
+			buff = io_request_framed(ctx, cache, conn);
+			if (!buff) {
+				debug("conn %d: no buffer available, skipping", conn->fd);
+				flush_request_batch(ctx, conn, &batch);
+				return handle_request_done(ctx, conn);
+			}
+			if (buff->left)
+				continue;
+		}
+
+		// debug("conn %d: received message %d", conn->fd, buff->req.id);
+		conn->recvbuf = NULL;
+		trace_stamp(ctx, buff, TRACE_RECV);
+		add_request_batch(ctx, conn, &batch, buff);
 	}
 }
 
-static int handle_response(
+/*
+ * Ring mode: read whatever the socket holds, up to max_io_size, into the
+ * connection's receive ring with one call and slice it into requests. The
+ * ring is only refilled once drained, so it never wraps. Bytes left in it
+ * when requests cannot be started (readahead, no buffer) are not visible
+ * to epoll any more; the connection is retried from the pending list.
+ */
+static int handle_request_ring(
 	struct server_context_t *ctx,
 	struct server_connection_t *conn
 ) {
+	struct buffer_cache_t *cache = &ctx->caches.io[conn->ioidx];
+	struct request_batch_t batch = { .nr = 0 };
+	size_t io_size = min(ctx->cfg.load.recv_ring, ctx->cfg.load.max_io_size);
+
 	while (1) {
-		struct server_buffer_t *buff = conn->sendbuf;
-		// dump_conn(conn);
+		struct server_buffer_t *buff = conn->recvbuf;
+
+		if (buff && !buff->left) {
+			if (!buff->framed) {
+				if (io_request_too_long(ctx, buff)) {
+					debug("conn %d: %u byte payload too long", conn->fd, buff->req.len);
+					flush_request_batch(ctx, conn, &batch);
+					return finish_connection(ctx, conn);
+				}
+				buff = io_request_framed(ctx, cache, conn);
+				if (!buff)
+					goto out_stalled;
+				if (buff->left)
+					continue;
+			}
+			conn->recvbuf = NULL;
+			trace_stamp(ctx, buff, TRACE_RECV);
+			add_request_batch(ctx, conn, &batch, buff);
+			continue;
+		}
+		if (!buff && conn->received + batch.nr - conn->sent > ctx->cfg.load.readahead)
+			goto out_stalled;
+		if (conn->ring.head == conn->ring.tail) {
+			int len = Z_recv(conn->fd, conn->ring.buf, io_size, MSG_DONTWAIT);
+			if (len == -1 && errno == EAGAIN) {
+				flush_request_batch(ctx, conn, &batch);
+				return handle_request_done(ctx, conn);
+			} else if (len <= 0) {
+				flush_request_batch(ctx, conn, &batch);
+				return finish_connection(ctx, conn);
+			}
+			conn->ring.head = 0;
+			conn->ring.tail = len;
+		}
 		if (!buff) {
+			buff = io_request_start(ctx, cache, conn);
+			if (!buff)
+				goto out_stalled;
+		}
+		size_t n = min(buff->left, conn->ring.tail - conn->ring.head);
+		io_request_fill(conn, buff, conn->ring.buf + conn->ring.head, n);
+		conn->ring.head += n;
+	}
+
+out_stalled:
+	flush_request_batch(ctx, conn, &batch);
+	if (conn->ring.head != conn->ring.tail || (conn->recvbuf && !conn->recvbuf->left))
+		ring_pending_add(ctx, conn);
+	return handle_request_done(ctx, conn);
+}
+
+/* Retry the connections handle_request_ring() left data behind on */
+static void retry_ring_pending(struct server_context_t *ctx, unsigned int ioidx) {
+	struct server_connection_t *conn = ctx->io.ring_pending[ioidx];
+
+	ctx->io.ring_pending[ioidx] = NULL;
+	while (conn) {
+		struct server_connection_t *next = conn->ring.pending_next;
+		conn->ring.pending = 0;
+		if (handle_request_ring(ctx, conn))
+			Z_perror("handle_request_ring");
+		conn = next;
+	}
+}
+
+/*
+ * The socket is full. The submitter turns EPOLLOUT on in the staged
+ * pipeline; in run-to-completion mode nobody else will.
+ */
+static int handle_response_stalled(
+	struct server_context_t *ctx,
+	struct server_connection_t *conn
+) {
+	if (ctx->mode != SERVER_MODE_RTC)
+		return 0;
+	lock(&conn->lock);
+	int err = epoll_set_conn_state(ctx, conn, conn->epoll_state | EPOLLOUT);
+	unlock(&conn->lock);
+	return err;
+}
+
+/*
+ * A short batch is held back. EPOLLOUT goes off, a writable socket would
+ * only spin epoll_wait, and the IO loop sleeps no longer than the batch
+ * may wait, see retry_send_delayed(). A new response turns EPOLLOUT back
+ * on and gets the batch another look.
+ */
+static int handle_response_delayed(
+	struct server_context_t *ctx,
+	struct server_connection_t *conn
+) {
+	send_delayed_add(ctx, conn);
+	lock(&conn->lock);
+	int err = epoll_set_conn_state(ctx, conn, conn->epoll_state & ~EPOLLOUT);
+	unlock(&conn->lock);
+	return err;
+}
+
+/*
+ * Coalesced responses: what is on the send queue, up to load.send_iov
+ * responses and max_io_size bytes, goes out with one sendmsg. With
+ * load.send_delay set, a short batch is held back until it fills up or its
+ * oldest response has waited that long.
+ */
+static int handle_response_vec(
+	struct server_context_t *ctx,
+	struct server_connection_t *conn
+) {
+	struct io_stats_t *stats = &ctx->io_stats[conn->ioidx];
+	struct buffer_cache_t *cache = &ctx->caches.io[conn->ioidx];
+	unsigned int max = ctx->cfg.load.send_iov;
+
+	while (1) {
+		struct server_buffer_t **bufs = conn->sendv.bufs;
+		struct iovec iov[SERVER_SEND_IOV_MAX];
+		size_t io_size = 0;
+		unsigned int n = 0;
+
+		while (conn->sendv.nr < max) {
 			struct queue_head *q = queue_get(&conn->send_queue);
-			if (!q) {
-				// debug("No response ready, skipping");
-				return 0;
-			}
-			buff = container_of(q, struct server_buffer_t, q);
-			buff->conn = conn;
-			buff->left = sizeof (struct response_t);
-			buff->ptr = (unsigned char *) &buff->msg.res.id;
-			conn->sendbuf = buff;
+			if (!q)
+				break;
+			struct server_buffer_t *buff = container_of(q, struct server_buffer_t, q);
+			io_response_start(conn, buff);
+			bufs[conn->sendv.nr++] = buff;
 		}
-		// dump_conn(conn);
-		size_t io_size = min(buff->left, ctx->cfg.load.max_io_size);
-		int len = Z_send(conn->fd, buff->ptr, io_size, MSG_DONTWAIT);
+		conn->sendbuf = NULL;
+		if (!conn->sendv.nr)
+			return 0;
+		if (conn->sendv.nr < max && ctx->io.send_delay) {
+			uint64_t now = rdtsc();
+			if (!conn->sendv.since)
+				conn->sendv.since = now;
+			if (now - conn->sendv.since < ctx->io.send_delay)
+				return handle_response_delayed(ctx, conn);
+		}
+
+		for (; n < conn->sendv.nr && io_size < ctx->cfg.load.max_io_size; n++) {
+			iov[n].iov_base = bufs[n]->ptr;
+			iov[n].iov_len = min(bufs[n]->left, ctx->cfg.load.max_io_size - io_size);
+			io_size += iov[n].iov_len;
+		}
+		struct msghdr msg = {
+			.msg_iov = iov,
+			.msg_iovlen = n,
+		};
+		ssize_t len = Z_sendmsg(conn->fd, &msg, MSG_DONTWAIT);
 		if (len == -1) {
 			if (errno == EAGAIN)
-				return 0;
+				return handle_response_stalled(ctx, conn);
 			else
 				return finish_connection(ctx, conn);
 		}
-		// debug("len = %d", len);
+		stats->sends++;
+		conn->sendv.since = 0;
 
-		buff->left -= len;
-		buff->ptr += len;
-		if (len < io_size)
-			return 0;
-		if (buff->left)
-			continue;
-
-		// debug("conn %d: sent message %d", conn->fd, buff->msg.req.id);
-		conn->sent++;
-		conn->sendbuf = NULL;
-		queue_put(&buff->q, ctx->queues.empty_buffers);
+		// Retire what went out in full, the next one may have gone in part
+		unsigned int done = 0;
+		for (size_t rest = len; done < conn->sendv.nr && rest; done++) {
+			struct server_buffer_t *buff = bufs[done];
+			if (rest < buff->left) {
+				buff->left -= rest;
+				buff->ptr += rest;
+				break;
+			}
+			rest -= buff->left;
+			conn->sent++;
+			trace_request_done(ctx, buff);
+			buffer_put(ctx, cache, buff);
+		}
+		conn->sendv.nr -= done;
+		memmove(bufs, bufs + done, conn->sendv.nr * sizeof (bufs[0]));
+		stats->responses += done;
 
 		lock(&conn->lock);
 		int err = 0;
@@ -148,26 +437,226 @@ static int handle_response(
 			debug("err = %d", err);
 			return err;
 		}
+		if ((size_t) len < io_size)
+			return handle_response_stalled(ctx, conn);
+	}
+}
+
+/* The response being sent, or the next one off the send queue */
+static struct server_buffer_t *response_current(struct server_connection_t *conn) {
+	if (!conn->sendbuf) {
+		struct queue_head *q = queue_get(&conn->send_queue);
+		if (!q)
+			return NULL;
+		io_response_start(conn, container_of(q, struct server_buffer_t, q));
+	}
+	return conn->sendbuf;
+}
+
+/*
+ * len bytes of buff went out, or -1 with errno set. *more is set if the
+ * connection can take the next send right away.
+ */
+static int handle_response_sent(
+	struct server_context_t *ctx,
+	struct server_connection_t *conn,
+	struct server_buffer_t *buff,
+	size_t io_size,
+	ssize_t len,
+	int *more
+) {
+	*more = 0;
+	if (len == -1) {
+		if (errno == EAGAIN)
+			return handle_response_stalled(ctx, conn);
+		else
+			return finish_connection(ctx, conn);
+	}
+	// debug("len = %d", len);
+	ctx->io_stats[conn->ioidx].sends++;
+
+	buff->left -= len;
+	buff->ptr += len;
+	if ((size_t) len < io_size)
+		return handle_response_stalled(ctx, conn);
+	*more = 1;
+	if (buff->left)
+		return 0;
+
+	// debug("conn %d: sent message %d", conn->fd, buff->req.id);
+	conn->sent++;
+	ctx->io_stats[conn->ioidx].responses++;
+	conn->sendbuf = NULL;
+	trace_request_done(ctx, buff);
+	buffer_put(ctx, &ctx->caches.io[conn->ioidx], buff);
+
+	lock(&conn->lock);
+	int err = 0;
+	if (conn->processed == conn->sent)
+		err = epoll_set_conn_state(ctx, conn, conn->epoll_state & ~EPOLLOUT);
+	unlock(&conn->lock);
+
+	if (err) {
+		debug("err = %d", err);
+		*more = 0;
+	}
+	return err;
+}
+
+static int handle_response(
+	struct server_context_t *ctx,
+	struct server_connection_t *conn
+) {
+	int more = 1;
+
+	if (ctx->cfg.load.send_iov > 1)
+		return handle_response_vec(ctx, conn);
+
+	while (more) {
+		struct server_buffer_t *buff = response_current(conn);
+		// dump_conn(conn);
+		if (!buff) {
+			// debug("No response ready, skipping");
+			return 0;
+		}
+		size_t io_size = min(buff->left, ctx->cfg.load.max_io_size);
+		int len = Z_send(conn->fd, buff->ptr, io_size, MSG_DONTWAIT);
+		int err = handle_response_sent(ctx, conn, buff, io_size, len, &more);
+		if (err)
+			return err;
 	}
+	return 0;
 }
 
 #define MAX_EVENTS	10
 
-struct io_arg_t {
-	struct server_context_t *ctx;
-	struct thread_info_t *ti;
+/*
+ * With io.send_batch, the first send to every connection that reported
+ * EPOLLOUT in one epoll_wait goes out in a single Z_syscall_post(); any
+ * further sends are made by handle_response() as usual once it is reaped.
+ * With the syscall executor the sends are only posted: the IO loop goes on
+ * with the other connections and reaps the batch when it is done with the
+ * events, or before touching a connection whose send is still posted.
+ */
+struct response_batch_t {
+	struct z_syscall_t calls[MAX_EVENTS];
+	struct server_connection_t *conns[MAX_EVENTS];
+	struct server_buffer_t *bufs[MAX_EVENTS];
+	unsigned int n;
 };
 
+static void post_response_batch(
+	struct server_context_t *ctx,
+	struct response_batch_t *batch,
+	struct epoll_event events[],
+	unsigned int nevents
+) {
+	unsigned int n = 0;
+
+	for (unsigned int i = 0; i < nevents; i++) {
+		struct server_connection_t *conn = events[i].data.ptr;
+		if ((events[i].events & (EPOLLOUT | EPOLLERR)) != EPOLLOUT)
+			continue;
+		struct server_buffer_t *buff = response_current(conn);
+		if (!buff)
+			continue;
+		z_syscall_send(&batch->calls[n], conn->fd, buff->ptr,
+			       min(buff->left, ctx->cfg.load.max_io_size), MSG_DONTWAIT);
+		conn->send_posted = 1;
+		batch->conns[n] = conn;
+		batch->bufs[n++] = buff;
+	}
+	batch->n = n;
+	if (n)
+		Z_syscall_post(batch->calls, n);
+}
+
+static void reap_response_batch(
+	struct server_context_t *ctx,
+	struct response_batch_t *batch
+) {
+	unsigned int n = batch->n;
+
+	if (!n)
+		return;
+	batch->n = 0;
+	Z_syscall_reap(batch->calls, n);
+	for (unsigned int i = 0; i < n; i++)
+		batch->conns[i]->send_posted = 0;
+
+	for (unsigned int i = 0; i < n; i++) {
+		ssize_t len = batch->calls[i].ret;
+		int more;
+		if (len < 0) {
+			errno = -len;
+			len = -1;
+		}
+		if (handle_response_sent(ctx, batch->conns[i], batch->bufs[i], batch->calls[i].args[2], len, &more) ||
+		    (more && handle_response(ctx, batch->conns[i])))
+			Z_perror("handle_response");
+	}
+}
+
+/*
+ * Send the held back batches that are due, returns how long the IO loop
+ * may sleep until the next one is, in nsec, or -1 if none is left.
+ */
+static int64_t retry_send_delayed(struct server_context_t *ctx, unsigned int ioidx) {
+	struct server_connection_t *conn = ctx->io.send_delayed[ioidx];
+	uint64_t now = rdtsc(), next = UINT64_MAX;
+
+	ctx->io.send_delayed[ioidx] = NULL;
+	while (conn) {
+		struct server_connection_t *next_conn = conn->sendv.delayed_next;
+		conn->sendv.delayed = 0;
+		// Gone out meanwhile when since was reset
+		if (conn->sendv.since) {
+			uint64_t due = conn->sendv.since + ctx->io.send_delay;
+			if (due <= now) {
+				if (handle_response(ctx, conn))
+					Z_perror("handle_response");
+			} else {
+				send_delayed_add(ctx, conn);
+			}
+		}
+		conn = next_conn;
+	}
+	// Including fresh batches handle_response() held back
+	for (conn = ctx->io.send_delayed[ioidx]; conn; conn = conn->sendv.delayed_next)
+		if (conn->sendv.since + ctx->io.send_delay < next)
+			next = conn->sendv.since + ctx->io.send_delay;
+	if (next == UINT64_MAX)
+		return -1;
+	return next > now ? tsc_to_ns(next - now) : 0;
+}
+
+// Poll interval while received bytes wait in a connection's ring
+#define RING_PENDING_MSEC	1
+
 static long __io_worker(struct io_arg_t *arg) {
 	struct server_context_t *ctx = arg->ctx;
 	struct thread_info_t *ti = arg->ti;
 	int *stopping = &ctx->stopping;
-	int epollfd = ctx->io.epoll_fds[ti->group_info.current];
+	unsigned int ioidx = ti->group_info.current;
+	int epollfd = ctx->io.epoll_fds[ioidx];
 	unsigned int iter = 0;
+	// Coalesced responses already take one sendmsg per connection
+	int send_batch = (ctx->cfg.io.send_batch || syscall_exec_routed()) && ctx->cfg.load.send_iov == 1;
+	struct response_batch_t batch = { .n = 0 };
+	// Batches held back before a respawn are looked at right away
+	int64_t delay_ns = ctx->io.send_delayed[ioidx] ? 0 : -1;
 
 	while (!*stopping && iter++ < 1000) {
 		struct epoll_event events[MAX_EVENTS];
-		int nevents = Z_epoll_wait(epollfd, events, MAX_EVENTS, 1000);
+		ctx->io_stats[ioidx].loops++;
+		uint64_t timeout_ns = ctx->io.ring_pending[ioidx] ? RING_PENDING_MSEC * 1000000UL : 1000000000UL;
+		if (delay_ns >= 0 && (uint64_t) delay_ns < timeout_ns)
+			timeout_ns = delay_ns;
+		struct timespec timeout = {
+			.tv_sec = timeout_ns / 1000000000UL,
+			.tv_nsec = timeout_ns % 1000000000UL,
+		};
+		int nevents = Z_epoll_pwait2(epollfd, events, MAX_EVENTS, &timeout);
 		if (nevents == -1) {
 			if (errno  == EINTR) {
 				debug("epoll intr");
@@ -180,22 +669,27 @@ static long __io_worker(struct io_arg_t *arg) {
 				Z_perror("epoll_wait");
 				return -1;
 			}
-		} else if (nevents == 0) {
+		} else if (nevents == 0 && !ctx->io.ring_pending[ioidx] && !ctx->io.send_delayed[ioidx]) {
 			return 0;
 		}
 
-		for (unsigned int i = 0; i < nevents; i++) {
+		if (send_batch)
+			post_response_batch(ctx, &batch, events, nevents);
+		for (int i = 0; i < nevents; i++) {
 			struct server_connection_t *conn = events[i].data.ptr;
 			if (!conn) {
 				debug("bad conn");
+				reap_response_batch(ctx, &batch);
 				return -1;
 			}
+			if (conn->send_posted)
+				reap_response_batch(ctx, &batch);
 			if (events[i].events & EPOLLERR) {
 				debug("conn %d: err event", conn->fd);
 				finish_connection(ctx, conn);
 			} else {
 				// Send responses first to avoid read-starvation
-				if (events[i].events & EPOLLOUT) {
+				if ((events[i].events & EPOLLOUT) && !send_batch) {
 					// debug("conn %d: output event", conn->fd);
 					if (handle_response(ctx, conn)) {
 						Z_perror("handle_response");
@@ -204,13 +698,16 @@ static long __io_worker(struct io_arg_t *arg) {
 				}
 				if (events[i].events & EPOLLIN) {
 					// debug("conn %d: input event", conn->fd);
-					if (handle_request(ctx, conn)) {
+					if (conn->ring.buf ? handle_request_ring(ctx, conn) : handle_request(ctx, conn)) {
 						Z_perror("handle_request");
 						continue;
 					}
 				}
 			}
 		}
+		reap_response_batch(ctx, &batch);
+		retry_ring_pending(ctx, ioidx);
+		delay_ns = ctx->io.send_delayed[ioidx] ? retry_send_delayed(ctx, ioidx) : -1;
 	}
 	return 0;
 }
@@ -222,16 +719,22 @@ void *io_worker(void *opaque, struct thread_info_t *ti) {
 		.ti = ti,
 	};
 	long ret = 0;
+
+	syscall_stats_register(ti->name);
+	syscall_exec_register();
 	while (!ctx->stopping && !ret) {
+		long (*worker)(struct io_arg_t *) = __io_worker;
+		if (ctx->io.engine == IO_ENGINE_URING)
+			worker = __uring_io_worker;
 		if (KERNCALL_COND(ctx->cfg, io)) {
 			ret = kerncall_spawn(
-				(uintptr_t) __io_worker,
+				(uintptr_t) worker,
 				(unsigned long) &arg
 			);
 			asm(".align 32");
 		}
 		else
-			ret = __io_worker(&arg);
+			ret = worker(&arg);
 	}
 	return (void *) ret;
 }
\ No newline at end of file
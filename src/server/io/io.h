@@ -2,20 +2,79 @@
 #define __INTERNAL_IO_H
 
 #include <sys/socket.h>
+#include <sys/syscall.h>
+#include <string.h>
 #include <unistd.h>
 #include <sys/epoll.h>
+#include <linux/io_uring.h>
+#include <time.h>
 
 #include "include/server.h"
 int Z_accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags);
 ssize_t Z_recv(int sockfd, void *buf, size_t len, int flags);
 ssize_t Z_send(int sockfd, const void *buf, size_t len, int flags);
+ssize_t Z_sendmsg(int sockfd, const struct msghdr *msg, int flags);
 
+long Z_getpid(void);
 int Z_epoll_create1(int fl);
 int Z_close(int fd);
 int Z_epoll_ctl(int epfd, int op, int fd, struct epoll_event *event);
 int Z_epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeout);
+int Z_epoll_pwait2(int epfd, struct epoll_event *events, int maxevents, const struct timespec *timeout);
 void Z_perror(const char *s);
 int Z_ioctl(int fd, unsigned long request, unsigned long cmd);
+ssize_t Z_read(int fd, void *buf, size_t count);
+ssize_t Z_write(int fd, const void *buf, size_t count);
+long Z_futex(int *uaddr, int op, int val, const struct timespec *timeout);
+int Z_clock_gettime(clockid_t clk, struct timespec *ts);
+int Z_io_uring_setup(unsigned int entries, struct io_uring_params *p);
+int Z_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+		     unsigned int flags, void *arg, size_t argsz);
+int Z_io_uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args);
+
+/* One call of a Z_syscall_batch(), ret is its result or -errno */
+struct z_syscall_t {
+	long nr;
+	long args[6];
+	long ret;
+	int slot;	// executor entry between post and reap, -1 if made
+};
+
+void Z_syscall_batch(struct z_syscall_t *calls, unsigned int n);
+/*
+ * Z_syscall_batch() in two halves: with the syscall executor the calls are
+ * only posted and the caller goes on until it reaps them, otherwise they
+ * are made right away. Memory the calls point to must stay put until then.
+ */
+void Z_syscall_post(struct z_syscall_t *calls, unsigned int n);
+void Z_syscall_reap(struct z_syscall_t *calls, unsigned int n);
+/* One call made right here, never through the executor */
+void Z_syscall_direct(struct z_syscall_t *call);
+void syscall_exec_post(struct z_syscall_t *calls, unsigned int n);
+void syscall_exec_reap(struct z_syscall_t *calls, unsigned int n);
+
+static inline void z_syscall_send(struct z_syscall_t *call, int sockfd, const void *buf, size_t len, int flags) {
+	*call = (struct z_syscall_t) {
+		.nr = SYS_sendto,
+		.args = { sockfd, (uintptr_t) buf, len, flags, 0, 0 },
+		.slot = -1,
+	};
+}
+
+struct io_arg_t {
+	struct server_context_t *ctx;
+	struct thread_info_t *ti;
+};
+
+void setup_connection(
+	struct server_context_t *ctx,
+	struct server_connection_t *conn,
+	int fd
+);
+
+long __uring_io_worker(struct io_arg_t *arg);
+void *uring_accept_worker(struct server_context_t *ctx, struct thread_info_t *ti);
+int uring_conn_want_send(struct server_context_t *ctx, struct server_connection_t *conn);
 
 static inline int epoll_set_conn_state(
 	struct server_context_t *ctx,
@@ -44,4 +103,196 @@ static inline int epoll_set_conn_state(
 	return Z_epoll_ctl(conn->epoll_fd, op, conn->fd, &evt);
 }
 
+/*
+ * Hand a chain of n fully received requests, linked through q.next from
+ * first to last, over to the compute stage under one lock acquisition. In
+ * run-to-completion mode compute them right here and queue the responses.
+ */
+static inline void io_dispatch_requests(
+	struct server_context_t *ctx,
+	struct server_connection_t *conn,
+	struct server_buffer_t *first,
+	struct server_buffer_t *last,
+	unsigned int n
+) {
+	ctx->io_stats[conn->ioidx].received += n;
+	if (ctx->mode == SERVER_MODE_RTC) {
+		struct request_t *reqs[SERVER_BATCH_MAX];
+		struct response_t *res[SERVER_BATCH_MAX];
+		struct server_buffer_t *buff = first;
+		for (unsigned int i = 0; i < n; i++) {
+			trace_stamp(ctx, buff, TRACE_COMPUTE_START);
+			reqs[i] = &buff->req;
+			res[i] = &buff->res;
+			if (buff != last)
+				buff = container_of(buff->q.next, struct server_buffer_t, q);
+		}
+		compute_requests(&ctx->load, reqs, res, n);
+		buff = first;
+		for (unsigned int i = 0; i < n; i++) {
+			trace_stamp(ctx, buff, TRACE_COMPUTE_DONE);
+			buff->ts[TRACE_SUBMIT] = buff->ts[TRACE_COMPUTE_DONE];
+			if (buff != last)
+				buff = container_of(buff->q.next, struct server_buffer_t, q);
+		}
+		lock(&conn->lock);
+		conn->received += n;
+		conn->processed += n;
+		queue_put_list(&first->q, &last->q, n, &conn->send_queue);
+		unlock(&conn->lock);
+		return;
+	}
+
+	struct queue_root *inbox = ctx->queues.compute_inbox[conn->computeidx];
+	lock(&conn->lock);
+	conn->received += n;
+	// Racy, a missed transition costs no more than a park timeout
+	int was_empty = !queue_depth(inbox);
+	queue_put_list(&first->q, &last->q, n, inbox);
+	unlock(&conn->lock);
+	// Fresh work can be stolen: a parked sibling takes it if the owner is busy
+	if (ctx->cfg.threads.steal && was_empty)
+		doorbell_ring_group(ctx->doorbells.compute, ctx->cfg.threads.compute, conn->computeidx);
+	else
+		doorbell_ring(&ctx->doorbells.compute[conn->computeidx]);
+}
+
+/*
+ * Start receiving a request into a fresh buffer of the load.payload class,
+ * so that the usual request is read in place: the header first, see
+ * io_request_framed(). Any class holds the header when that one ran dry.
+ */
+static inline struct server_buffer_t *io_request_start(
+	struct server_context_t *ctx,
+	struct buffer_cache_t *cache,
+	struct server_connection_t *conn
+) {
+	struct server_buffer_t *buff = buffer_get(ctx, cache, ctx->pools[ctx->recv_cls].size);
+	for (unsigned int cls = ctx->recv_cls; !buff && cls--; )
+		buff = buffer_class_get(ctx, cache, cls);
+	if (!buff)
+		return NULL;
+	buff->conn = conn;
+	buff->framed = 0;
+	buff->left = sizeof (struct request_t);
+	buff->ptr = (unsigned char *) &buff->req;
+	conn->recvbuf = buff;
+	return buff;
+}
+
+/*
+ * COMPUTE payloads of at least load.stream bytes are hashed piece by piece
+ * as they arrive. They never need a buffer larger than the header, so
+ * load.max_payload does not bound them.
+ */
+static inline int io_request_streams(
+	struct server_context_t *ctx,
+	struct server_buffer_t *buff
+) {
+	return ctx->cfg.load.stream && buff->req.op == RPC_OP_COMPUTE &&
+	       buff->req.len >= ctx->cfg.load.stream;
+}
+
+static inline int io_request_too_long(
+	struct server_context_t *ctx,
+	struct server_buffer_t *buff
+) {
+	return buff->req.len > ctx->cfg.load.max_payload && !io_request_streams(ctx, buff);
+}
+
+/* Hash n more payload bytes of a streamed request, finish the digest at the end */
+static inline void io_request_stream(
+	struct server_connection_t *conn,
+	struct server_buffer_t *buff,
+	const unsigned char *p,
+	size_t n
+) {
+	sha1_update(&conn->stream.sha, p, n);
+	buff->left -= n;
+	if (!buff->left)
+		sha1_final(&conn->stream.sha, buff->res.sha);
+}
+
+/* Move n received bytes into the request being received */
+static inline void io_request_fill(
+	struct server_connection_t *conn,
+	struct server_buffer_t *buff,
+	const unsigned char *src,
+	size_t n
+) {
+	if (buff->framed && (buff->req.flags & REQUEST_F_STREAMED)) {
+		io_request_stream(conn, buff, src, n);
+		return;
+	}
+	memcpy(buff->ptr, src, n);
+	buff->ptr += n;
+	buff->left -= n;
+}
+
+/*
+ * The header in conn->recvbuf is complete: move it to a buffer of the size
+ * class its payload needs, unless it fits already, and receive the payload
+ * next. Returns NULL with conn->recvbuf untouched if no buffer is left.
+ */
+static inline struct server_buffer_t *io_request_framed(
+	struct server_context_t *ctx,
+	struct buffer_cache_t *cache,
+	struct server_connection_t *conn
+) {
+	struct server_buffer_t *buff = conn->recvbuf;
+	size_t size = sizeof (struct request_t) + buff->req.len;
+
+	buff->req.flags = 0;
+	if (io_request_streams(ctx, buff)) {
+		sha1_init(&conn->stream.sha);
+		buff->req.flags = REQUEST_F_STREAMED;
+		buff->framed = 1;
+		buff->left = buff->req.len;
+		buff->ptr = NULL;
+		return buff;
+	}
+	if (size > ctx->pools[buff->cls].size) {
+		struct server_buffer_t *big = buffer_get(ctx, cache, size);
+		if (!big)
+			return NULL;
+		big->conn = conn;
+		big->req = buff->req;
+		buffer_put(ctx, cache, buff);
+		buff = big;
+	}
+	buff->framed = 1;
+	buff->left = buff->req.len;
+	buff->ptr = buff->req.data;
+	conn->recvbuf = buff;
+	return buff;
+}
+
+static inline void io_response_start(
+	struct server_connection_t *conn,
+	struct server_buffer_t *buff
+) {
+	buff->conn = conn;
+	buff->left = RESPONSE_HDR_LEN + buff->res.len;
+	buff->ptr = (unsigned char *) &buff->res;
+	conn->sendbuf = buff;
+}
+
+static inline void io_dispatch_request(
+	struct server_context_t *ctx,
+	struct server_connection_t *conn,
+	struct server_buffer_t *buff
+) {
+	io_dispatch_requests(ctx, conn, buff, buff, 1);
+}
+
+/* Called with conn->lock held once a response was put on conn->send_queue */
+static inline int io_conn_want_send(
+	struct server_context_t *ctx,
+	struct server_connection_t *conn
+) {
+	if (ctx->io.engine == IO_ENGINE_URING)
+		return uring_conn_want_send(ctx, conn);
+	return epoll_set_conn_state(ctx, conn, conn->epoll_state | EPOLLOUT);
+}
+
 #endif // __INTERNAL_IO_H
@@ -1,7 +1,9 @@
 #define NEED_DEBUG 0
 #include "include/debug.h"
+#include "include/executor.h"
 #include "include/kerncall.h"
 #include "include/server.h"
+#include "include/syscall_stats.h"
 
 #include "io.h"
 
@@ -10,6 +12,54 @@ struct submit_arg_t {
 	struct thread_info_t *ti;
 };
 
+/*
+ * Deliver a run of n responses for the same connection under one lock
+ * acquisition. Returns 1 if the connection is busy and the run has to be
+ * retried later, or -1 on error.
+ */
+static long submit_responses(
+	struct server_context_t *ctx,
+	struct buffer_cache_t *cache,
+	struct server_connection_t *conn,
+	struct queue_head *run[],
+	unsigned int n
+) {
+	if (!trylock(&conn->lock)) {
+		debug("conn %d: recycle %u responses", conn->fd, n);
+		return 1;
+	}
+
+	conn->processed += n;
+	if (conn->closed) {
+		debug("conn %d: submitter dispose %u", conn->fd, n);
+		for (unsigned int i = 0; i < n; i++)
+			buffer_put(ctx, cache, container_of(run[i], struct server_buffer_t, q));
+		unlock(&conn->lock);
+
+		if (conn->processed == conn->received) {
+			// Last in-flight buffer
+			debug("conn %d: submitter cleanup", conn->fd);
+			queue_put(&conn->q, ctx->queues.empty_connections);
+		}
+		return 0;
+	}
+
+	debug("conn %d: submit %u responses", conn->fd, n);
+	for (unsigned int i = 0; i < n; i++) {
+		trace_stamp(ctx, container_of(run[i], struct server_buffer_t, q), TRACE_SUBMIT);
+		if (i + 1 < n)
+			run[i]->next = run[i + 1];
+	}
+	queue_put_list(run[0], run[n - 1], n, &conn->send_queue);
+	long err = 0;
+	if (io_conn_want_send(ctx, conn)) {
+		Z_perror("io_conn_want_send");
+		err = -1;
+	}
+	unlock(&conn->lock);
+	return err;
+}
+
 static long __submitter_worker(struct submit_arg_t *arg) {
 	struct server_context_t *ctx = arg->ctx;
 	struct thread_info_t *ti = arg->ti;
@@ -18,40 +68,44 @@ static long __submitter_worker(struct submit_arg_t *arg) {
 	unsigned long iter = 0;
 
 	struct queue_root *inbox = ctx->queues.submitter_inbox[ti->group_info.current];
+	struct buffer_cache_t *cache = &ctx->caches.submit[ti->group_info.current];
+	struct doorbell_t *db = &ctx->doorbells.submit[ti->group_info.current];
+	struct submit_stats_t *stats = &ctx->submit_stats[ti->group_info.current];
+	unsigned int nbatch = ctx->cfg.threads.batch;
+	unsigned int idle = 0;
+	struct queue_head *batch[SERVER_BATCH_MAX];
 
 	while (!*stopping && iter++ < 10000000l && !err) {
-		struct queue_head *q = queue_get(inbox);
-		if (!q)
-			continue;
-		struct server_buffer_t *buff = container_of(q, struct server_buffer_t, q);
-		struct server_connection_t *conn = buff->conn;
-		if (!trylock(&conn->lock)) {
-			queue_put(q, inbox);
-			debug("conn %d: recycle response %d", conn->fd, buff->msg.res.id);
-			continue;
-		}
+		unsigned int n = doorbell_queue_get_batch(inbox, db, ctx->cfg.threads.spin, &idle, batch, nbatch);
+		struct queue_head *recycle = NULL, *recycle_last = NULL;
+		unsigned int nr_recycle = 0;
 
-		conn->processed++;
-		if (conn->closed) {
-			debug("conn %d: submitter dispose id %d", conn->fd, buff->msg.req.id);
-			queue_put(q, ctx->queues.empty_buffers);
-			unlock(&conn->lock);
+		stats->loops++;
+		for (unsigned int i = 0, j; i < n && !err; i = j) {
+			struct server_connection_t *conn = container_of(batch[i], struct server_buffer_t, q)->conn;
+			for (j = i + 1; j < n; j++)
+				if (container_of(batch[j], struct server_buffer_t, q)->conn != conn)
+					break;
 
-			if (conn->processed == conn->received) {
-				// Last in-flight buffer
-				debug("conn %d: submitter cleanup", conn->fd);
-				queue_put(&conn->q, ctx->queues.empty_connections);
-				continue;
-			}
-		} else {
-			debug("conn %d: submit response %d", conn->fd, buff->msg.res.id);
-			queue_put(&buff->q, &conn->send_queue);
-			if (epoll_set_conn_state(ctx, conn, conn->epoll_state | EPOLLOUT)) {
-				Z_perror("epoll_set_conn_state");
-				err = -1;
+			long ret = submit_responses(ctx, cache, conn, &batch[i], j - i);
+			if (ret < 0) {
+				err = ret;
+			} else if (!ret) {
+				stats->submitted += j - i;
+			} else {
+				// Requeue busy runs in one go once the batch is done
+				if (recycle)
+					recycle_last->next = batch[i];
+				else
+					recycle = batch[i];
+				for (unsigned int k = i; k + 1 < j; k++)
+					batch[k]->next = batch[k + 1];
+				recycle_last = batch[j - 1];
+				nr_recycle += j - i;
 			}
-			unlock(&conn->lock);
 		}
+		if (recycle)
+			queue_put_list(recycle, recycle_last, nr_recycle, inbox);
 	}
 	debug("submit done");
 	return err;
@@ -65,6 +119,8 @@ void *submitter_worker(void *opaque, struct thread_info_t *ti) {
 	};
 	long ret = 0;
 
+	syscall_stats_register(ti->name);
+	syscall_exec_register();
 	while (!ctx->stopping && !ret) {
 		if (KERNCALL_COND(ctx->cfg, submit)) {
 			ret = kerncall_spawn(
@@ -1,8 +1,13 @@
+#define _GNU_SOURCE
 #include <sys/types.h>
 #include <sys/syscall.h>
 #include <errno.h>
+#include <stdio.h>
+#include <string.h>
 
+#include "include/executor.h"
 #include "include/kerncall.h"
+#include "include/syscall_stats.h"
 
 #include "io.h"
 
@@ -30,15 +35,97 @@ static __inline int can_use_call() {
 	// return 0;
 }
 
+int syscall_stats_enabled;
+struct syscall_stats_t *syscall_stats[SYSCALL_STATS_MAX_THREADS];
+unsigned int syscall_stats_nr;
+
+const char *const syscall_slot_names[SYSCALL_SLOTS] = {
+	[SYSCALL_SLOT_ACCEPT] = "accept",
+	[SYSCALL_SLOT_RECV] = "recv",
+	[SYSCALL_SLOT_SEND] = "send",
+	[SYSCALL_SLOT_SENDMSG] = "sendmsg",
+	[SYSCALL_SLOT_CLOSE] = "close",
+	[SYSCALL_SLOT_EPOLL_CREATE] = "epoll_create",
+	[SYSCALL_SLOT_EPOLL_CTL] = "epoll_ctl",
+	[SYSCALL_SLOT_EPOLL_WAIT] = "epoll_wait",
+	[SYSCALL_SLOT_READ] = "read",
+	[SYSCALL_SLOT_WRITE] = "write",
+	[SYSCALL_SLOT_FUTEX] = "futex",
+	[SYSCALL_SLOT_CLOCK_GETTIME] = "clock_gettime",
+	[SYSCALL_SLOT_URING_SETUP] = "io_uring_setup",
+	[SYSCALL_SLOT_URING_ENTER] = "io_uring_enter",
+	[SYSCALL_SLOT_URING_REGISTER] = "io_uring_register",
+	[SYSCALL_SLOT_IOCTL] = "ioctl",
+	[SYSCALL_SLOT_OTHER] = "other",
+};
+
+const char *const syscall_path_names[SYSCALL_PATHS] = {
+	[SYSCALL_PATH_SYSCALL] = "syscall",
+	[SYSCALL_PATH_GATE] = "gate",
+};
+
+// This thread's table, see syscall_stats_register()
+static __thread struct syscall_stats_t *syscall_stats_self;
+
+/* Allocates and logs, so never from the syscall path, which may be in kerncall */
+int syscall_stats_register(const char *name) {
+	if (!syscall_stats_enabled || syscall_stats_self)
+		return 0;
+	unsigned int idx = __atomic_fetch_add(&syscall_stats_nr, 1, __ATOMIC_RELAXED);
+	if (idx >= SYSCALL_STATS_MAX_THREADS) {
+		fprintf(stderr, "syscall stats: more than %u threads, %s not counted\n",
+			SYSCALL_STATS_MAX_THREADS, name);
+		return -1;
+	}
+	struct syscall_stats_t *stats = aligned_alloc(64, sizeof (*stats));
+	if (!stats) {
+		perror("aligned_alloc");
+		return -1;
+	}
+	memset(stats, 0, sizeof (*stats));
+	strncpy(stats->name, name, sizeof (stats->name) - 1);
+	for (unsigned int slot = 0; slot < SYSCALL_SLOTS; slot++)
+		for (unsigned int path = 0; path < SYSCALL_PATHS; path++)
+			hist_init(&stats->calls[slot][path].hist);
+	__atomic_store_n(&syscall_stats[idx], stats, __ATOMIC_RELEASE);
+	syscall_stats_self = stats;
+	return 0;
+}
+
+void syscall_stats_record(unsigned int slot, unsigned int path, uint64_t cycles) {
+	struct syscall_stats_t *stats = syscall_stats_self;
+
+	if (!stats)
+		return;
+	struct syscall_stat_t *stat = &stats->calls[slot][path];
+	stat->count++;
+	stat->cycles += cycles;
+	hist_record(&stat->hist, cycles);
+}
+
+static inline uint64_t syscall_stats_start(void) {
+	return syscall_stats_enabled ? rdtsc() : 0;
+}
+
+static inline void syscall_stats_end(long n, int gate, uint64_t start) {
+	if (start && syscall_stats_enabled)
+		syscall_stats_record(syscall_slot(n), gate ? SYSCALL_PATH_GATE : SYSCALL_PATH_SYSCALL,
+				     rdtsc() - start);
+}
+
 
 static inline long Z_syscall0(long n)
 {
 	long ret;
-	if (!can_use_call()) {
+	int gate = can_use_call();
+	uint64_t start = syscall_stats_start();
+
+	if (!gate) {
 		__asm__ __volatile__ ("syscall" : "=a"(ret) : "a"(n) : "rcx", "r11", "memory");
 	} else {
 		__asm__ __volatile__ ("call *%2" : "=a"(ret) : "a"(n), "m"(kerncall_gate) : "rcx", "r11", "memory");
 	}
+	syscall_stats_end(n, gate, start);
 	SYSCALL_RETURN(ret);
 	return ret;
 }
@@ -46,11 +133,15 @@ static inline long Z_syscall0(long n)
 static inline long Z_syscall1(long n, long a1)
 {
 	long ret;
-	if (!can_use_call()) {
+	int gate = can_use_call();
+	uint64_t start = syscall_stats_start();
+
+	if (!gate) {
 		__asm__ __volatile__ ("syscall" : "=a"(ret) : "a"(n), "D"(a1) : "rcx", "r11", "memory");
 	} else {
 		__asm__ __volatile__ ("call *%3" : "=a"(ret) : "a"(n), "D"(a1), "m"(kerncall_gate) : "rcx", "r11", "memory");
 	}
+	syscall_stats_end(n, gate, start);
 	SYSCALL_RETURN(ret);
 	return ret;
 }
@@ -58,13 +149,17 @@ static inline long Z_syscall1(long n, long a1)
 static inline long Z_syscall2(long n, long a1, long a2)
 {
 	long ret;
-	if (!can_use_call()) {
+	int gate = can_use_call();
+	uint64_t start = syscall_stats_start();
+
+	if (!gate) {
 		__asm__ __volatile__ ("syscall" : "=a"(ret) : "a"(n), "D"(a1), "S"(a2)
 						: "rcx", "r11", "memory");
 	} else {
 		__asm__ __volatile__ ("call *%4" : "=a"(ret) : "a"(n), "D"(a1), "S"(a2), "m"(kerncall_gate)
 							  : "rcx", "r11", "memory");
 	}
+	syscall_stats_end(n, gate, start);
 	SYSCALL_RETURN(ret);
 	return ret;
 }
@@ -72,13 +167,17 @@ static inline long Z_syscall2(long n, long a1, long a2)
 static inline long Z_syscall3(long n, long a1, long a2, long a3)
 {
 	long ret;
-	if (!can_use_call()) {
+	int gate = can_use_call();
+	uint64_t start = syscall_stats_start();
+
+	if (!gate) {
 		__asm__ __volatile__ ("syscall" : "=a"(ret) : "a"(n), "D"(a1), "S"(a2),
 							  "d"(a3) : "rcx", "r11", "memory");
 	} else {
 		__asm__ __volatile__ ("call *%5" : "=a"(ret) : "a"(n), "D"(a1), "S"(a2),
 							  "d"(a3), "m"(kerncall_gate) : "rcx", "r11", "memory");
 	}
+	syscall_stats_end(n, gate, start);
 	SYSCALL_RETURN(ret);
 	return ret;
 }
@@ -86,14 +185,18 @@ static inline long Z_syscall3(long n, long a1, long a2, long a3)
 static inline long Z_syscall4(long n, long a1, long a2, long a3, long a4)
 {
 	long ret;
+	int gate = can_use_call();
+	uint64_t start = syscall_stats_start();
 	register long r10 __asm__("r10") = a4;
-	if (!can_use_call()) {
+
+	if (!gate) {
 		__asm__ __volatile__ ("syscall" : "=a"(ret) : "a"(n), "D"(a1), "S"(a2),
 							  "d"(a3), "r"(r10): "rcx", "r11", "memory");
 	} else {
 		__asm__ __volatile__ ("call *%6" : "=a"(ret) : "a"(n), "D"(a1), "S"(a2),
 							  "d"(a3), "r"(r10), "m"(kerncall_gate): "rcx", "r11", "memory");
 	}
+	syscall_stats_end(n, gate, start);
 	SYSCALL_RETURN(ret);
 	return ret;
 }
@@ -101,15 +204,19 @@ static inline long Z_syscall4(long n, long a1, long a2, long a3, long a4)
 static inline long Z_syscall5(long n, long a1, long a2, long a3, long a4, long a5)
 {
 	long ret;
+	int gate = can_use_call();
+	uint64_t start = syscall_stats_start();
 	register long r10 __asm__("r10") = a4;
 	register long r8 __asm__("r8") = a5;
-	if (!can_use_call()) {
+
+	if (!gate) {
 		__asm__ __volatile__ ("syscall" : "=a"(ret) : "a"(n), "D"(a1), "S"(a2),
 							  "d"(a3), "r"(r10), "r"(r8) : "rcx", "r11", "memory");	
 	} else {
 		__asm__ __volatile__ ("call *%7" : "=a"(ret) : "a"(n), "D"(a1), "S"(a2),
 							  "d"(a3), "r"(r10), "r"(r8), "m"(kerncall_gate) : "rcx", "r11", "memory");	
 	}
+	syscall_stats_end(n, gate, start);
 	SYSCALL_RETURN(ret);
 	return ret;
 }
@@ -117,33 +224,106 @@ static inline long Z_syscall5(long n, long a1, long a2, long a3, long a4, long a
 static inline long Z_syscall6(long n, long a1, long a2, long a3, long a4, long a5, long a6)
 {
 	long ret;
+	int gate = can_use_call();
+	uint64_t start = syscall_stats_start();
 	register long r10 __asm__("r10") = a4;
 	register long r8 __asm__("r8") = a5;
 	register long r9 __asm__("r9") = a6;
 
-	if (!can_use_call()) {
+	if (!gate) {
 		__asm__ __volatile__ ("syscall" : "=a"(ret) : "a"(n), "D"(a1), "S"(a2),
 							  "d"(a3), "r"(r10), "r"(r8), "r"(r9) : "rcx", "r11", "memory");
 	} else {
 		__asm__ __volatile__ ("call *%8" : "=a"(ret) : "a"(n), "D"(a1), "S"(a2),
 							  "d"(a3), "r"(r10), "r"(r8), "r"(r9), "m"(kerncall_gate) : "rcx", "r11", "memory");
 	}
+	syscall_stats_end(n, gate, start);
 	SYSCALL_RETURN(ret);
 	return ret;
 }
 
+/*
+ * Vectored syscalls. A thread outside kerncall enters it once through
+ * kerncall_spawn() and makes the whole batch through the gate, so the
+ * spawn is paid once instead of a syscall per entry. Without PIOT, or for
+ * a single call, the calls are simply made one after the other. With the
+ * syscall executor the whole batch is posted to it at once.
+ */
+#define Z_BATCH_SPAWN_MIN	2
+
+void Z_syscall_direct(struct z_syscall_t *call) {
+	long ret = Z_syscall6(call->nr, call->args[0], call->args[1], call->args[2],
+			      call->args[3], call->args[4], call->args[5]);
+	call->ret = ret == -1 ? -errno : ret;
+}
+
+struct z_batch_t {
+	struct z_syscall_t *calls;
+	unsigned int n;
+	unsigned int done;
+};
+
+static long Z_syscall_batch_run(unsigned long arg) {
+	struct z_batch_t *batch = (void *) arg;
+
+	for (; batch->done < batch->n; batch->done++)
+		Z_syscall_direct(&batch->calls[batch->done]);
+	return 0;
+}
+
+void Z_syscall_batch(struct z_syscall_t *calls, unsigned int n) {
+	struct z_batch_t batch = {
+		.calls = calls,
+		.n = n,
+	};
+
+	if (syscall_exec_routed()) {
+		syscall_exec_post(calls, n);
+		syscall_exec_reap(calls, n);
+		return;
+	}
+	if (n >= Z_BATCH_SPAWN_MIN && kerncall_avail && !can_use_call())
+		kerncall_spawn((uintptr_t) Z_syscall_batch_run, (unsigned long) &batch);
+	// Whatever the spawn did not get to
+	Z_syscall_batch_run((unsigned long) &batch);
+}
+
+void Z_syscall_post(struct z_syscall_t *calls, unsigned int n) {
+	if (syscall_exec_routed())
+		syscall_exec_post(calls, n);
+	else
+		Z_syscall_batch(calls, n);
+}
+
+void Z_syscall_reap(struct z_syscall_t *calls, unsigned int n) {
+	// Posted calls are reaped even if the executor was turned off since
+	syscall_exec_reap(calls, n);
+}
+
 int Z_accept4(int sockfd, struct sockaddr *addr, socklen_t *addrlen, int flags) {
 	return Z_syscall4(SYS_accept, sockfd, (uintptr_t) addr, (uintptr_t) addrlen, flags);
 	// return accept(sockfd, addr, addrlen);
 }
 ssize_t Z_recv(int sockfd, void *buf, size_t len, int flags) {
+	if (syscall_exec_routed())
+		return syscall_exec(SYS_recvfrom, sockfd, (uintptr_t) buf, len, flags, 0, 0);
 	return Z_syscall6(SYS_recvfrom, sockfd, (uintptr_t) buf, len, flags, 0, 0);
 	// return recv(sockfd, buf, len, flags);
 }
 ssize_t Z_send(int sockfd, const void *buf, size_t len, int flags) {
+	if (syscall_exec_routed())
+		return syscall_exec(SYS_sendto, sockfd, (uintptr_t) buf, len, flags, 0, 0);
 	return Z_syscall6(SYS_sendto, sockfd, (uintptr_t) buf, len, flags, 0, 0);
 	// return send(sockfd, buf, len, flags);
 }
+ssize_t Z_sendmsg(int sockfd, const struct msghdr *msg, int flags) {
+	if (syscall_exec_routed())
+		return syscall_exec(SYS_sendmsg, sockfd, (uintptr_t) msg, flags, 0, 0, 0);
+	return Z_syscall3(SYS_sendmsg, sockfd, (uintptr_t) msg, flags);
+}
+long Z_getpid(void) {
+	return Z_syscall0(SYS_getpid);
+}
 int Z_close(int fd) {
 	return Z_syscall1(SYS_close, fd);
 }
@@ -152,6 +332,8 @@ int Z_epoll_create1(int fl) {
 	// return epoll_create1(fl);
 }
 int Z_epoll_ctl(int epfd, int op, int fd, struct epoll_event *event) {
+	if (syscall_exec_routed())
+		return syscall_exec(SYS_epoll_ctl, epfd, op, fd, (uintptr_t) event, 0, 0);
 	return Z_syscall4(SYS_epoll_ctl, epfd, op, fd, (uintptr_t) event);
 	// return epoll_ctl(epfd, op, fd, event);
 }
@@ -159,6 +341,35 @@ int Z_epoll_wait(int epfd, struct epoll_event *events, int maxevents, int timeou
 	return Z_syscall4(SYS_epoll_wait, epfd, (uintptr_t) events, maxevents, timeout);
 	// return epoll_wait(epfd, events, maxevents, timeout);
 }
+int Z_epoll_pwait2(int epfd, struct epoll_event *events, int maxevents, const struct timespec *timeout) {
+	return Z_syscall6(SYS_epoll_pwait2, epfd, (uintptr_t) events, maxevents, (uintptr_t) timeout, 0, 0);
+	// return epoll_pwait2(epfd, events, maxevents, timeout, NULL);
+}
+
+ssize_t Z_read(int fd, void *buf, size_t count) {
+	return Z_syscall3(SYS_read, fd, (uintptr_t) buf, count);
+}
+ssize_t Z_write(int fd, const void *buf, size_t count) {
+	return Z_syscall3(SYS_write, fd, (uintptr_t) buf, count);
+}
+
+long Z_futex(int *uaddr, int op, int val, const struct timespec *timeout) {
+	return Z_syscall4(SYS_futex, (uintptr_t) uaddr, op, val, (uintptr_t) timeout);
+}
+int Z_clock_gettime(clockid_t clk, struct timespec *ts) {
+	return Z_syscall2(SYS_clock_gettime, clk, (uintptr_t) ts);
+}
+
+int Z_io_uring_setup(unsigned int entries, struct io_uring_params *p) {
+	return Z_syscall2(SYS_io_uring_setup, entries, (uintptr_t) p);
+}
+int Z_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+		     unsigned int flags, void *arg, size_t argsz) {
+	return Z_syscall6(SYS_io_uring_enter, fd, to_submit, min_complete, flags, (uintptr_t) arg, argsz);
+}
+int Z_io_uring_register(int fd, unsigned int opcode, void *arg, unsigned int nr_args) {
+	return Z_syscall4(SYS_io_uring_register, fd, opcode, (uintptr_t) arg, nr_args);
+}
 
 int Z_ioctl(int fd, unsigned long request, unsigned long cmd) {
 	return Z_syscall3(SYS_ioctl, fd, request, cmd);
@@ -0,0 +1,974 @@
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/eventfd.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+
+#define NEED_DEBUG 1
+#include "include/debug.h"
+#include "include/kerncall.h"
+#include "include/server.h"
+
+#include "io.h"
+
+#define min(a,b) \
+   ({ __typeof__ (a) _a = (a); \
+       __typeof__ (b) _b = (b); \
+     _a > _b ? _b : _a; })
+
+/*
+ * io_uring IO engine.
+ *
+ * Accept threads run a multishot accept on the listening socket and hand
+ * new connections to the owning IO ring with IORING_OP_MSG_RING. IO rings
+ * run one multishot recv per connection into a provided buffer ring that
+ * is stocked with server_buffer_t's from the pool, and send responses with
+ * WRITE_FIXED out of the buffer slabs registered as fixed buffers, as much
+ * of them as RLIMIT_MEMLOCK allows, and plain SEND from the rest. All
+ * SQEs produced while handling a batch of CQEs go out with a single
+ * io_uring_enter.
+ *
+ * Submitters queue ready connections on the IO ring's ready queue and only
+ * ring its eventfd when the IO thread is about to sleep.
+ */
+
+#define URING_BGID	0
+
+#define URING_TAG_MASK		0x3fUL
+#define URING_TAG_RECV		1
+#define URING_TAG_SEND		2
+#define URING_TAG_NEWCONN	3
+#define URING_TAG_WAKE		4
+#define URING_TAG_ACCEPT	5
+#define URING_TAG_IGNORE	6
+
+#define URING_DATA(ptr, tag)	((uint64_t) (uintptr_t) (ptr) | (tag))
+#define URING_PTR(data)		((void *) (uintptr_t) ((data) & ~URING_TAG_MASK))
+#define URING_TAG(data)		((data) & URING_TAG_MASK)
+
+#define URING_WAIT_MSEC	1000
+// Retry connections stalled on an empty buffer class this often
+#define URING_STALL_MSEC	1
+
+#define URING_CHUNK_FREE	0	// data copied out, the caller releases the chunk
+#define URING_CHUNK_TAKEN	1	// dispatched as a request
+#define URING_CHUNK_STALLED	2	// out of buffers, ptr and left give the rest
+#define URING_CHUNK_FINISHED	3	// bad request, the connection is finished
+#define URING_CHUNK_HELD	4	// over readahead, ptr and left give the rest
+
+struct uring_t {
+	int fd;
+	unsigned int sq_entries;
+	unsigned int *sq_head;
+	unsigned int *sq_tail;
+	unsigned int sq_mask;
+	unsigned int sq_local_tail;
+	unsigned int to_submit;
+	struct io_uring_sqe *sqes;
+	unsigned int *cq_head;
+	unsigned int *cq_tail;
+	unsigned int cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_ring;
+	size_t sq_ring_len;
+	void *cq_ring;
+	size_t cq_ring_len;
+	size_t sqes_len;
+};
+
+struct server_uring_t {
+	struct uring_t ring;
+	int fixed_bufs;
+	// Registered bytes of each class slab, sends from past the end are plain
+	size_t fixed_len[BUFFER_CLASSES];
+
+	// Provided receive buffers, indexed by buffer id
+	struct io_uring_buf_ring *br;
+	size_t br_len;
+	unsigned int br_entries;
+	unsigned short br_tail;
+	struct server_buffer_t **br_bufs;
+	unsigned short *br_missing;
+	unsigned int nr_missing;
+
+	int wakefd;
+	int wake_armed;
+	uint64_t wakeval;
+	struct queue_root *ready;
+	struct server_connection_t *stalled; // waiting for a buffer, see uring_handle_chunk()
+	int sleeping __attribute__((aligned(64)));
+} __attribute__((aligned(64)));
+
+static int uring_init(struct uring_t *ring, unsigned int entries) {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof (p));
+	memset(ring, 0, sizeof (*ring));
+
+	ring->fd = Z_io_uring_setup(entries, &p);
+	if (ring->fd < 0) {
+		Z_perror("io_uring_setup");
+		return -1;
+	}
+	ring->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof (unsigned int);
+	ring->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring->cq_ring_len > ring->sq_ring_len)
+			ring->sq_ring_len = ring->cq_ring_len;
+		ring->cq_ring_len = ring->sq_ring_len;
+	}
+
+	ring->sq_ring = mmap(NULL, ring->sq_ring_len, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+	if (ring->sq_ring == MAP_FAILED) {
+		perror("mmap/sq_ring");
+		goto out_close;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		ring->cq_ring = ring->sq_ring;
+	} else {
+		ring->cq_ring = mmap(NULL, ring->cq_ring_len, PROT_READ | PROT_WRITE,
+				     MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+		if (ring->cq_ring == MAP_FAILED) {
+			perror("mmap/cq_ring");
+			goto out_unmap_sq;
+		}
+	}
+	ring->sqes_len = p.sq_entries * sizeof (struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED) {
+		perror("mmap/sqes");
+		goto out_unmap_cq;
+	}
+
+	ring->sq_entries = p.sq_entries;
+	ring->sq_head = ring->sq_ring + p.sq_off.head;
+	ring->sq_tail = ring->sq_ring + p.sq_off.tail;
+	ring->sq_mask = *(unsigned int *) (ring->sq_ring + p.sq_off.ring_mask);
+	ring->sq_local_tail = *ring->sq_tail;
+	unsigned int *sq_array = ring->sq_ring + p.sq_off.array;
+	for (unsigned int i = 0; i < p.sq_entries; i++)
+		sq_array[i] = i;
+
+	ring->cq_head = ring->cq_ring + p.cq_off.head;
+	ring->cq_tail = ring->cq_ring + p.cq_off.tail;
+	ring->cq_mask = *(unsigned int *) (ring->cq_ring + p.cq_off.ring_mask);
+	ring->cqes = ring->cq_ring + p.cq_off.cqes;
+	return 0;
+
+out_unmap_cq:
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_len);
+out_unmap_sq:
+	munmap(ring->sq_ring, ring->sq_ring_len);
+out_close:
+	close(ring->fd);
+	ring->fd = -1;
+	return -1;
+}
+
+static void uring_fini(struct uring_t *ring) {
+	if (ring->fd < 0)
+		return;
+	munmap(ring->sqes, ring->sqes_len);
+	if (ring->cq_ring != ring->sq_ring)
+		munmap(ring->cq_ring, ring->cq_ring_len);
+	munmap(ring->sq_ring, ring->sq_ring_len);
+	close(ring->fd);
+	ring->fd = -1;
+}
+
+static int uring_enter(struct uring_t *ring, unsigned int wait_nr, unsigned int wait_msec) {
+	struct __kernel_timespec ts = {
+		.tv_sec = wait_msec / 1000,
+		.tv_nsec = (wait_msec % 1000) * 1000000L,
+	};
+	struct io_uring_getevents_arg arg = {
+		.ts = (uintptr_t) &ts,
+	};
+	unsigned int flags = IORING_ENTER_EXT_ARG;
+	if (wait_nr)
+		flags |= IORING_ENTER_GETEVENTS;
+
+	__atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+	int ret = Z_io_uring_enter(ring->fd, ring->to_submit, wait_nr, flags, &arg, sizeof (arg));
+	if (ret >= 0) {
+		ring->to_submit -= min((unsigned int) ret, ring->to_submit);
+	} else if (errno == ETIME || errno == EINTR) {
+		ret = 0;
+	}
+	return ret;
+}
+
+static struct io_uring_sqe *uring_get_sqe(struct uring_t *ring) {
+	unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+	if (ring->sq_local_tail - head >= ring->sq_entries) {
+		if (uring_enter(ring, 0, 0) < 0)
+			return NULL;
+		head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+		if (ring->sq_local_tail - head >= ring->sq_entries)
+			return NULL;
+	}
+	struct io_uring_sqe *sqe = &ring->sqes[ring->sq_local_tail & ring->sq_mask];
+	memset(sqe, 0, sizeof (*sqe));
+	ring->sq_local_tail++;
+	ring->to_submit++;
+	return sqe;
+}
+
+/* Provided buffer ring */
+
+static void uring_br_add(struct server_uring_t *ur, struct server_buffer_t *buff, unsigned short bid, unsigned int len) {
+	struct io_uring_buf *buf = &ur->br->bufs[ur->br_tail & (ur->br_entries - 1)];
+	buf->addr = (uintptr_t) &buff->req;
+	buf->len = len;
+	buf->bid = bid;
+	ur->br_bufs[bid] = buff;
+	ur->br_tail++;
+}
+
+static void uring_br_commit(struct server_uring_t *ur) {
+	__atomic_store_n(&ur->br->tail, ur->br_tail, __ATOMIC_RELEASE);
+}
+
+static unsigned int uring_chunk_size(struct server_context_t *ctx) {
+	return min(ctx->cfg.load.max_io_size, ctx->pools[ctx->nr_pools - 1].size);
+}
+
+static void uring_br_replenish(
+	struct server_context_t *ctx,
+	struct server_uring_t *ur,
+	struct buffer_cache_t *cache
+) {
+	unsigned int added = 0;
+	while (ur->nr_missing) {
+		struct server_buffer_t *buff = buffer_get(ctx, cache, uring_chunk_size(ctx));
+		if (!buff)
+			break;
+		uring_br_add(ur, buff, ur->br_missing[--ur->nr_missing], uring_chunk_size(ctx));
+		added++;
+	}
+	if (added)
+		uring_br_commit(ur);
+}
+
+static int uring_setup_br(struct server_context_t *ctx, struct server_uring_t *ur) {
+	unsigned int entries = 1;
+	while (entries < ctx->cfg.io.uring_bufs && entries < 32768)
+		entries <<= 1;
+
+	ur->br_entries = entries;
+	ur->br_len = entries * sizeof (struct io_uring_buf);
+	ur->br = mmap(NULL, ur->br_len, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	if (ur->br == MAP_FAILED) {
+		perror("mmap/buf_ring");
+		ur->br = NULL;
+		return -1;
+	}
+	ur->br_bufs = calloc(entries, sizeof (struct server_buffer_t *));
+	ur->br_missing = calloc(entries, sizeof (unsigned short));
+	if (!ur->br_bufs || !ur->br_missing) {
+		perror("calloc");
+		return -1;
+	}
+
+	struct io_uring_buf_reg reg = {
+		.ring_addr = (uintptr_t) ur->br,
+		.ring_entries = entries,
+		.bgid = URING_BGID,
+	};
+	if (Z_io_uring_register(ur->ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1)) {
+		Z_perror("io_uring_register/pbuf_ring");
+		return -1;
+	}
+
+	ur->br_tail = 0;
+	struct queue_root *pool = ctx->pools[buffer_class(ctx, uring_chunk_size(ctx))].empty;
+	for (unsigned int bid = 0; bid < entries; bid++) {
+		struct queue_head *q = queue_get(pool);
+		if (!q) {
+			debug("not enough buffers for the uring buffer ring");
+			return -1;
+		}
+		uring_br_add(ur, container_of(q, struct server_buffer_t, q), bid, uring_chunk_size(ctx));
+	}
+	uring_br_commit(ur);
+	return 0;
+}
+
+/*
+ * Registered buffers are pinned and charged to RLIMIT_MEMLOCK once per
+ * ring, so every ring gets its share of the limit rather than a request
+ * for all slabs that fails outright under the usual 8 MB.
+ */
+static size_t uring_fixed_budget(struct server_context_t *ctx) {
+	struct rlimit rl;
+	if (getrlimit(RLIMIT_MEMLOCK, &rl)) {
+		perror("getrlimit/memlock");
+		return 0;
+	}
+	if (rl.rlim_cur == RLIM_INFINITY)
+		return SIZE_MAX;
+	// Leave a page per ring for whatever else gets locked
+	size_t share = rl.rlim_cur / ctx->io.nr_io;
+	return share > 4096 ? share - 4096 : 0;
+}
+
+static int uring_setup_one(struct server_context_t *ctx, struct server_uring_t *ur) {
+	ur->ring.fd = -1;
+	ur->wakefd = -1;
+	if (uring_init(&ur->ring, ctx->cfg.io.uring_entries))
+		return -1;
+
+	// Registering the slab of each size class lets sends use WRITE_FIXED on any buffer
+	struct iovec iov[BUFFER_CLASSES];
+	size_t budget = uring_fixed_budget(ctx);
+	for (unsigned int cls = 0; cls < ctx->nr_pools; cls++) {
+		struct buffer_pool_t *pool = &ctx->pools[cls];
+		size_t len = pool->nr * pool->stride;
+		if (len > budget)
+			len = budget / pool->stride * pool->stride;
+		budget -= len;
+		iov[cls].iov_base = pool->slab;
+		// A zero length iovec is refused, keep one buffer and let the limit decide
+		iov[cls].iov_len = len ? len : pool->stride;
+		ur->fixed_len[cls] = iov[cls].iov_len;
+	}
+	ur->fixed_bufs = !Z_io_uring_register(ur->ring.fd, IORING_REGISTER_BUFFERS, iov, ctx->nr_pools);
+	if (!ur->fixed_bufs)
+		Z_perror("io_uring_register/buffers, falling back to plain send");
+
+	if (uring_setup_br(ctx, ur))
+		return -1;
+
+	ur->ready = alloc_queue_root_sized(ctx->cfg.alloc.sessions);
+	if (!ur->ready) {
+		perror("alloc_queue_root_sized");
+		return -1;
+	}
+	ur->wakefd = eventfd(0, EFD_CLOEXEC);
+	if (ur->wakefd < 0) {
+		perror("eventfd");
+		return -1;
+	}
+	return 0;
+}
+
+int setup_server_uring(struct server_context_t *ctx) {
+	for (unsigned int i = 0; i < ctx->io.nr_io; i++) {
+		struct server_uring_t *ur = aligned_alloc(64, sizeof (struct server_uring_t));
+		if (!ur) {
+			perror("aligned_alloc");
+			return -1;
+		}
+		memset(ur, 0, sizeof (*ur));
+		ctx->io.urings[i] = ur;
+		if (uring_setup_one(ctx, ur))
+			return -1;
+	}
+	return 0;
+}
+
+void cleanup_server_uring(struct server_context_t *ctx) {
+	for (unsigned int i = 0; i < ctx->io.nr_io; i++) {
+		struct server_uring_t *ur = ctx->io.urings[i];
+		if (!ur)
+			continue;
+		uring_fini(&ur->ring);
+		if (ur->wakefd >= 0)
+			close(ur->wakefd);
+		if (ur->br)
+			munmap(ur->br, ur->br_len);
+		if (ur->ready)
+			free_queue_root(ur->ready);
+		// Buffers still owned by the ring belong to the slab, nothing to return
+		free(ur->br_bufs);
+		free(ur->br_missing);
+		free(ur);
+		ctx->io.urings[i] = NULL;
+	}
+}
+
+/* IO stage */
+
+static int uring_arm_recv(struct server_uring_t *ur, struct server_connection_t *conn) {
+	struct io_uring_sqe *sqe = uring_get_sqe(&ur->ring);
+	if (!sqe)
+		return -1;
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = conn->fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BGID;
+	sqe->user_data = URING_DATA(conn, URING_TAG_RECV);
+	conn->uring.recv_armed = 1;
+	conn->uring.recv_paused = 0;
+	return 0;
+}
+
+static int uring_cancel_recv(struct server_uring_t *ur, struct server_connection_t *conn) {
+	struct io_uring_sqe *sqe = uring_get_sqe(&ur->ring);
+	if (!sqe)
+		return -1;
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = URING_DATA(conn, URING_TAG_RECV);
+	sqe->user_data = URING_DATA(NULL, URING_TAG_IGNORE);
+	return 0;
+}
+
+static int uring_arm_wake(struct server_uring_t *ur) {
+	struct io_uring_sqe *sqe = uring_get_sqe(&ur->ring);
+	if (!sqe)
+		return -1;
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd = ur->wakefd;
+	sqe->addr = (uintptr_t) &ur->wakeval;
+	sqe->len = sizeof (ur->wakeval);
+	sqe->user_data = URING_DATA(NULL, URING_TAG_WAKE);
+	return 0;
+}
+
+static int uring_start_send(
+	struct server_context_t *ctx,
+	struct server_uring_t *ur,
+	struct server_connection_t *conn
+) {
+	struct server_buffer_t *buff = conn->sendbuf;
+	if (conn->uring.send_inflight || conn->uring.closing)
+		return 0;
+	if (!buff) {
+		struct queue_head *q = queue_get(&conn->send_queue);
+		if (!q)
+			return 0;
+		buff = container_of(q, struct server_buffer_t, q);
+		io_response_start(conn, buff);
+	}
+
+	struct io_uring_sqe *sqe = uring_get_sqe(&ur->ring);
+	if (!sqe)
+		return -1;
+	if (ur->fixed_bufs &&
+	    (void *) buff + ctx->pools[buff->cls].stride <= ctx->pools[buff->cls].slab + ur->fixed_len[buff->cls]) {
+		sqe->opcode = IORING_OP_WRITE_FIXED;
+		sqe->buf_index = buff->cls;
+	} else {
+		sqe->opcode = IORING_OP_SEND;
+	}
+	sqe->fd = conn->fd;
+	sqe->addr = (uintptr_t) buff->ptr;
+	sqe->len = min(buff->left, (size_t) ctx->cfg.load.max_io_size);
+	sqe->user_data = URING_DATA(conn, URING_TAG_SEND);
+	conn->uring.send_inflight = 1;
+	return 0;
+}
+
+static void uring_backlog_push(struct server_connection_t *conn, struct server_buffer_t *chunk) {
+	chunk->q.next = NULL;
+	if (conn->uring.backlog_tail)
+		conn->uring.backlog_tail->q.next = &chunk->q;
+	else
+		conn->uring.backlog = chunk;
+	conn->uring.backlog_tail = chunk;
+}
+
+static void uring_backlog_push_front(struct server_connection_t *conn, struct server_buffer_t *chunk) {
+	chunk->q.next = conn->uring.backlog ? &conn->uring.backlog->q : NULL;
+	if (!conn->uring.backlog)
+		conn->uring.backlog_tail = chunk;
+	conn->uring.backlog = chunk;
+}
+
+static struct server_buffer_t *uring_backlog_pop(struct server_connection_t *conn) {
+	struct server_buffer_t *chunk = conn->uring.backlog;
+	if (!chunk)
+		return NULL;
+	if (chunk->q.next)
+		conn->uring.backlog = container_of(chunk->q.next, struct server_buffer_t, q);
+	else
+		conn->uring.backlog = conn->uring.backlog_tail = NULL;
+	return chunk;
+}
+
+/*
+ * Tear the connection down once the ring holds no more references to it.
+ * Mirrors finish_connection() in io.c: whatever is still in the compute or
+ * submit stages is released by the submitter. Returns 1 once conn is torn
+ * down, it may be reused or released by the submitter and must not be
+ * touched again.
+ */
+static int uring_finish_connection(
+	struct server_context_t *ctx,
+	struct server_uring_t *ur,
+	struct server_connection_t *conn
+) {
+	struct buffer_cache_t *cache = &ctx->caches.io[conn->ioidx];
+
+	if (!conn->uring.closing) {
+		conn->uring.closing = 1;
+		if (conn->uring.recv_armed)
+			uring_cancel_recv(ur, conn);
+	}
+	if (conn->uring.recv_armed || conn->uring.send_inflight)
+		return 0;
+
+	if (conn->uring.stalled) {
+		// Still on the stalled list, finished again once retried
+		return 0;
+	}
+
+	lock(&conn->lock);
+	if (conn->uring.tx_scheduled) {
+		// Still on the ready queue, finished again once popped
+		unlock(&conn->lock);
+		return 0;
+	}
+
+	if (conn->sendbuf)
+		buffer_put(ctx, cache, conn->sendbuf);
+	if (conn->recvbuf)
+		buffer_put(ctx, cache, conn->recvbuf);
+	conn->sendbuf = conn->recvbuf = NULL;
+	struct server_buffer_t *chunk;
+	while ((chunk = uring_backlog_pop(conn)))
+		buffer_put(ctx, cache, chunk);
+	Z_close(conn->fd);
+
+	struct queue_head *q;
+	while ((q = queue_get(&conn->send_queue))) {
+		conn->sent++;
+		buffer_put(ctx, cache, container_of(q, struct server_buffer_t, q));
+	}
+	conn->closed = 1;
+
+	if (conn->sent == conn->received) {
+		debug("conn %d: finish(released) stats: received %lu, sent %lu", conn->fd, conn->received, conn->sent);
+		queue_put(&conn->q, ctx->queues.empty_connections);
+		return 1;
+	}
+	debug("conn %d: finish(delegated) stats: received %lu, sent %lu", conn->fd, conn->received, conn->sent);
+	unlock(&conn->lock);
+	return 1;
+}
+
+static int uring_over_readahead(
+	struct server_context_t *ctx,
+	struct server_connection_t *conn
+) {
+	return conn->received - conn->sent > ctx->cfg.load.readahead;
+}
+
+/*
+ * Slice the rest of a received chunk, from chunk->ptr on for chunk->left
+ * bytes, into requests. A fresh chunk holding exactly one request is
+ * dispatched as is. No request is started over readahead, like
+ * handle_request() does, and when a size class runs dry the chunk is left
+ * with the bytes still to go for a retry once responses or buffers come
+ * back. On a bad request the caller releases the chunk and finishes the
+ * connection.
+ */
+static int uring_handle_chunk(
+	struct server_context_t *ctx,
+	struct server_connection_t *conn,
+	struct server_buffer_t *chunk
+) {
+	struct buffer_cache_t *cache = &ctx->caches.io[conn->ioidx];
+	unsigned char *src = chunk->ptr;
+	size_t len = chunk->left;
+
+	if (!conn->recvbuf && src == (unsigned char *) &chunk->req &&
+	    len >= sizeof (struct request_t) &&
+	    len == sizeof (struct request_t) + chunk->req.len && !io_request_too_long(ctx, chunk)) {
+		chunk->conn = conn;
+		chunk->framed = 1;
+		chunk->left = 0;
+		chunk->req.flags = 0;
+		trace_stamp(ctx, chunk, TRACE_RECV);
+		io_dispatch_request(ctx, conn, chunk);
+		return URING_CHUNK_TAKEN;
+	}
+
+	while (1) {
+		struct server_buffer_t *buff = conn->recvbuf;
+		if (buff && !buff->left && !buff->framed) {
+			if (io_request_too_long(ctx, buff)) {
+				debug("conn %d: %u byte payload too long", conn->fd, buff->req.len);
+				return URING_CHUNK_FINISHED;
+			}
+			buff = io_request_framed(ctx, cache, conn);
+			if (!buff)
+				goto out_stalled;
+		}
+		if (buff && !buff->left) {
+			conn->recvbuf = NULL;
+			trace_stamp(ctx, buff, TRACE_RECV);
+			io_dispatch_request(ctx, conn, buff);
+			continue;
+		}
+		if (!len)
+			return URING_CHUNK_FREE;
+		if (!buff) {
+			if (uring_over_readahead(ctx, conn)) {
+				chunk->ptr = src;
+				chunk->left = len;
+				return URING_CHUNK_HELD;
+			}
+			buff = io_request_start(ctx, cache, conn);
+			if (!buff)
+				goto out_stalled;
+		}
+		// Streamed payloads are hashed straight out of the chunk
+		size_t n = min(buff->left, len);
+		io_request_fill(conn, buff, src, n);
+		src += n;
+		len -= n;
+	}
+
+out_stalled:
+	chunk->ptr = src;
+	chunk->left = len;
+	return URING_CHUNK_STALLED;
+}
+
+/*
+ * Multishot recv keeps completing for a while after it is cancelled, so
+ * received chunks wait on a per-connection backlog and are only sliced
+ * into requests while the connection is within its readahead, a chunk
+ * held part way resuming where it stopped. That keeps the send queue
+ * bound the epoll engine relies on. Returns 1 when the
+ * connection is closing, the caller must not touch conn anymore.
+ */
+static int uring_drain_backlog(
+	struct server_context_t *ctx,
+	struct server_uring_t *ur,
+	struct server_connection_t *conn
+) {
+	struct buffer_cache_t *cache = &ctx->caches.io[conn->ioidx];
+
+	while (conn->uring.backlog && !conn->uring.closing && !uring_over_readahead(ctx, conn)) {
+		struct server_buffer_t *chunk = uring_backlog_pop(conn);
+		int ret = uring_handle_chunk(ctx, conn, chunk);
+		if (ret == URING_CHUNK_FREE) {
+			buffer_put(ctx, cache, chunk);
+		} else if (ret == URING_CHUNK_FINISHED) {
+			buffer_put(ctx, cache, chunk);
+			uring_finish_connection(ctx, ur, conn);
+			return 1;
+		} else if (ret == URING_CHUNK_HELD) {
+			// Sent responses drain it further, see uring_handle_send()
+			uring_backlog_push_front(conn, chunk);
+			break;
+		} else if (ret == URING_CHUNK_STALLED) {
+			uring_backlog_push_front(conn, chunk);
+			if (!conn->uring.stalled) {
+				conn->uring.stalled = 1;
+				conn->uring.stalled_next = ur->stalled;
+				ur->stalled = conn;
+			}
+			break;
+		}
+	}
+	if (conn->uring.closing)
+		return 1;
+
+	if (conn->uring.backlog || uring_over_readahead(ctx, conn)) {
+		if (!conn->uring.recv_paused) {
+			conn->uring.recv_paused = 1;
+			if (conn->uring.recv_armed)
+				uring_cancel_recv(ur, conn);
+		}
+	} else if (!conn->uring.recv_armed) {
+		uring_arm_recv(ur, conn);
+	}
+
+	// Run-to-completion responses are already on the send queue
+	if (ctx->mode == SERVER_MODE_RTC)
+		uring_start_send(ctx, ur, conn);
+	return 0;
+}
+
+static void uring_handle_recv(
+	struct server_context_t *ctx,
+	struct server_uring_t *ur,
+	struct server_connection_t *conn,
+	struct io_uring_cqe *cqe
+) {
+	if (cqe->flags & IORING_CQE_F_BUFFER) {
+		unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+		struct server_buffer_t *chunk = ur->br_bufs[bid];
+		if (cqe->res > 0 && !conn->uring.closing) {
+			// The chunk leaves the ring, a fresh buffer is stocked later
+			chunk->ptr = (unsigned char *) &chunk->req;
+			chunk->left = cqe->res;
+			uring_backlog_push(conn, chunk);
+			ur->br_missing[ur->nr_missing++] = bid;
+		} else {
+			uring_br_add(ur, chunk, bid, uring_chunk_size(ctx));
+			uring_br_commit(ur);
+		}
+	}
+
+	if (!(cqe->flags & IORING_CQE_F_MORE))
+		conn->uring.recv_armed = 0;
+
+	if (conn->uring.closing ||
+	    cqe->res == 0 ||
+	    (cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -ECANCELED)) {
+		uring_finish_connection(ctx, ur, conn);
+		return;
+	}
+	uring_drain_backlog(ctx, ur, conn);
+}
+
+static void uring_handle_send(
+	struct server_context_t *ctx,
+	struct server_uring_t *ur,
+	struct server_connection_t *conn,
+	struct io_uring_cqe *cqe
+) {
+	struct server_buffer_t *buff = conn->sendbuf;
+	conn->uring.send_inflight = 0;
+	ctx->io_stats[conn->ioidx].sends++;
+
+	// Nothing sent for a non-empty buffer, the peer is gone
+	if (cqe->res == 0 || (cqe->res < 0 && cqe->res != -EAGAIN)) {
+		uring_finish_connection(ctx, ur, conn);
+		return;
+	}
+	if (conn->uring.closing) {
+		uring_finish_connection(ctx, ur, conn);
+		return;
+	}
+	if (cqe->res > 0) {
+		buff->left -= cqe->res;
+		buff->ptr += cqe->res;
+	}
+	if (!buff->left) {
+		conn->sent++;
+		ctx->io_stats[conn->ioidx].responses++;
+		conn->sendbuf = NULL;
+		trace_request_done(ctx, buff);
+		buffer_put(ctx, &ctx->caches.io[conn->ioidx], buff);
+		if (conn->uring.recv_paused && uring_drain_backlog(ctx, ur, conn))
+			return;
+	}
+	uring_start_send(ctx, ur, conn);
+}
+
+static void uring_handle_ready(
+	struct server_context_t *ctx,
+	struct server_uring_t *ur
+) {
+	struct queue_head *q;
+	while ((q = queue_get(ur->ready))) {
+		struct server_connection_t *conn = container_of(q, struct server_connection_t, q);
+		lock(&conn->lock);
+		conn->uring.tx_scheduled = 0;
+		unlock(&conn->lock);
+		if (conn->uring.closing)
+			uring_finish_connection(ctx, ur, conn);
+		else
+			uring_start_send(ctx, ur, conn);
+	}
+}
+
+/* Give connections that ran out of buffers another go */
+static void uring_retry_stalled(
+	struct server_context_t *ctx,
+	struct server_uring_t *ur
+) {
+	struct server_connection_t *conn = ur->stalled;
+	ur->stalled = NULL;
+	while (conn) {
+		struct server_connection_t *next = conn->uring.stalled_next;
+		conn->uring.stalled = 0;
+		if (conn->uring.closing)
+			uring_finish_connection(ctx, ur, conn);
+		else
+			uring_drain_backlog(ctx, ur, conn);
+		conn = next;
+	}
+}
+
+int uring_conn_want_send(struct server_context_t *ctx, struct server_connection_t *conn) {
+	struct server_uring_t *ur = ctx->io.urings[conn->ioidx];
+	if (conn->uring.tx_scheduled)
+		return 0;
+	conn->uring.tx_scheduled = 1;
+	queue_put(&conn->q, ur->ready);
+	if (__atomic_exchange_n(&ur->sleeping, 0, __ATOMIC_SEQ_CST)) {
+		uint64_t val = 1;
+		if (Z_write(ur->wakefd, &val, sizeof (val)) != sizeof (val))
+			return -1;
+	}
+	return 0;
+}
+
+static int uring_process_cqes(struct server_context_t *ctx, struct server_uring_t *ur) {
+	struct uring_t *ring = &ur->ring;
+	unsigned int head = *ring->cq_head;
+	unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+	int n = 0;
+
+	for (; head != tail; head++, n++) {
+		struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+		struct server_connection_t *conn = URING_PTR(cqe->user_data);
+		switch (URING_TAG(cqe->user_data)) {
+		case URING_TAG_RECV:
+			uring_handle_recv(ctx, ur, conn, cqe);
+			break;
+		case URING_TAG_SEND:
+			uring_handle_send(ctx, ur, conn, cqe);
+			break;
+		case URING_TAG_NEWCONN:
+			if (uring_arm_recv(ur, conn))
+				debug("conn %d: failed to arm recv", conn->fd);
+			break;
+		case URING_TAG_WAKE:
+			uring_arm_wake(ur);
+			break;
+		default:
+			break;
+		}
+	}
+	__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	return n;
+}
+
+long __uring_io_worker(struct io_arg_t *arg) {
+	struct server_context_t *ctx = arg->ctx;
+	struct thread_info_t *ti = arg->ti;
+	int *stopping = &ctx->stopping;
+	struct server_uring_t *ur = ctx->io.urings[ti->group_info.current];
+	struct buffer_cache_t *cache = &ctx->caches.io[ti->group_info.current];
+	unsigned int iter = 0;
+
+	if (!ur->wake_armed) {
+		if (uring_arm_wake(ur))
+			return -1;
+		ur->wake_armed = 1;
+	}
+
+	while (!*stopping && iter++ < 1000) {
+		ctx->io_stats[ti->group_info.current].loops++;
+		uring_handle_ready(ctx, ur);
+		uring_retry_stalled(ctx, ur);
+		uring_br_replenish(ctx, ur, cache);
+
+		// Anything queued after this point comes with an eventfd wakeup
+		__atomic_store_n(&ur->sleeping, 1, __ATOMIC_SEQ_CST);
+		uring_handle_ready(ctx, ur);
+		int ret = uring_enter(&ur->ring, 1, ur->stalled ? URING_STALL_MSEC : URING_WAIT_MSEC);
+		__atomic_store_n(&ur->sleeping, 0, __ATOMIC_SEQ_CST);
+		if (ret < 0) {
+			Z_perror("io_uring_enter");
+			return -1;
+		}
+
+		if (!uring_process_cqes(ctx, ur) && !ur->stalled)
+			return 0;
+	}
+	return 0;
+}
+
+/* Accept stage */
+
+struct uring_accept_arg_t {
+	struct server_context_t *ctx;
+	struct uring_t ring;
+};
+
+static int uring_arm_accept(struct server_context_t *ctx, struct uring_t *ring) {
+	struct io_uring_sqe *sqe = uring_get_sqe(ring);
+	if (!sqe)
+		return -1;
+	sqe->opcode = IORING_OP_ACCEPT;
+	sqe->fd = ctx->io.listen_fd;
+	sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	sqe->user_data = URING_DATA(NULL, URING_TAG_ACCEPT);
+	return 0;
+}
+
+static int uring_handle_accept(struct server_context_t *ctx, struct uring_t *ring, int fd) {
+	struct queue_head *q = queue_get(ctx->queues.empty_connections);
+	if (!q) {
+		debug("no session available, refusing connection");
+		Z_close(fd);
+		return 0;
+	}
+	struct server_connection_t *conn = container_of(q, struct server_connection_t, q);
+	setup_connection(ctx, conn, fd);
+
+	struct io_uring_sqe *sqe = uring_get_sqe(ring);
+	if (!sqe)
+		return -1;
+	sqe->opcode = IORING_OP_MSG_RING;
+	sqe->fd = ctx->io.urings[conn->ioidx]->ring.fd;
+	sqe->addr = IORING_MSG_DATA;
+	sqe->off = URING_DATA(conn, URING_TAG_NEWCONN);
+	sqe->user_data = URING_DATA(NULL, URING_TAG_IGNORE);
+	return 0;
+}
+
+static long __uring_accept_worker(struct uring_accept_arg_t *arg) {
+	struct server_context_t *ctx = arg->ctx;
+	struct uring_t *ring = &arg->ring;
+	int *stopping = &ctx->stopping;
+	unsigned int iter = 0;
+
+	while (!*stopping && iter++ < 1000) {
+		int ret = uring_enter(ring, 1, URING_WAIT_MSEC);
+		if (ret < 0) {
+			Z_perror("io_uring_enter");
+			return -1;
+		}
+
+		unsigned int head = *ring->cq_head;
+		unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+		if (head == tail)
+			return 0;
+		for (; head != tail; head++) {
+			struct io_uring_cqe *cqe = &ring->cqes[head & ring->cq_mask];
+			if (URING_TAG(cqe->user_data) != URING_TAG_ACCEPT)
+				continue;
+			if (cqe->res >= 0 && uring_handle_accept(ctx, ring, cqe->res))
+				return -1;
+			if (!(cqe->flags & IORING_CQE_F_MORE) && uring_arm_accept(ctx, ring))
+				return -1;
+		}
+		__atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+	}
+	return 0;
+}
+
+void *uring_accept_worker(struct server_context_t *ctx, struct thread_info_t *ti) {
+	struct uring_accept_arg_t arg = {
+		.ctx = ctx,
+	};
+	long ret = 0;
+
+	(void) ti;
+	if (uring_init(&arg.ring, ctx->cfg.io.uring_entries))
+		return (void *) -1L;
+	if (uring_arm_accept(ctx, &arg.ring)) {
+		ret = -1;
+		goto out;
+	}
+
+	while (!ctx->stopping && !ret) {
+		if (KERNCALL_COND(ctx->cfg, accept)) {
+			ret = kerncall_spawn(
+				(uintptr_t) __uring_accept_worker,
+				(unsigned long) &arg
+			);
+			asm(".align 32");
+		}
+		else
+			ret = __uring_accept_worker(&arg);
+	}
+
+out:
+	uring_fini(&arg.ring);
+	return (void *) ret;
+}
@@ -0,0 +1,270 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <immintrin.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+
+#define NEED_DEBUG 1
+#include "include/debug.h"
+#include "include/compute.h"
+#include "include/sha1.h"
+
+/*
+ * SHA1 through the kernel picked by --load.sha. Multi-buffer kernels want
+ * equally long messages, so requests are hashed in groups by length.
+ */
+static void kernel_sha1_run(struct request_t *reqs[], struct response_t *res[], unsigned int n) {
+	const unsigned char *data[n];
+	unsigned char *digest[n];
+	uint64_t done = 0;
+
+	for (unsigned int i = 0; i < n; i++) {
+		unsigned int len = reqs[i]->len, nr = 0;
+		if (done & (1ULL << i))
+			continue;
+		for (unsigned int j = i; j < n; j++) {
+			if (reqs[j]->len != len)
+				continue;
+			data[nr] = reqs[j]->data;
+			digest[nr++] = res[j]->sha;
+			done |= 1ULL << j;
+		}
+		sha1_multi(data, len, digest, nr);
+	}
+}
+
+/* SHA256, truncated to the response digest */
+
+static void kernel_sha256_run(struct request_t *reqs[], struct response_t *res[], unsigned int n) {
+	unsigned char digest[SHA256_DIGEST_LENGTH];
+
+	for (unsigned int i = 0; i < n; i++) {
+		SHA256(reqs[i]->data, reqs[i]->len, digest);
+		memcpy(res[i]->sha, digest, SHA_DIGEST_LENGTH);
+	}
+}
+
+/*
+ * AES-128-GCM encryption of the payload, the tag is the digest. Each thread
+ * keys its own cipher context on first use and only sets the IV per
+ * request, the thread-specific key frees it when the thread exits.
+ */
+
+#define AES_GCM_TAG_LEN	16
+#define AES_GCM_CHUNK	1024
+
+static const unsigned char aes_gcm_key[16] = "piotbench-aeskey";
+static pthread_key_t aes_gcm_evp_key;
+static int aes_gcm_evp_key_ready;
+static __thread EVP_CIPHER_CTX *aes_gcm_evp;
+
+static void aes_gcm_evp_free(void *evp) {
+	EVP_CIPHER_CTX_free(evp);
+}
+
+static int kernel_aes_gcm_setup(void) {
+	if (pthread_key_create(&aes_gcm_evp_key, aes_gcm_evp_free)) {
+		perror("pthread_key_create");
+		return -1;
+	}
+	aes_gcm_evp_key_ready = 1;
+	return 0;
+}
+
+static void kernel_aes_gcm_cleanup(void) {
+	if (!aes_gcm_evp_key_ready)
+		return;
+	// Exiting threads freed theirs, the calling thread's is left
+	EVP_CIPHER_CTX_free(aes_gcm_evp);
+	aes_gcm_evp = NULL;
+	pthread_key_delete(aes_gcm_evp_key);
+	aes_gcm_evp_key_ready = 0;
+}
+
+static EVP_CIPHER_CTX *aes_gcm_evp_get(void) {
+	if (aes_gcm_evp)
+		return aes_gcm_evp;
+	EVP_CIPHER_CTX *evp = EVP_CIPHER_CTX_new();
+	if (!evp)
+		return NULL;
+	if (!EVP_EncryptInit_ex(evp, EVP_aes_128_gcm(), NULL, aes_gcm_key, NULL)) {
+		EVP_CIPHER_CTX_free(evp);
+		return NULL;
+	}
+	pthread_setspecific(aes_gcm_evp_key, evp);
+	return aes_gcm_evp = evp;
+}
+
+static void kernel_aes_gcm_run(struct request_t *reqs[], struct response_t *res[], unsigned int n) {
+	unsigned char out[AES_GCM_CHUNK + AES_GCM_TAG_LEN];
+	unsigned char iv[12] = { 0 };
+	int len;
+
+	EVP_CIPHER_CTX *evp = aes_gcm_evp_get();
+	if (!evp)
+		return;
+	for (unsigned int i = 0; i < n; i++) {
+		memcpy(iv, &reqs[i]->id, sizeof (reqs[i]->id));
+		EVP_EncryptInit_ex(evp, NULL, NULL, NULL, iv);
+		for (unsigned int off = 0; off < reqs[i]->len; off += AES_GCM_CHUNK) {
+			unsigned int chunk = reqs[i]->len - off;
+			if (chunk > AES_GCM_CHUNK)
+				chunk = AES_GCM_CHUNK;
+			EVP_EncryptUpdate(evp, out, &len, reqs[i]->data + off, chunk);
+		}
+		EVP_EncryptFinal_ex(evp, out, &len);
+		EVP_CIPHER_CTX_ctrl(evp, EVP_CTRL_GCM_GET_TAG, AES_GCM_TAG_LEN, res[i]->sha);
+	}
+}
+
+/* CRC32C, with SSE4.2 when available */
+
+#define CRC32C_POLY	0x82f63b78
+
+static uint32_t crc32c_table[256];
+static int crc32c_hw;
+
+static int kernel_crc32c_setup(void) {
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t crc = i;
+		for (unsigned int j = 0; j < 8; j++)
+			crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+		crc32c_table[i] = crc;
+	}
+	__builtin_cpu_init();
+	crc32c_hw = __builtin_cpu_supports("sse4.2");
+	return 0;
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(const unsigned char *p, size_t len) {
+	uint64_t crc = ~0U;
+	for (; len >= 8; len -= 8, p += 8) {
+		uint64_t v;
+		memcpy(&v, p, sizeof (v));
+		crc = _mm_crc32_u64(crc, v);
+	}
+	for (; len; len--)
+		crc = _mm_crc32_u8(crc, *p++);
+	return ~crc;
+}
+
+static uint32_t crc32c_soft(const unsigned char *p, size_t len) {
+	uint32_t crc = ~0U;
+	while (len--)
+		crc = crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+static void kernel_crc32c_run(struct request_t *reqs[], struct response_t *res[], unsigned int n) {
+	for (unsigned int i = 0; i < n; i++) {
+		uint32_t crc = crc32c_hw ?
+			crc32c_sse42(reqs[i]->data, reqs[i]->len) :
+			crc32c_soft(reqs[i]->data, reqs[i]->len);
+		memcpy(res[i]->sha, &crc, sizeof (crc));
+	}
+}
+
+/* Copy the payload out chunk by chunk and fold it into a Fletcher-style checksum */
+
+#define MEMCPY_CHUNK	1024
+
+static void kernel_memcpy_run(struct request_t *reqs[], struct response_t *res[], unsigned int n) {
+	uint64_t copy[MEMCPY_CHUNK / 8];
+
+	for (unsigned int i = 0; i < n; i++) {
+		uint64_t a = 0, b = 0;
+		for (unsigned int off = 0; off < reqs[i]->len; off += MEMCPY_CHUNK) {
+			unsigned int chunk = reqs[i]->len - off;
+			if (chunk > MEMCPY_CHUNK)
+				chunk = MEMCPY_CHUNK;
+			memcpy(copy, reqs[i]->data + off, chunk);
+			for (unsigned int j = 0; j < chunk / 8; j++) {
+				a += copy[j];
+				b += a;
+			}
+		}
+		memcpy(res[i]->sha, &a, sizeof (a));
+		memcpy(res[i]->sha + sizeof (a), &b, sizeof (b));
+	}
+}
+
+/*
+ * Dependent loads through a random cycle much larger than the LLC. Each
+ * iteration walks CHASE_STEPS links from a slot picked by the request.
+ */
+#define CHASE_SLOTS	(4U << 20)	// 16MB of uint32_t
+#define CHASE_STEPS	64
+
+static uint32_t *chase_links;
+
+static int kernel_chase_setup(void) {
+	if (chase_links)
+		return 0;
+	uint32_t *perm = malloc(CHASE_SLOTS * sizeof (uint32_t));
+	chase_links = malloc(CHASE_SLOTS * sizeof (uint32_t));
+	if (!perm || !chase_links) {
+		perror("malloc");
+		free(perm);
+		free(chase_links);
+		chase_links = NULL;
+		return -1;
+	}
+	// Sattolo's shuffle gives a single cycle through every slot
+	uint64_t x = 0x9e3779b97f4a7c15ULL;
+	for (uint32_t i = 0; i < CHASE_SLOTS; i++)
+		perm[i] = i;
+	for (uint32_t i = CHASE_SLOTS - 1; i > 0; i--) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		uint32_t j = x % i;
+		uint32_t tmp = perm[i];
+		perm[i] = perm[j];
+		perm[j] = tmp;
+	}
+	for (uint32_t i = 0; i < CHASE_SLOTS; i++)
+		chase_links[perm[i]] = perm[(i + 1) % CHASE_SLOTS];
+	free(perm);
+	return 0;
+}
+
+static void kernel_chase_cleanup(void) {
+	free(chase_links);
+	chase_links = NULL;
+}
+
+static void kernel_chase_run(struct request_t *reqs[], struct response_t *res[], unsigned int n) {
+	for (unsigned int i = 0; i < n; i++) {
+		uint32_t slot;
+		memcpy(&slot, res[i]->sha, sizeof (slot));
+		slot = (slot ^ reqs[i]->id) % CHASE_SLOTS;
+		for (unsigned int j = 0; j < CHASE_STEPS; j++)
+			slot = chase_links[slot];
+		memcpy(res[i]->sha, &slot, sizeof (slot));
+	}
+}
+
+static const struct compute_kernel_t compute_kernels[] = {
+	{ "sha1", "SHA1 of the payload, implementation set by --load.sha", NULL, NULL, kernel_sha1_run },
+	{ "sha256", "SHA256 of the payload", NULL, NULL, kernel_sha256_run },
+	{ "aes-gcm", "AES-128-GCM encryption of the payload", kernel_aes_gcm_setup, kernel_aes_gcm_cleanup, kernel_aes_gcm_run },
+	{ "crc32c", "CRC32C of the payload", kernel_crc32c_setup, NULL, kernel_crc32c_run },
+	{ "memcpy", "Payload copy and checksum", NULL, NULL, kernel_memcpy_run },
+	{ "chase", "Dependent loads through a 16MB random cycle", kernel_chase_setup, kernel_chase_cleanup, kernel_chase_run },
+};
+
+#define NR_COMPUTE_KERNELS (sizeof (compute_kernels) / sizeof (compute_kernels[0]))
+
+const struct compute_kernel_t *compute_kernel_find(const char *name) {
+	for (unsigned int i = 0; i < NR_COMPUTE_KERNELS; i++)
+		if (!strcmp(compute_kernels[i].name, name))
+			return &compute_kernels[i];
+	return NULL;
+}
+
+const struct compute_kernel_t *compute_kernel_at(unsigned int i) {
+	return i < NR_COMPUTE_KERNELS ? &compute_kernels[i] : NULL;
+}
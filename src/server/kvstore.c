@@ -0,0 +1,160 @@
+#include <sys/mman.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define NEED_DEBUG 1
+#include "include/debug.h"
+#include "include/kvstore.h"
+
+/* splitmix64 finalizer, client keys are small dense integers */
+static inline uint64_t kv_hash(uint64_t key) {
+	key ^= key >> 30;
+	key *= 0xbf58476d1ce4e5b9ULL;
+	key ^= key >> 27;
+	key *= 0x94d049bb133111ebULL;
+	key ^= key >> 31;
+	return key;
+}
+
+/*
+ * Slot holding key. With init set a missing key is inserted with that
+ * value, written before the slot is published so that no GET sees it
+ * empty, and *inserted tells the caller. Returns NULL if the key is
+ * missing, or when inserting, the table is full.
+ */
+static struct kv_slot_t *kv_lookup(
+	struct kv_store_t *kv,
+	uint64_t key,
+	const uint64_t init[KV_VALUE_WORDS],
+	int *inserted
+) {
+	uint64_t idx = kv_hash(key) & kv->mask;
+
+	for (uint64_t probes = 0; probes <= kv->mask; probes++, idx = (idx + 1) & kv->mask) {
+		struct kv_slot_t *slot = &kv->slots[idx];
+		unsigned int state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+
+		if (state == KV_SLOT_FREE) {
+			if (!init)
+				return NULL;
+			if (__atomic_compare_exchange_n(&slot->state, &state, KV_SLOT_BUSY, 0,
+							__ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+				slot->key = key;
+				// Nobody reads the slot before it is published, seq still goes odd and back
+				__atomic_store_n(&slot->seq, 1, __ATOMIC_RELAXED);
+				for (unsigned int i = 0; i < KV_VALUE_WORDS; i++)
+					__atomic_store_n(&slot->value[i], init[i], __ATOMIC_RELAXED);
+				__atomic_store_n(&slot->seq, 2, __ATOMIC_RELEASE);
+				__atomic_store_n(&slot->state, KV_SLOT_USED, __ATOMIC_RELEASE);
+				*inserted = 1;
+				__atomic_fetch_add(&kv->nr_keys, 1, __ATOMIC_RELAXED);
+				return slot;
+			}
+		}
+		// Another inserter owns the slot, its key shows up shortly
+		while (state == KV_SLOT_BUSY) {
+			__builtin_ia32_pause();
+			state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+		}
+		if (slot->key == key)
+			return slot;
+	}
+	return NULL;
+}
+
+int kv_get(struct kv_store_t *kv, uint64_t key, unsigned char value[KV_VALUE_LEN]) {
+	struct kv_slot_t *slot = kv_lookup(kv, key, NULL, NULL);
+	uint64_t words[KV_VALUE_WORDS];
+	unsigned int seq;
+
+	if (!slot && kv->on_demand) {
+		int inserted = 0;
+		kv_value_of(key, value);
+		memcpy(words, value, KV_VALUE_LEN);
+		slot = kv_lookup(kv, key, words, &inserted);
+		if (inserted)
+			return RPC_STATUS_OK;
+	}
+	if (!slot)
+		return RPC_STATUS_NOTFOUND;
+	do {
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		for (unsigned int i = 0; i < KV_VALUE_WORDS; i++)
+			words[i] = __atomic_load_n(&slot->value[i], __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || seq != __atomic_load_n(&slot->seq, __ATOMIC_RELAXED));
+	memcpy(value, words, KV_VALUE_LEN);
+	return RPC_STATUS_OK;
+}
+
+int kv_put(struct kv_store_t *kv, uint64_t key, const unsigned char value[KV_VALUE_LEN]) {
+	uint64_t words[KV_VALUE_WORDS];
+	unsigned int seq;
+	int inserted = 0;
+
+	memcpy(words, value, KV_VALUE_LEN);
+	struct kv_slot_t *slot = kv_lookup(kv, key, words, &inserted);
+	if (!slot)
+		return RPC_STATUS_FULL;
+	if (inserted)
+		return RPC_STATUS_OK;
+	do {
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+	} while ((seq & 1) || !__atomic_compare_exchange_n(&slot->seq, &seq, seq + 1, 0,
+							    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+	for (unsigned int i = 0; i < KV_VALUE_WORDS; i++)
+		__atomic_store_n(&slot->value[i], words[i], __ATOMIC_RELAXED);
+	__atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+	return RPC_STATUS_OK;
+}
+
+/*
+ * Table of nr_slots (rounded up to a power of two) slots, with keys
+ * 0..preload-1 set to kv_value_of() so that clients GET what they expect.
+ * Without preload keys get that value on their first GET instead.
+ */
+struct kv_store_t *kv_create(unsigned long nr_slots, unsigned long preload) {
+	struct kv_store_t *kv = calloc(1, sizeof (struct kv_store_t));
+	if (!kv) {
+		perror("calloc");
+		goto out;
+	}
+
+	uint64_t size = 1;
+	while (size < nr_slots)
+		size <<= 1;
+	if (preload > size) {
+		debug("kv: %lu keys do not fit %lu slots", preload, size);
+		goto out_free;
+	}
+	kv->mask = size - 1;
+	kv->on_demand = !preload;
+	kv->slots_len = size * sizeof (struct kv_slot_t);
+	kv->slots = mmap(NULL, kv->slots_len, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (kv->slots == MAP_FAILED) {
+		perror("mmap");
+		goto out_free;
+	}
+
+	for (uint64_t key = 0; key < preload; key++) {
+		unsigned char value[KV_VALUE_LEN];
+		kv_value_of(key, value);
+		kv_put(kv, key, value);
+	}
+	return kv;
+
+out_free:
+	free(kv);
+out:
+	return NULL;
+}
+
+void kv_destroy(struct kv_store_t *kv) {
+	if (!kv)
+		return;
+	debug("kv: %lu keys in %lu slots", kv->nr_keys, (unsigned long) kv->mask + 1);
+	munmap(kv->slots, kv->slots_len);
+	free(kv);
+}
@@ -9,8 +9,10 @@
 #include <signal.h>
 #define NEED_DEBUG 1
 #include "include/debug.h"
+#include "include/executor.h"
 #include "include/kerncall.h"
 #include "include/server.h"
+#include "include/syscall_stats.h"
 #include "include/thread.h"
 #include "include/utils.h"
 #include "include/command.h"
@@ -26,21 +28,136 @@ struct param_t server_params[] = {
 		"Server socket path",
 		"/tmp/bench-server"
 	),
+	SERVER_PARAM_STR(
+		stats_path,
+		"Statistics socket, answers \"text\" or \"json\" with a snapshot (empty for <socket_path>.stats, none to disable)",
+		""
+	),
+	SERVER_PARAM_STR(
+		mode,
+		"Pipeline mode: staged (IO/compute/submit threads) or rtc (IO threads run to completion)",
+		"staged"
+	),
+	SERVER_PARAM_UINT(
+		trace,
+		"Record per-stage request latency histograms, dumped at exit",
+		1
+	),
+	SERVER_PARAM_UINT(
+		syscall_stats,
+		"Count and time every syscall per thread, syscall instruction vs kerncall gate, dumped at exit",
+		0
+	),
 	SERVER_PARAM_UINT(
 		load.compute_dur,
 		"Duration in nsec for compute load function",
 		100
 	),
+	SERVER_PARAM_STR(
+		load.compute_mode,
+		"Compute cost: time (spin for compute_dur) or iters (fixed hash passes calibrated to compute_dur)",
+		"time"
+	),
 	SERVER_PARAM_UINT(
 		load.max_io_size,
 		"Max IO size for send/recv syscalls",
 		128
 	),
+	SERVER_PARAM_UINT(
+		load.max_payload,
+		"Largest request payload accepted, bounds the buffer size classes",
+		REQUEST_MAX_LENGTH
+	),
+	SERVER_PARAM_UINT(
+		load.payload,
+		"Expected request payload, requests are received straight into its size class",
+		REQUEST_LENGTH
+	),
 	SERVER_PARAM_UINT(
 		load.readahead,
 		"Max readahead for each connection",
 		1000
 	),
+	SERVER_PARAM_STR(
+		load.workload,
+		"Requests served: compute, or kv to also serve GET/PUT from a key-value store",
+		"compute"
+	),
+	SERVER_PARAM_STR(
+		load.kernel,
+		"Compute workload (sha1, sha256, aes-gcm, crc32c, memcpy, chase)",
+		"sha1"
+	),
+	SERVER_PARAM_STR(
+		load.sha,
+		"SHA1 kernel for the compute load (auto, avx2, shani, openssl, scalar)",
+		"auto"
+	),
+	SERVER_PARAM_UINT(
+		load.stream,
+		"Hash COMPUTE payloads of at least this many bytes while they arrive (0 to disable, sha1 kernel only)",
+		0
+	),
+	SERVER_PARAM_UINT(
+		load.stream_window,
+		"Receive window per connection for streamed payloads, in bytes",
+		4096
+	),
+	SERVER_PARAM_UINT(
+		load.recv_ring,
+		"Per-connection receive ring in bytes, read in bulk up to max_io_size and sliced into requests (epoll engine, 0 to disable)",
+		0
+	),
+	SERVER_PARAM_UINT(
+		load.send_iov,
+		"Max responses coalesced into one sendmsg, within max_io_size bytes (epoll engine, 1 to 64)",
+		1
+	),
+	SERVER_PARAM_UINT(
+		load.send_delay,
+		"Usec a short batch of coalesced responses may wait for more (0 to send right away)",
+		0
+	),
+	SERVER_PARAM_UINT(
+		kv.keys,
+		"Keys preloaded into the key-value store with load.workload=kv (0 to insert keys on their first GET instead)",
+		1048576
+	),
+	SERVER_PARAM_UINT(
+		kv.slots,
+		"Key-value store slots, rounded up to a power of two (0 for twice kv.keys, or 2M without preload)",
+		0
+	),
+	SERVER_PARAM_STR(
+		io.engine,
+		"IO engine for the IO and accept stages (epoll, uring)",
+		"epoll"
+	),
+	SERVER_PARAM_UINT(
+		io.uring_entries,
+		"Submission queue entries per io_uring",
+		256
+	),
+	SERVER_PARAM_UINT(
+		io.uring_bufs,
+		"Provided receive buffers per io_uring",
+		1024
+	),
+	SERVER_PARAM_UINT(
+		io.send_batch,
+		"Make the first send to every writable connection of an epoll_wait in one batched syscall submission (epoll engine, load.send_iov=1)",
+		0
+	),
+	SERVER_PARAM_STR(
+		io.syscalls,
+		"How IO threads make recv/send/epoll_ctl: direct (syscall or kerncall gate) or executor (posted to a syscall executor thread)",
+		"direct"
+	),
+	SERVER_PARAM_UINT(
+		io.executor_spin,
+		"Empty sweeps before the syscall executor parks, and polls before a caller sleeps on its result (0 for 1000 with several CPUs online, none with one)",
+		0
+	),
 	SERVER_PARAM_UINT(
 		threads.io,
 		"Number of IO threads",
@@ -51,6 +168,21 @@ struct param_t server_params[] = {
 		"Number of compute threads",
 		1
 	),
+	SERVER_PARAM_UINT(
+		threads.steal,
+		"Max requests an idle compute thread steals from a sibling (0 to disable)",
+		0
+	),
+	SERVER_PARAM_UINT(
+		threads.spin,
+		"Empty polls before compute and submit threads park (0 to never park)",
+		0
+	),
+	SERVER_PARAM_UINT(
+		threads.batch,
+		"Max buffers a stage moves per queue operation (1 to 64)",
+		16
+	),
 	SERVER_PARAM_UINT(
 		threads.submit,
 		"Number of submit threads",
@@ -68,9 +200,14 @@ struct param_t server_params[] = {
 	),
 	SERVER_PARAM_UINT(
 		alloc.buffers,
-		"Buffer objects to pre-allocate",
+		"Buffers to pre-allocate in the size class of load.payload, classes below it get a quarter as many per class, classes above it alloc.buffers/4^class",
 		100000
 	),
+	SERVER_PARAM_UINT(
+		alloc.buffer_cache,
+		"Per-thread empty buffer cache size (0 to disable)",
+		64
+	),
 	SERVER_PARAM_UINT(
 		kerncall.global,
 		"Run threads in kerncall (global setting)",
@@ -91,6 +228,11 @@ struct param_t server_params[] = {
 		"Run submit threads in kerncall",
 		0
 	),
+	SERVER_PARAM_UINT(
+		kerncall.executor,
+		"Run the syscall executor thread in kerncall",
+		0
+	),
 	LAST_PARAM,
 };
 
@@ -103,34 +245,84 @@ static int bind_server_socket(struct server_context_t *ctx) {
 	return -1;
 }
 
-static int alloc_one_queue(struct queue_root **qptr) {
-	struct queue_root *q = alloc_queue_root();
+static int alloc_one_queue(struct queue_root **qptr, unsigned long size) {
+	struct queue_root *q = alloc_queue_root_sized(size);
 	if (!q)
 		return -1;
 	*qptr = q;
 	return 0;
 }
 
-static int alloc_n_queues(struct queue_root *queues[], unsigned int n) {
+static int alloc_n_queues(struct queue_root *queues[], unsigned int n, unsigned long size) {
 	for (unsigned int i = 0; i < n; i++) {
-		if (alloc_one_queue(&queues[i]))
+		if (alloc_one_queue(&queues[i], size))
 			return -1;
 	}
 	return 0;
 }
 
+/*
+ * Size classes up to the one holding load.max_payload, and their counts.
+ * Requests are received into the class of load.payload, which gets the
+ * full alloc.buffers. Larger classes keep the bytes of the smallest one.
+ */
+static int size_buffer_pools(struct server_context_t *ctx) {
+	size_t max_size = sizeof (struct request_t) + ctx->cfg.load.max_payload;
+	size_t recv_size = sizeof (struct request_t) + ctx->cfg.load.payload;
+	unsigned int size = BUFFER_CLASS_MIN;
+
+	if (ctx->cfg.load.max_payload > REQUEST_MAX_LENGTH) {
+		debug("load.max_payload above %lu", (unsigned long) REQUEST_MAX_LENGTH);
+		return -1;
+	}
+	if (recv_size > max_size)
+		recv_size = max_size;
+	ctx->recv_cls = 0;
+	while (ctx->recv_cls < BUFFER_CLASSES - 1 && (size_t) BUFFER_CLASS_MIN << (2 * ctx->recv_cls) < recv_size)
+		ctx->recv_cls++;
+
+	ctx->nr_pools = 0;
+	for (unsigned int cls = 0; cls < BUFFER_CLASSES; cls++, size <<= 2) {
+		struct buffer_pool_t *pool = &ctx->pools[cls];
+		pool->size = size;
+		if (cls == ctx->recv_cls)
+			pool->nr = ctx->cfg.alloc.buffers;
+		else if (cls < ctx->recv_cls)
+			pool->nr = ctx->cfg.alloc.buffers >> (2 * (ctx->recv_cls - cls));
+		else
+			pool->nr = ctx->cfg.alloc.buffers >> (2 * cls);
+		if (pool->nr < BUFFER_CLASS_MIN_NR)
+			pool->nr = BUFFER_CLASS_MIN_NR;
+		pool->stride = sizeof (struct server_buffer_t) + size - sizeof (struct request_t);
+		pool->stride = (pool->stride + 63) & ~63UL;
+		ctx->nr_pools++;
+		debug("buffers: %u of %u bytes", pool->nr, pool->size);
+		if (size >= max_size)
+			break;
+	}
+	return 0;
+}
+
 static int alloc_server_queues(struct server_context_t *ctx) {
+	// Every queue must be able to hold all objects of its kind at once
+	unsigned long nr_sessions = ctx->cfg.alloc.sessions;
+	unsigned long nr_buffers = 0;
+	for (unsigned int cls = 0; cls < ctx->nr_pools; cls++) {
+		if (alloc_one_queue(&ctx->pools[cls].empty, ctx->pools[cls].nr))
+			return -1;
+		nr_buffers += ctx->pools[cls].nr;
+	}
 	return (
-		alloc_one_queue(&ctx->queues.empty_connections) ||
-		alloc_one_queue(&ctx->queues.empty_buffers) ||
-		alloc_n_queues(ctx->queues.compute_inbox, ctx->cfg.threads.compute) ||
-		alloc_n_queues(ctx->queues.submitter_inbox, ctx->cfg.threads.submit)
+		alloc_one_queue(&ctx->queues.empty_connections, nr_sessions) ||
+		alloc_n_queues(ctx->queues.compute_inbox, ctx->cfg.threads.compute, nr_buffers) ||
+		alloc_n_queues(ctx->queues.submitter_inbox, ctx->cfg.threads.submit, nr_buffers)
 	);
 }
 
 static int cleanup_one_queue(struct queue_root **qptr) {
 	// FIXME elements?
-	free(*qptr);
+	if (*qptr)
+		free_queue_root(*qptr);
 	return 0;
 }
 
@@ -142,9 +334,10 @@ static int cleanup_n_queues(struct queue_root *queues[], unsigned int n) {
 	return 0;
 }
 static int cleanup_server_queues(struct server_context_t *ctx) {
+	for (unsigned int cls = 0; cls < ctx->nr_pools; cls++)
+		cleanup_one_queue(&ctx->pools[cls].empty);
 	return (
 		cleanup_one_queue(&ctx->queues.empty_connections) ||
-		cleanup_one_queue(&ctx->queues.empty_buffers) ||
 		cleanup_n_queues(ctx->queues.compute_inbox, ctx->cfg.threads.compute) ||
 		cleanup_n_queues(ctx->queues.submitter_inbox, ctx->cfg.threads.submit)
 	);
@@ -157,31 +350,329 @@ static int setup_server_prealloc(struct server_context_t *ctx) {
 			perror("aligned_alloc");
 			return -1;
 		}
+		// In-flight responses are bounded by readahead, see handle_request()
+		if (init_queue_root_sized(&conn->send_queue, ctx->cfg.load.readahead + 2)) {
+			perror("init_queue_root_sized");
+			free(conn);
+			return -1;
+		}
+		// Streamed payloads pass through this window instead of a buffer
+		conn->stream.window = NULL;
+		if (ctx->cfg.load.stream && !(conn->stream.window = malloc(ctx->cfg.load.stream_window))) {
+			perror("malloc");
+			fini_queue_root(&conn->send_queue);
+			free(conn);
+			return -1;
+		}
+		conn->ring.buf = NULL;
+		if (ctx->cfg.load.recv_ring && ctx->io.engine == IO_ENGINE_EPOLL &&
+		    !(conn->ring.buf = malloc(ctx->cfg.load.recv_ring))) {
+			perror("malloc");
+			free(conn->stream.window);
+			fini_queue_root(&conn->send_queue);
+			free(conn);
+			return -1;
+		}
 		queue_put(&conn->q, ctx->queues.empty_connections);
 	}
-	for (int i = 0; i < ctx->cfg.alloc.buffers; i++) {
-		struct server_buffer_t *buff = aligned_alloc(64, sizeof (struct server_buffer_t));
-		if (!buff) {
+	for (unsigned int cls = 0; cls < ctx->nr_pools; cls++) {
+		struct buffer_pool_t *pool = &ctx->pools[cls];
+		pool->slab = aligned_alloc(64, pool->nr * pool->stride);
+		if (!pool->slab) {
 			perror("aligned_alloc");
 			return -1;
 		}
-		queue_put(&buff->q, ctx->queues.empty_buffers);
+		for (unsigned int i = 0; i < pool->nr; i++) {
+			struct server_buffer_t *buff = pool->slab + i * pool->stride;
+			buff->cls = cls;
+			queue_put(&buff->q, pool->empty);
+		}
+	}
+	return 0;
+}
+
+static int alloc_buffer_caches(
+	struct server_context_t *ctx,
+	struct buffer_cache_t **cptr,
+	unsigned int n
+) {
+	struct buffer_cache_t *caches = aligned_alloc(64, n * sizeof (struct buffer_cache_t));
+	if (!caches) {
+		perror("aligned_alloc");
+		return -1;
+	}
+	memset(caches, 0, n * sizeof (struct buffer_cache_t));
+	*cptr = caches;
+	for (unsigned int i = 0; i < n; i++) {
+		for (unsigned int cls = 0; cls < ctx->nr_pools; cls++) {
+			struct buffer_magazine_t *mag = &caches[i].mags[cls];
+			mag->size = ctx->cfg.alloc.buffer_cache;
+			mag->bufs = calloc(mag->size + 1, sizeof (struct server_buffer_t *));
+			if (!mag->bufs) {
+				perror("calloc");
+				return -1;
+			}
+		}
 	}
 	return 0;
 }
 
+static int setup_server_caches(struct server_context_t *ctx) {
+	return (
+		alloc_buffer_caches(ctx, &ctx->caches.io, ctx->cfg.threads.io) ||
+		alloc_buffer_caches(ctx, &ctx->caches.submit, ctx->cfg.threads.submit)
+	);
+}
+
+static void cleanup_buffer_caches(
+	struct server_context_t *ctx,
+	const char *name,
+	struct buffer_cache_t *caches,
+	unsigned int n
+) {
+	if (!caches)
+		return;
+	for (unsigned int i = 0; i < n; i++) {
+		for (unsigned int cls = 0; cls < ctx->nr_pools; cls++) {
+			struct buffer_magazine_t *mag = &caches[i].mags[cls];
+			if (mag->size && (mag->hits || mag->misses))
+				debug("buffer cache %s:%u/%u: hits %lu, misses %lu, flushes %lu",
+				      name, i, ctx->pools[cls].size, mag->hits, mag->misses, mag->flushes);
+			if (mag->bufs)
+				buffer_cache_flush(ctx->pools[cls].empty, mag, mag->nr);
+			free(mag->bufs);
+		}
+	}
+	free(caches);
+}
+
+static void cleanup_server_caches(struct server_context_t *ctx) {
+	cleanup_buffer_caches(ctx, "IO", ctx->caches.io, ctx->cfg.threads.io);
+	cleanup_buffer_caches(ctx, "submit", ctx->caches.submit, ctx->cfg.threads.submit);
+}
+
 static int free_server_prealloc(struct server_context_t *ctx) {
 	struct queue_head *q;
 	while ((q = queue_get(ctx->queues.empty_connections))) {
-		free(container_of(q, struct server_connection_t, q));
+		struct server_connection_t *conn = container_of(q, struct server_connection_t, q);
+		fini_queue_root(&conn->send_queue);
+		free(conn->stream.window);
+		free(conn->ring.buf);
+		free(conn);
+	}
+	for (unsigned int cls = 0; cls < ctx->nr_pools; cls++) {
+		struct buffer_pool_t *pool = &ctx->pools[cls];
+		if (pool->empty)
+			while ((q = queue_get(pool->empty)))
+				;
+		free(pool->slab);
+	}
+	return 0;
+}
+
+static int alloc_doorbells(struct server_context_t *ctx, struct doorbell_t **dbptr, unsigned int n) {
+	struct doorbell_t *dbs = aligned_alloc(64, n * sizeof (struct doorbell_t));
+	if (!dbs) {
+		perror("aligned_alloc");
+		return -1;
 	}
-	while ((q = queue_get(ctx->queues.empty_buffers))) {
-		free(container_of(q, struct server_buffer_t, q));
+	for (unsigned int i = 0; i < n; i++)
+		doorbell_init(&dbs[i], ctx->cfg.threads.spin);
+	*dbptr = dbs;
+	return 0;
+}
+
+static int setup_server_doorbells(struct server_context_t *ctx) {
+	return (
+		alloc_doorbells(ctx, &ctx->doorbells.compute, ctx->cfg.threads.compute) ||
+		alloc_doorbells(ctx, &ctx->doorbells.submit, ctx->cfg.threads.submit)
+	);
+}
+
+static void cleanup_doorbells(const char *name, struct doorbell_t *dbs, unsigned int n) {
+	if (!dbs)
+		return;
+	for (unsigned int i = 0; i < n; i++) {
+		struct doorbell_t *db = &dbs[i];
+		if (db->enabled)
+			debug("%s:%u: parks %lu, wakeups %lu, parked %.3lf sec",
+			      name, i, db->parks, db->wakeups, db->park_ns / 1000000000.0);
+	}
+	free(dbs);
+}
+
+static void cleanup_server_doorbells(struct server_context_t *ctx) {
+	cleanup_doorbells("compute", ctx->doorbells.compute, ctx->cfg.threads.compute);
+	cleanup_doorbells("submit", ctx->doorbells.submit, ctx->cfg.threads.submit);
+}
+
+static int setup_server_stats(struct server_context_t *ctx) {
+	unsigned int n = ctx->cfg.threads.compute;
+	ctx->compute_stats = aligned_alloc(64, n * sizeof (struct compute_stats_t));
+	if (!ctx->compute_stats) {
+		perror("aligned_alloc");
+		return -1;
+	}
+	memset(ctx->compute_stats, 0, n * sizeof (struct compute_stats_t));
+
+	n = ctx->cfg.threads.io;
+	ctx->io_stats = aligned_alloc(64, n * sizeof (struct io_stats_t));
+	if (!ctx->io_stats) {
+		perror("aligned_alloc");
+		return -1;
+	}
+	memset(ctx->io_stats, 0, n * sizeof (struct io_stats_t));
+
+	n = ctx->cfg.threads.submit;
+	ctx->submit_stats = aligned_alloc(64, n * sizeof (struct submit_stats_t));
+	if (!ctx->submit_stats) {
+		perror("aligned_alloc");
+		return -1;
 	}
+	memset(ctx->submit_stats, 0, n * sizeof (struct submit_stats_t));
 	return 0;
 }
 
+static void cleanup_server_stats(struct server_context_t *ctx) {
+	if (!ctx->compute_stats)
+		return;
+	if (ctx->threads.compute) {
+		for (unsigned int i = 0; i < ctx->cfg.threads.compute; i++) {
+			struct compute_stats_t *stats = &ctx->compute_stats[i];
+			debug("compute:%u: executed %lu, stolen %lu", i, stats->executed, stats->stolen);
+		}
+	}
+	free(ctx->compute_stats);
+	free(ctx->submit_stats);
+
+	if (!ctx->io_stats)
+		return;
+	for (unsigned int i = 0; i < ctx->cfg.threads.io; i++) {
+		struct io_stats_t *stats = &ctx->io_stats[i];
+		if (stats->sends)
+			debug("io:%u: %lu responses in %lu sends, %.2f per syscall", i,
+			      stats->responses, stats->sends, (double) stats->responses / stats->sends);
+	}
+	free(ctx->io_stats);
+}
+
+static int setup_server_kv(struct server_context_t *ctx) {
+	unsigned long keys = ctx->cfg.kv.keys;
+	unsigned long slots = ctx->cfg.kv.slots;
+
+	// GET/PUT of a compute run are answered RPC_STATUS_BADOP
+	if (strcmp(ctx->cfg.load.workload, "kv"))
+		return 0;
+	if (!slots)
+		slots = keys ? 2 * keys : KV_DEFAULT_SLOTS;
+	ctx->load.kv = kv_create(slots, keys);
+	return ctx->load.kv ? 0 : -1;
+}
+
+static int setup_server_traces(struct server_context_t *ctx) {
+	if (!ctx->cfg.trace)
+		return 0;
+	unsigned int n = ctx->cfg.threads.io;
+	ctx->traces = aligned_alloc(64, n * sizeof (struct server_trace_t));
+	if (!ctx->traces) {
+		perror("aligned_alloc");
+		return -1;
+	}
+	for (unsigned int i = 0; i < n; i++)
+		for (unsigned int s = 0; s < TRACE_STAGES; s++)
+			hist_init(&ctx->traces[i].stages[s]);
+	return tsc_init();
+}
+
+static const char *trace_stage_names[TRACE_STAGES] = {
+	[TRACE_STAGE_INBOX] = "trace: recv->compute",
+	[TRACE_STAGE_COMPUTE] = "trace: compute",
+	[TRACE_STAGE_SUBMIT] = "trace: compute->submit",
+	[TRACE_STAGE_SEND] = "trace: submit->sent",
+	[TRACE_STAGE_TOTAL] = "trace: recv->sent",
+};
+
+static void cleanup_server_traces(struct server_context_t *ctx) {
+	if (!ctx->traces)
+		return;
+	// Merge the IO threads' histograms into the first one
+	for (unsigned int s = 0; s < TRACE_STAGES; s++) {
+		struct hist_t *merged = &ctx->traces[0].stages[s];
+		for (unsigned int i = 1; i < ctx->cfg.threads.io; i++)
+			hist_merge(merged, &ctx->traces[i].stages[s]);
+		hist_print(trace_stage_names[s], merged, 1 / (tsc_clock.ticks_per_ns * 1000), "usec");
+	}
+	free(ctx->traces);
+}
+
+static int setup_server_syscall_stats(struct server_context_t *ctx) {
+	if (!ctx->cfg.syscall_stats)
+		return 0;
+	if (tsc_init())
+		return -1;
+	syscall_stats_enabled = 1;
+	// Workers register as they start, see syscall_stats_register()
+	return syscall_stats_register("main");
+}
+
+static void cleanup_server_syscall_stats(struct server_context_t *ctx) {
+	struct hist_t merged;
+	char name[64];
+
+	if (!ctx->cfg.syscall_stats || !syscall_stats_enabled)
+		return;
+	// Syscalls made from here on, e.g. by the cleanup, are not recorded
+	syscall_stats_enabled = 0;
+	unsigned int nr = syscall_stats_nr < SYSCALL_STATS_MAX_THREADS ? syscall_stats_nr : SYSCALL_STATS_MAX_THREADS;
+	for (unsigned int slot = 0; slot < SYSCALL_SLOTS; slot++) {
+		for (unsigned int path = 0; path < SYSCALL_PATHS; path++) {
+			hist_init(&merged);
+			for (unsigned int i = 0; i < nr; i++) {
+				struct syscall_stat_t *stat;
+				if (!syscall_stats[i])
+					continue;
+				stat = &syscall_stats[i]->calls[slot][path];
+				if (!stat->count)
+					continue;
+				debug("syscalls: %s: %s via %s: %lu calls, %lu cycles, %.0f per call",
+				      syscall_stats[i]->name, syscall_slot_names[slot], syscall_path_names[path],
+				      stat->count, stat->cycles, (double) stat->cycles / stat->count);
+				hist_merge(&merged, &stat->hist);
+			}
+			if (!merged.count)
+				continue;
+			snprintf(name, sizeof (name), "syscalls: %s via %s",
+				 syscall_slot_names[slot], syscall_path_names[path]);
+			hist_print(name, &merged, 1 / tsc_clock.ticks_per_ns, "nsec");
+		}
+	}
+	for (unsigned int i = 0; i < nr; i++)
+		free(syscall_stats[i]);
+}
+
 static int spawn_server_threads(struct server_context_t *ctx) {
+	// Syscall executor, first so that it serves every other thread
+	if (!strcmp(ctx->cfg.io.syscalls, "executor")) {
+		unsigned int spin = ctx->cfg.io.executor_spin;
+		// On a single CPU a spinning caller only delays the executor
+		if (!spin && sysconf(_SC_NPROCESSORS_ONLN) > 1)
+			spin = EXEC_SPIN_DEFAULT;
+		syscall_executor.spin = spin;
+		// The executor always parks, after spin empty sweeps
+		doorbell_init(&syscall_executor.db, 1);
+		syscall_executor.enabled = 1;
+		ctx->threads.executor = create_thread("executor", syscall_executor_worker, ctx);
+		if (!ctx->threads.executor) {
+			perror("create_thread/executor");
+			syscall_executor.enabled = 0;
+			return -1;
+		}
+	}
+
+	// IO threads compute and send inline, no other stages
+	if (ctx->mode == SERVER_MODE_RTC)
+		goto spawn_io;
+
 	// Compute threads
 	ctx->threads.compute = thread_group_create(
 		"compute",
@@ -204,6 +695,7 @@ static int spawn_server_threads(struct server_context_t *ctx) {
 		perror("thread_group_create/submit");
 		return -1;
 	}
+spawn_io:
 	// IO threads
 	ctx->threads.io = thread_group_create(
 		"IO",
@@ -226,6 +718,14 @@ static int spawn_server_threads(struct server_context_t *ctx) {
 		perror("thread_group_create/accept");
 		return -1;
 	}
+	// Statistics socket
+	if (ctx->io.stats_fd >= 0) {
+		ctx->threads.stats = create_thread("stats", stats_worker, ctx);
+		if (!ctx->threads.stats) {
+			perror("create_thread/stats");
+			return -1;
+		}
+	}
 	return 0;
 }
 
@@ -277,10 +777,72 @@ struct server_context_t *create_server(struct server_config_t *cfg) {
 	memset(ctx, 0, sizeof (struct server_context_t));
 	ctx->cfg = *cfg;
 	ctx->io.listen_fd = -1;
+	ctx->io.stats_fd = -1;
 	for (unsigned int i = 0; i < SERVER_MAX_THREADS; i++) {
 		ctx->io.epoll_fds[i] = -1;
 	}
 
+	if (!strcmp(ctx->cfg.mode, "staged")) {
+		ctx->mode = SERVER_MODE_STAGED;
+	} else if (!strcmp(ctx->cfg.mode, "rtc")) {
+		ctx->mode = SERVER_MODE_RTC;
+	} else {
+		debug("unknown server mode: %s", ctx->cfg.mode);
+		goto out_cleanup;
+	}
+
+	if (!strcmp(ctx->cfg.io.engine, "epoll")) {
+		ctx->io.engine = IO_ENGINE_EPOLL;
+	} else if (!strcmp(ctx->cfg.io.engine, "uring")) {
+		ctx->io.engine = IO_ENGINE_URING;
+	} else {
+		debug("unknown IO engine: %s", ctx->cfg.io.engine);
+		goto out_cleanup;
+	}
+
+	if (strcmp(ctx->cfg.io.syscalls, "direct") && strcmp(ctx->cfg.io.syscalls, "executor")) {
+		debug("unknown syscall mode: %s", ctx->cfg.io.syscalls);
+		goto out_cleanup;
+	}
+
+	if (strcmp(ctx->cfg.load.workload, "compute") && strcmp(ctx->cfg.load.workload, "kv")) {
+		debug("unknown workload: %s", ctx->cfg.load.workload);
+		goto out_cleanup;
+	}
+
+	if (sha1_select(ctx->cfg.load.sha)) {
+		debug("bad SHA1 kernel: %s", ctx->cfg.load.sha);
+		goto out_cleanup;
+	}
+
+	if (!ctx->cfg.threads.batch)
+		ctx->cfg.threads.batch = 1;
+	if (ctx->cfg.threads.batch > SERVER_BATCH_MAX)
+		ctx->cfg.threads.batch = SERVER_BATCH_MAX;
+	if (!ctx->cfg.load.send_iov)
+		ctx->cfg.load.send_iov = 1;
+	if (ctx->cfg.load.send_iov > SERVER_SEND_IOV_MAX)
+		ctx->cfg.load.send_iov = SERVER_SEND_IOV_MAX;
+
+	if (size_buffer_pools(ctx)) {
+		debug("bad buffer pool setup");
+		goto out_cleanup;
+	}
+
+	if (setup_compute_load(ctx)) {
+		debug("bad compute load setup");
+		goto out_cleanup;
+	}
+
+	// Key-value store for GET/PUT requests
+	if (setup_server_kv(ctx)) {
+		perror("setup_server_kv");
+		goto out_cleanup;
+	}
+
+	// The TSC is calibrated by setup_compute_load()
+	ctx->io.send_delay = ns_to_tsc(ctx->cfg.load.send_delay * 1000UL);
+
 	if (setup_server_io(ctx)) {
 		perror("setup_server_io");
 		goto out_cleanup;
@@ -298,6 +860,46 @@ struct server_context_t *create_server(struct server_config_t *cfg) {
 		goto out_cleanup;
 	}
 
+	// Per-thread buffer caches
+	if (setup_server_caches(ctx)) {
+		perror("setup_server_caches");
+		goto out_cleanup;
+	}
+
+	if (ctx->io.engine == IO_ENGINE_URING && setup_server_uring(ctx)) {
+		perror("setup_server_uring");
+		goto out_cleanup;
+	}
+
+	// Doorbells for parked compute and submit threads
+	if (setup_server_doorbells(ctx)) {
+		perror("setup_server_doorbells");
+		goto out_cleanup;
+	}
+
+	// Per-thread counters
+	if (setup_server_stats(ctx)) {
+		perror("setup_server_stats");
+		goto out_cleanup;
+	}
+
+	if (setup_server_stats_socket(ctx)) {
+		perror("setup_server_stats_socket");
+		goto out_cleanup;
+	}
+
+	// Per-request stage latency histograms
+	if (setup_server_traces(ctx)) {
+		perror("setup_server_traces");
+		goto out_cleanup;
+	}
+
+	// Per-thread syscall counts and cycles
+	if (setup_server_syscall_stats(ctx)) {
+		perror("setup_server_syscall_stats");
+		goto out_cleanup;
+	}
+
 	// Spawn threads
 	if (spawn_server_threads(ctx)) {
 		perror("spawn_server_threads");
@@ -325,13 +927,32 @@ static void cleanup_server_threads(struct server_context_t *ctx) {
 		thread_group_join(ctx->threads.accept, NULL);
 	if (ctx->threads.compute)
 		thread_group_join(ctx->threads.compute, NULL);
+	if (ctx->threads.stats)
+		thread_join(ctx->threads.stats);
+	// Last, the threads above may post syscalls until they are done
+	if (ctx->threads.executor) {
+		syscall_executor.enabled = 0;
+		__atomic_store_n(&syscall_executor.stop, 1, __ATOMIC_RELEASE);
+		doorbell_wake(&syscall_executor.db);
+		thread_join(ctx->threads.executor);
+	}
 }
 
 int destroy_server(struct server_context_t *ctx) {
 	ctx->stopping = 1;
 	cleanup_server_threads(ctx);
+	cleanup_server_syscall_stats(ctx);
+	if (ctx->io.engine == IO_ENGINE_URING)
+		cleanup_server_uring(ctx);
+	cleanup_server_caches(ctx);
+	cleanup_server_traces(ctx);
+	cleanup_server_stats(ctx);
+	cleanup_server_doorbells(ctx);
+	kv_destroy(ctx->load.kv);
+	cleanup_compute_load(ctx);
 	free_server_prealloc(ctx);
 	cleanup_server_queues(ctx);
+	cleanup_server_stats_socket(ctx);
 	cleanup_server_io(ctx);
 	free(ctx);
 	return 0;
@@ -351,6 +972,8 @@ static void sigint_handler(int signr) {
 
 int run_server(struct server_config_t *cfg) {
 	struct server_context_t *ctx = create_server(cfg);
+	if (!ctx)
+		return 1;
 	stop = &ctx->stopping;	
 	signal(SIGINT, sigint_handler);
 	while (!ctx->stopping) {
@@ -377,7 +1000,7 @@ int main(int argc, char **argv) {
 
 	if (
 		!kerncall_avail &&
-		(cfg.kerncall.accept || cfg.kerncall.io || cfg.kerncall.submit)
+		(cfg.kerncall.accept || cfg.kerncall.io || cfg.kerncall.submit || cfg.kerncall.executor)
 	) {
 		debug("warning: kerncall requested but not available");
 	}
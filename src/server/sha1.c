@@ -0,0 +1,477 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <immintrin.h>
+#include <openssl/sha.h>
+
+#define NEED_DEBUG 1
+#include "include/debug.h"
+#include "include/sha1.h"
+
+#define SHA1_K0	0x5a827999
+#define SHA1_K1	0x6ed9eba1
+#define SHA1_K2	0x8f1bbcdc
+#define SHA1_K3	0xca62c1d6
+
+static const uint32_t sha1_init_state[5] = {
+	0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0,
+};
+
+static inline uint32_t load_be32(const unsigned char *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof (v));
+	return __builtin_bswap32(v);
+}
+
+static inline void store_be32(unsigned char *p, uint32_t v) {
+	v = __builtin_bswap32(v);
+	memcpy(p, &v, sizeof (v));
+}
+
+/*
+ * Build the final one or two padded blocks of a len byte message, whose
+ * last partial block is at rest, into tail (128 bytes). Returns the number
+ * of tail blocks.
+ */
+static unsigned int sha1_pad(unsigned char *tail, const unsigned char *rest, uint64_t len) {
+	size_t rem = len % SHA1_BLOCK_LEN;
+	unsigned int blocks = rem + 9 > SHA1_BLOCK_LEN ? 2 : 1;
+	uint64_t bits = len * 8;
+
+	memset(tail, 0, 2 * SHA1_BLOCK_LEN);
+	memcpy(tail, rest, rem);
+	tail[rem] = 0x80;
+	store_be32(tail + blocks * SHA1_BLOCK_LEN - 8, bits >> 32);
+	store_be32(tail + blocks * SHA1_BLOCK_LEN - 4, bits);
+	return blocks;
+}
+
+static unsigned int sha1_pad_tail(unsigned char *tail, const unsigned char *data, size_t len) {
+	return sha1_pad(tail, data + len - len % SHA1_BLOCK_LEN, len);
+}
+
+static void sha1_store_digest(unsigned char *digest, const uint32_t state[5]) {
+	for (unsigned int i = 0; i < 5; i++)
+		store_be32(digest + 4 * i, state[i]);
+}
+
+/* OpenSSL, one message at a time: what the compute stage always did */
+
+static int sha1_openssl_supported(void) {
+	return 1;
+}
+
+static void sha1_openssl_multi(
+	const unsigned char *const data[],
+	size_t len,
+	unsigned char *const digest[],
+	unsigned int n
+) {
+	for (unsigned int i = 0; i < n; i++)
+		SHA1(data[i], len, digest[i]);
+}
+
+/* Portable C */
+
+#define ROL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void sha1_scalar_blocks(uint32_t state[5], const unsigned char *p, size_t blocks) {
+	uint32_t w[16];
+
+	while (blocks--) {
+		uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+		for (unsigned int t = 0; t < 80; t++) {
+			uint32_t f, k;
+			if (t < 16) {
+				w[t] = load_be32(p + 4 * t);
+			} else {
+				uint32_t x = w[(t - 3) & 15] ^ w[(t - 8) & 15] ^ w[(t - 14) & 15] ^ w[t & 15];
+				w[t & 15] = ROL32(x, 1);
+			}
+			if (t < 20) {
+				f = d ^ (b & (c ^ d));
+				k = SHA1_K0;
+			} else if (t < 40) {
+				f = b ^ c ^ d;
+				k = SHA1_K1;
+			} else if (t < 60) {
+				f = (b & c) | (d & (b | c));
+				k = SHA1_K2;
+			} else {
+				f = b ^ c ^ d;
+				k = SHA1_K3;
+			}
+			uint32_t tmp = ROL32(a, 5) + f + e + k + w[t & 15];
+			e = d;
+			d = c;
+			c = ROL32(b, 30);
+			b = a;
+			a = tmp;
+		}
+		state[0] += a;
+		state[1] += b;
+		state[2] += c;
+		state[3] += d;
+		state[4] += e;
+		p += SHA1_BLOCK_LEN;
+	}
+}
+
+static int sha1_scalar_supported(void) {
+	return 1;
+}
+
+static void sha1_scalar_multi(
+	const unsigned char *const data[],
+	size_t len,
+	unsigned char *const digest[],
+	unsigned int n
+) {
+	unsigned char tail[2 * SHA1_BLOCK_LEN];
+
+	for (unsigned int i = 0; i < n; i++) {
+		uint32_t state[5];
+		memcpy(state, sha1_init_state, sizeof (state));
+		sha1_scalar_blocks(state, data[i], len / SHA1_BLOCK_LEN);
+		unsigned int blocks = sha1_pad_tail(tail, data[i], len);
+		sha1_scalar_blocks(state, tail, blocks);
+		sha1_store_digest(digest[i], state);
+	}
+}
+
+/* SHA extensions, one message at a time */
+
+/*
+ * Four rounds per group g. Message words for g >= 4 are derived from the
+ * previous four groups, kept in a ring of four vectors.
+ */
+#define SHANI_GROUP(g, f) do {								\
+	if (g >= 4)									\
+		w[g % 4] = _mm_sha1msg2_epu32(						\
+			_mm_xor_si128(_mm_sha1msg1_epu32(w[g % 4], w[(g + 1) % 4]),	\
+				      w[(g + 2) % 4]),					\
+			w[(g + 3) % 4]);						\
+	e = g ? _mm_sha1nexte_epu32(prev, w[g % 4]) : _mm_add_epi32(e, w[0]);		\
+	prev = abcd;									\
+	abcd = _mm_sha1rnds4_epu32(abcd, e, f);					\
+} while (0)
+
+__attribute__((target("sha,sse4.1")))
+static void sha1_shani_blocks(uint32_t state[5], const unsigned char *p, size_t blocks) {
+	const __m128i mask = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+	__m128i abcd = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i *) state), 0x1b);
+	__m128i e0 = _mm_set_epi32(state[4], 0, 0, 0);
+
+	while (blocks--) {
+		__m128i abcd_save = abcd, e0_save = e0;
+		__m128i w[4], e = e0, prev;
+
+		for (unsigned int i = 0; i < 4; i++)
+			w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i *) (p + 16 * i)), mask);
+
+		SHANI_GROUP(0, 0);  SHANI_GROUP(1, 0);  SHANI_GROUP(2, 0);  SHANI_GROUP(3, 0);
+		SHANI_GROUP(4, 0);  SHANI_GROUP(5, 1);  SHANI_GROUP(6, 1);  SHANI_GROUP(7, 1);
+		SHANI_GROUP(8, 1);  SHANI_GROUP(9, 1);  SHANI_GROUP(10, 2); SHANI_GROUP(11, 2);
+		SHANI_GROUP(12, 2); SHANI_GROUP(13, 2); SHANI_GROUP(14, 2); SHANI_GROUP(15, 3);
+		SHANI_GROUP(16, 3); SHANI_GROUP(17, 3); SHANI_GROUP(18, 3); SHANI_GROUP(19, 3);
+
+		e0 = _mm_sha1nexte_epu32(prev, e0_save);
+		abcd = _mm_add_epi32(abcd, abcd_save);
+		p += SHA1_BLOCK_LEN;
+	}
+
+	_mm_storeu_si128((__m128i *) state, _mm_shuffle_epi32(abcd, 0x1b));
+	state[4] = _mm_extract_epi32(e0, 3);
+}
+
+static int sha1_shani_supported(void) {
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sha") && __builtin_cpu_supports("sse4.1");
+}
+
+__attribute__((target("sha,sse4.1")))
+static void sha1_shani_multi(
+	const unsigned char *const data[],
+	size_t len,
+	unsigned char *const digest[],
+	unsigned int n
+) {
+	unsigned char tail[2 * SHA1_BLOCK_LEN];
+
+	for (unsigned int i = 0; i < n; i++) {
+		uint32_t state[5];
+		memcpy(state, sha1_init_state, sizeof (state));
+		sha1_shani_blocks(state, data[i], len / SHA1_BLOCK_LEN);
+		unsigned int blocks = sha1_pad_tail(tail, data[i], len);
+		sha1_shani_blocks(state, tail, blocks);
+		sha1_store_digest(digest[i], state);
+	}
+}
+
+/* AVX2, eight messages per pass, one per 32-bit lane */
+
+#define V_ROL(x, n) _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - (n)))
+
+#define AVX2_ROUND(t, f, k) do {							\
+	if (t >= 16)									\
+		w[t & 15] = V_ROL(_mm256_xor_si256(					\
+			_mm256_xor_si256(w[(t - 3) & 15], w[(t - 8) & 15]),		\
+			_mm256_xor_si256(w[(t - 14) & 15], w[t & 15])), 1);		\
+	__m256i tmp = _mm256_add_epi32(							\
+		_mm256_add_epi32(V_ROL(a, 5), f),					\
+		_mm256_add_epi32(_mm256_add_epi32(e, k), w[t & 15]));			\
+	e = d;										\
+	d = c;										\
+	c = V_ROL(b, 30);								\
+	b = a;										\
+	a = tmp;									\
+} while (0)
+
+#define AVX2_F0 _mm256_xor_si256(d, _mm256_and_si256(b, _mm256_xor_si256(c, d)))
+#define AVX2_F1 _mm256_xor_si256(_mm256_xor_si256(b, c), d)
+#define AVX2_F2 _mm256_or_si256(_mm256_and_si256(b, c), _mm256_and_si256(d, _mm256_or_si256(b, c)))
+
+__attribute__((target("avx2")))
+static void sha1_avx2_blocks(__m256i state[5], const unsigned char *const p[SHA1_AVX2_LANES], size_t blocks) {
+	const __m256i k0 = _mm256_set1_epi32(SHA1_K0);
+	const __m256i k1 = _mm256_set1_epi32(SHA1_K1);
+	const __m256i k2 = _mm256_set1_epi32(SHA1_K2);
+	const __m256i k3 = _mm256_set1_epi32(SHA1_K3);
+
+	for (size_t blk = 0; blk < blocks; blk++) {
+		__m256i w[16];
+		__m256i a = state[0], b = state[1], c = state[2], d = state[3], e = state[4];
+		size_t off = blk * SHA1_BLOCK_LEN;
+
+		// Transpose: vector t holds word t of every lane's block
+		for (unsigned int t = 0; t < 16; t++)
+			w[t] = _mm256_set_epi32(
+				load_be32(p[7] + off + 4 * t), load_be32(p[6] + off + 4 * t),
+				load_be32(p[5] + off + 4 * t), load_be32(p[4] + off + 4 * t),
+				load_be32(p[3] + off + 4 * t), load_be32(p[2] + off + 4 * t),
+				load_be32(p[1] + off + 4 * t), load_be32(p[0] + off + 4 * t));
+
+		for (unsigned int t = 0; t < 20; t++)
+			AVX2_ROUND(t, AVX2_F0, k0);
+		for (unsigned int t = 20; t < 40; t++)
+			AVX2_ROUND(t, AVX2_F1, k1);
+		for (unsigned int t = 40; t < 60; t++)
+			AVX2_ROUND(t, AVX2_F2, k2);
+		for (unsigned int t = 60; t < 80; t++)
+			AVX2_ROUND(t, AVX2_F1, k3);
+
+		state[0] = _mm256_add_epi32(state[0], a);
+		state[1] = _mm256_add_epi32(state[1], b);
+		state[2] = _mm256_add_epi32(state[2], c);
+		state[3] = _mm256_add_epi32(state[3], d);
+		state[4] = _mm256_add_epi32(state[4], e);
+	}
+}
+
+static int sha1_avx2_supported(void) {
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+
+/*
+ * A pass costs the same however many lanes are busy; below this many
+ * messages hashing them one by one with SHA-NI is cheaper.
+ */
+#define SHA1_AVX2_MIN_LANES	6
+
+/* Up to SHA1_AVX2_LANES messages; idle lanes repeat the first message */
+__attribute__((target("avx2")))
+static void sha1_avx2_pass(
+	const unsigned char *const data[],
+	size_t len,
+	unsigned char *const digest[],
+	unsigned int n
+) {
+	unsigned char tails[SHA1_AVX2_LANES][2 * SHA1_BLOCK_LEN];
+	const unsigned char *p[SHA1_AVX2_LANES];
+	uint32_t out[5][SHA1_AVX2_LANES];
+	__m256i state[5];
+	unsigned int tail_blocks = 0;
+
+	for (unsigned int i = 0; i < 5; i++)
+		state[i] = _mm256_set1_epi32(sha1_init_state[i]);
+
+	for (unsigned int l = 0; l < SHA1_AVX2_LANES; l++)
+		p[l] = data[l < n ? l : 0];
+	sha1_avx2_blocks(state, p, len / SHA1_BLOCK_LEN);
+
+	for (unsigned int l = 0; l < SHA1_AVX2_LANES; l++) {
+		tail_blocks = sha1_pad_tail(tails[l], p[l], len);
+		p[l] = tails[l];
+	}
+	sha1_avx2_blocks(state, p, tail_blocks);
+
+	for (unsigned int i = 0; i < 5; i++)
+		_mm256_storeu_si256((__m256i *) out[i], state[i]);
+	for (unsigned int l = 0; l < n; l++)
+		for (unsigned int i = 0; i < 5; i++)
+			store_be32(digest[l] + 4 * i, out[i][l]);
+}
+
+static void sha1_avx2_multi(
+	const unsigned char *const data[],
+	size_t len,
+	unsigned char *const digest[],
+	unsigned int n
+) {
+	while (n >= SHA1_AVX2_MIN_LANES) {
+		unsigned int chunk = n < SHA1_AVX2_LANES ? n : SHA1_AVX2_LANES;
+		sha1_avx2_pass(data, len, digest, chunk);
+		data += chunk;
+		digest += chunk;
+		n -= chunk;
+	}
+	if (n) {
+		if (sha1_shani_supported())
+			sha1_shani_multi(data, len, digest, n);
+		else
+			sha1_scalar_multi(data, len, digest, n);
+	}
+}
+
+/* Incremental hashing, one message at a time with SHA-NI or portable C */
+
+static void (*sha1_stream_blocks)(uint32_t state[5], const unsigned char *p, size_t blocks) = sha1_scalar_blocks;
+
+void sha1_init(struct sha1_ctx_t *c) {
+	memcpy(c->state, sha1_init_state, sizeof (c->state));
+	c->len = 0;
+}
+
+void sha1_update(struct sha1_ctx_t *c, const unsigned char *p, size_t len) {
+	size_t fill = c->len % SHA1_BLOCK_LEN;
+
+	c->len += len;
+	if (fill) {
+		size_t n = SHA1_BLOCK_LEN - fill;
+		if (n > len)
+			n = len;
+		memcpy(c->buf + fill, p, n);
+		p += n;
+		len -= n;
+		if (fill + n < SHA1_BLOCK_LEN)
+			return;
+		sha1_stream_blocks(c->state, c->buf, 1);
+	}
+	if (len >= SHA1_BLOCK_LEN) {
+		sha1_stream_blocks(c->state, p, len / SHA1_BLOCK_LEN);
+		p += len & ~(size_t) (SHA1_BLOCK_LEN - 1);
+		len %= SHA1_BLOCK_LEN;
+	}
+	memcpy(c->buf, p, len);
+}
+
+void sha1_final(struct sha1_ctx_t *c, unsigned char *digest) {
+	unsigned char tail[2 * SHA1_BLOCK_LEN];
+	unsigned int blocks = sha1_pad(tail, c->buf, c->len);
+
+	sha1_stream_blocks(c->state, tail, blocks);
+	sha1_store_digest(digest, c->state);
+}
+
+/* Feed the self-test message in uneven pieces that straddle blocks */
+static int sha1_stream_selftest(const unsigned char *data, size_t len) {
+	unsigned char ref[SHA1_DIGEST_LEN], digest[SHA1_DIGEST_LEN];
+	struct sha1_ctx_t c;
+	size_t off = 0, piece = 1;
+
+	sha1_init(&c);
+	while (off < len) {
+		size_t n = piece < len - off ? piece : len - off;
+		sha1_update(&c, data + off, n);
+		off += n;
+		piece = piece * 3 + 7;
+	}
+	sha1_final(&c, digest);
+	SHA1(data, len, ref);
+	if (memcmp(ref, digest, SHA1_DIGEST_LEN)) {
+		debug("sha1: incremental mismatch on length %zu", len);
+		return -1;
+	}
+	return 0;
+}
+
+/* Fastest first: "auto" takes the first supported entry */
+static const struct sha1_kernel_t sha1_kernels[] = {
+	{ "avx2", sha1_avx2_supported, sha1_avx2_multi },
+	{ "shani", sha1_shani_supported, sha1_shani_multi },
+	{ "openssl", sha1_openssl_supported, sha1_openssl_multi },
+	{ "scalar", sha1_scalar_supported, sha1_scalar_multi },
+};
+
+#define NR_SHA1_KERNELS (sizeof (sha1_kernels) / sizeof (sha1_kernels[0]))
+
+sha1_multi_fn sha1_multi = sha1_openssl_multi;
+static const char *sha1_selected_name = "openssl";
+
+#define SHA1_SELFTEST_MSGS	(SHA1_AVX2_LANES + 3)
+#define SHA1_SELFTEST_LEN	1020
+
+static int sha1_selftest(const struct sha1_kernel_t *kernel) {
+	static unsigned char msgs[SHA1_SELFTEST_MSGS][SHA1_SELFTEST_LEN];
+	unsigned char digests[SHA1_SELFTEST_MSGS][SHA1_DIGEST_LEN];
+	const unsigned char *data[SHA1_SELFTEST_MSGS];
+	unsigned char *out[SHA1_SELFTEST_MSGS];
+
+	for (unsigned int i = 0; i < SHA1_SELFTEST_MSGS; i++) {
+		for (unsigned int j = 0; j < SHA1_SELFTEST_LEN; j++)
+			msgs[i][j] = i * 31 + j * 7;
+		data[i] = msgs[i];
+		out[i] = digests[i];
+	}
+	// Lengths around the one/two tail block boundary
+	static const size_t lens[] = { 0, 55, 56, 64, 119, SHA1_SELFTEST_LEN };
+	for (unsigned int l = 0; l < sizeof (lens) / sizeof (lens[0]); l++) {
+		if (sha1_stream_selftest(data[0], lens[l]))
+			return -1;
+		kernel->hash(data, lens[l], out, SHA1_SELFTEST_MSGS);
+		for (unsigned int i = 0; i < SHA1_SELFTEST_MSGS; i++) {
+			unsigned char ref[SHA1_DIGEST_LEN];
+			SHA1(data[i], lens[l], ref);
+			if (memcmp(ref, digests[i], SHA1_DIGEST_LEN)) {
+				debug("sha1: %s mismatch on message %u of length %zu", kernel->name, i, lens[l]);
+				return -1;
+			}
+		}
+	}
+	return 0;
+}
+
+int sha1_select(const char *name) {
+	int any = !strcmp(name, "auto");
+
+	if (sha1_shani_supported())
+		sha1_stream_blocks = sha1_shani_blocks;
+
+	for (unsigned int i = 0; i < NR_SHA1_KERNELS; i++) {
+		const struct sha1_kernel_t *kernel = &sha1_kernels[i];
+		if (!any && strcmp(name, kernel->name))
+			continue;
+		if (!kernel->supported()) {
+			if (any)
+				continue;
+			debug("sha1: %s is not supported by this CPU", name);
+			return -1;
+		}
+		if (sha1_selftest(kernel)) {
+			if (any)
+				continue;
+			return -1;
+		}
+		sha1_multi = kernel->hash;
+		sha1_selected_name = kernel->name;
+		debug("sha1: using %s", kernel->name);
+		return 0;
+	}
+	debug("sha1: unknown kernel %s", name);
+	return -1;
+}
+
+const char *sha1_selected(void) {
+	return sha1_selected_name;
+}
@@ -0,0 +1,240 @@
+#include <sys/socket.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NEED_DEBUG 1
+#include "include/debug.h"
+#include "include/server.h"
+#include "include/syscall_stats.h"
+#include "include/utils.h"
+
+// How often the stats thread checks for shutdown, and waits for a command
+#define STATS_POLL_MSEC	100
+
+#define STATS_CMD_LEN	16
+
+/*
+ * A snapshot of the counters and queue depths, as "key=value" lines or as
+ * one JSON object. Counters are read while the workers keep running, so
+ * values of different threads are not taken at quite the same instant.
+ */
+struct stats_fmt_t {
+	FILE *f;
+	int json;
+	int sections; // sections written so far
+	int items; // items written in the current section
+};
+
+#define stats_load(p)	__atomic_load_n(p, __ATOMIC_RELAXED)
+
+static void stats_section(struct stats_fmt_t *fmt, const char *name) {
+	if (fmt->json)
+		fprintf(fmt->f, "%s\"%s\":[", fmt->sections ? "]," : "", name);
+	fmt->sections++;
+	fmt->items = 0;
+}
+
+static void stats_item(struct stats_fmt_t *fmt, const char *name, unsigned int idx) {
+	if (fmt->json)
+		fprintf(fmt->f, "%s{", fmt->items ? "}," : "");
+	else
+		fprintf(fmt->f, "%s%s:%u", fmt->items ? "\n" : "", name, idx);
+	fmt->items++;
+}
+
+/* Close the last item of a section */
+static void stats_item_end(struct stats_fmt_t *fmt) {
+	if (!fmt->items)
+		return;
+	fprintf(fmt->f, fmt->json ? "}" : "\n");
+	fmt->items = 0;
+}
+
+static void stats_value(struct stats_fmt_t *fmt, int first, const char *key, unsigned long value) {
+	if (fmt->json)
+		fprintf(fmt->f, "%s\"%s\":%lu", first ? "" : ",", key, value);
+	else
+		fprintf(fmt->f, " %s=%lu", key, value);
+}
+
+static void stats_string(struct stats_fmt_t *fmt, int first, const char *key, const char *value) {
+	if (fmt->json)
+		fprintf(fmt->f, "%s\"%s\":\"%s\"", first ? "" : ",", key, value);
+	else
+		fprintf(fmt->f, " %s=%s", key, value);
+}
+
+/* One item per thread, syscall and path that has been used */
+static void stats_write_syscalls(struct stats_fmt_t *fmt) {
+	unsigned int nr = stats_load(&syscall_stats_nr), item = 0;
+
+	if (nr > SYSCALL_STATS_MAX_THREADS)
+		nr = SYSCALL_STATS_MAX_THREADS;
+	stats_section(fmt, "syscalls");
+	for (unsigned int i = 0; i < nr; i++) {
+		struct syscall_stats_t *stats = __atomic_load_n(&syscall_stats[i], __ATOMIC_ACQUIRE);
+		if (!stats)
+			continue;
+		for (unsigned int slot = 0; slot < SYSCALL_SLOTS; slot++) {
+			for (unsigned int path = 0; path < SYSCALL_PATHS; path++) {
+				struct syscall_stat_t *stat = &stats->calls[slot][path];
+				uint64_t count = stats_load(&stat->count);
+				if (!count)
+					continue;
+				stats_item(fmt, "syscalls", item++);
+				stats_string(fmt, 1, "thread", stats->name);
+				stats_string(fmt, 0, "call", syscall_slot_names[slot]);
+				stats_string(fmt, 0, "path", syscall_path_names[path]);
+				stats_value(fmt, 0, "count", count);
+				stats_value(fmt, 0, "cycles", stats_load(&stat->cycles));
+				stats_value(fmt, 0, "p50", hist_percentile(&stat->hist, 50));
+				stats_value(fmt, 0, "p99", hist_percentile(&stat->hist, 99));
+			}
+		}
+	}
+	stats_item_end(fmt);
+}
+
+static void stats_write(struct server_context_t *ctx, FILE *f, int json) {
+	struct stats_fmt_t fmt = { .f = f, .json = json };
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (json)
+		fprintf(f, "{\"time_ns\":%lu,", as_nanoseconds(&now));
+	else
+		fprintf(f, "time_ns=%lu\n", as_nanoseconds(&now));
+
+	stats_section(&fmt, "io");
+	for (unsigned int i = 0; i < ctx->cfg.threads.io; i++) {
+		struct io_stats_t *stats = &ctx->io_stats[i];
+		stats_item(&fmt, "io", i);
+		stats_value(&fmt, 1, "received", stats_load(&stats->received));
+		stats_value(&fmt, 0, "responses", stats_load(&stats->responses));
+		stats_value(&fmt, 0, "sends", stats_load(&stats->sends));
+		stats_value(&fmt, 0, "loops", stats_load(&stats->loops));
+	}
+	stats_item_end(&fmt);
+
+	if (ctx->mode == SERVER_MODE_STAGED) {
+		stats_section(&fmt, "compute");
+		for (unsigned int i = 0; i < ctx->cfg.threads.compute; i++) {
+			struct compute_stats_t *stats = &ctx->compute_stats[i];
+			stats_item(&fmt, "compute", i);
+			stats_value(&fmt, 1, "executed", stats_load(&stats->executed));
+			stats_value(&fmt, 0, "stolen", stats_load(&stats->stolen));
+			stats_value(&fmt, 0, "batches", stats_load(&stats->batches));
+			stats_value(&fmt, 0, "loops", stats_load(&stats->loops));
+			stats_value(&fmt, 0, "inbox", queue_depth(ctx->queues.compute_inbox[i]));
+		}
+		stats_item_end(&fmt);
+
+		stats_section(&fmt, "submit");
+		for (unsigned int i = 0; i < ctx->cfg.threads.submit; i++) {
+			struct submit_stats_t *stats = &ctx->submit_stats[i];
+			stats_item(&fmt, "submit", i);
+			stats_value(&fmt, 1, "submitted", stats_load(&stats->submitted));
+			stats_value(&fmt, 0, "loops", stats_load(&stats->loops));
+			stats_value(&fmt, 0, "inbox", queue_depth(ctx->queues.submitter_inbox[i]));
+		}
+		stats_item_end(&fmt);
+	}
+
+	// Buffers parked in per-thread caches do not show as free
+	stats_section(&fmt, "buffers");
+	for (unsigned int cls = 0; cls < ctx->nr_pools; cls++) {
+		stats_item(&fmt, "buffers", cls);
+		stats_value(&fmt, 1, "size", ctx->pools[cls].size);
+		stats_value(&fmt, 0, "total", ctx->pools[cls].nr);
+		stats_value(&fmt, 0, "free", queue_depth(ctx->pools[cls].empty));
+	}
+	stats_item_end(&fmt);
+
+	stats_section(&fmt, "sessions");
+	stats_item(&fmt, "sessions", 0);
+	stats_value(&fmt, 1, "accepted", stats_load(&ctx->io.next));
+	stats_value(&fmt, 0, "total", ctx->cfg.alloc.sessions);
+	stats_value(&fmt, 0, "free", queue_depth(ctx->queues.empty_connections));
+	stats_item_end(&fmt);
+
+	if (syscall_stats_enabled)
+		stats_write_syscalls(&fmt);
+
+	if (json)
+		fprintf(f, "]}\n");
+}
+
+/* Answer one client: an optional "text" or "json" command, then the snapshot */
+static void stats_serve(struct server_context_t *ctx, int fd) {
+	char cmd[STATS_CMD_LEN] = "";
+	struct pollfd pfd = {
+		.fd = fd,
+		.events = POLLIN,
+	};
+
+	if (poll(&pfd, 1, STATS_POLL_MSEC) == 1) {
+		ssize_t len = recv(fd, cmd, sizeof (cmd) - 1, MSG_DONTWAIT);
+		cmd[len > 0 ? len : 0] = '\0';
+	}
+	FILE *f = fdopen(fd, "w");
+	if (!f) {
+		perror("fdopen");
+		close(fd);
+		return;
+	}
+	stats_write(ctx, f, !strncmp(cmd, "json", 4));
+	fclose(f);
+}
+
+void *stats_worker(void *opaque, struct thread_info_t *ti) {
+	struct server_context_t *ctx = opaque;
+	struct pollfd pfd = {
+		.fd = ctx->io.stats_fd,
+		.events = POLLIN,
+	};
+
+	(void) ti;
+	while (!ctx->stopping) {
+		int ret = poll(&pfd, 1, STATS_POLL_MSEC);
+		if (ret == -1 && errno != EINTR) {
+			perror("poll");
+			return (void *) -1L;
+		}
+		if (ret != 1)
+			continue;
+		int fd = accept(ctx->io.stats_fd, NULL, NULL);
+		if (fd < 0) {
+			perror("accept");
+			continue;
+		}
+		stats_serve(ctx, fd);
+	}
+	return NULL;
+}
+
+int setup_server_stats_socket(struct server_context_t *ctx) {
+	char *path = ctx->cfg.stats_path;
+
+	if (!strcmp(path, "none"))
+		return 0;
+	if (!*path && snprintf(path, MAX_PATH_LEN, "%s.stats", ctx->cfg.socket_path) >= MAX_PATH_LEN) {
+		debug("stats: socket_path too long");
+		return -1;
+	}
+	ctx->io.stats_fd = bind_sock(path);
+	if (ctx->io.stats_fd < 0)
+		return -1;
+	debug("stats: listening on %s", path);
+	return 0;
+}
+
+void cleanup_server_stats_socket(struct server_context_t *ctx) {
+	if (ctx->io.stats_fd < 0)
+		return;
+	close(ctx->io.stats_fd);
+	unlink(ctx->cfg.stats_path);
+}
@@ -2,6 +2,9 @@
 #include <sys/un.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <cpuid.h>
+
+#include "include/utils.h"
 
 int bind_sock(const char *path) {
 	int fd = socket(PF_UNIX, SOCK_STREAM, 0);
@@ -27,3 +30,36 @@ int bind_sock(const char *path) {
 	}
 	return fd;
 }
+
+#define TSC_CALIBRATE_NSEC	20000000UL
+
+struct tsc_clock_t tsc_clock;
+
+static int tsc_invariant(void) {
+	unsigned int eax, ebx, ecx, edx;
+	if (!__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+		return 0;
+	return !!(edx & (1 << 8));
+}
+
+int tsc_init(void) {
+	if (tsc_clock.init)
+		return 0;
+	if (!tsc_invariant())
+		fprintf(stderr, "tsc: no invariant TSC, timings may drift with frequency changes\n");
+
+	uint64_t start_ns = cur_nanoseconds();
+	uint64_t start_tsc = rdtsc();
+	uint64_t now_ns;
+	do {
+		now_ns = cur_nanoseconds();
+	} while (now_ns - start_ns < TSC_CALIBRATE_NSEC);
+	uint64_t ticks = rdtsc() - start_tsc;
+	if (!ticks)
+		return -1;
+
+	tsc_clock.ticks_per_ns = (double) ticks / (now_ns - start_ns);
+	tsc_clock.ns_mult = (double) (1ULL << TSC_SHIFT) / tsc_clock.ticks_per_ns;
+	tsc_clock.init = 1;
+	return 0;
+}